@@ -0,0 +1,375 @@
+#include "wardenclyffe/android/audio/audio.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// libbase has CHECK macros that conflict with stagefright's ADebug.h
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wmacro-redefined"
+#include <android-base/logging.h>
+#pragma clang diagnostic pop
+
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <media/MediaCodecBuffer.h>
+#include <media/stagefright/MediaCodec.h>
+#include <media/stagefright/MediaCodecConstants.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+using namespace android;
+
+static constexpr const char* kOpusMimeType = "audio/opus";
+
+std::string AudioConfig::Key() const {
+  return android::base::StringPrintf("%s:%d", codec.c_str(), bitrate);
+}
+
+bool AudioConfig::Parse(std::string_view option) {
+  std::string key(option.substr(0, option.find('=')));
+  std::string value(option.substr(std::min(option.size(), key.size() + 1)));
+  if (key == "bitrate") {
+    // Opus' own limits.
+    return android::base::ParseInt(value, &bitrate, 6'000, 510'000);
+  }
+  return false;
+}
+
+static std::mutex pipelines_mutex;
+static std::map<std::string, std::weak_ptr<AudioSocket>> pipelines GUARDED_BY(pipelines_mutex);
+
+Socket* AudioSocket::Create(std::string_view path) {
+  std::vector<std::string> options;
+  if (size_t query_start = path.find('?'); query_start != std::string_view::npos) {
+    options = android::base::Split(std::string(path.substr(query_start + 1)), "&");
+    path = path.substr(0, query_start);
+  }
+
+  AudioConfig config;
+  if (path == "opus" || path == "opus/") {
+    config.codec = "opus";
+  } else {
+    LOG(ERROR) << "Unsupported audio codec: " << path;
+    return nullptr;
+  }
+
+  bool binary_header = false;
+  for (const std::string& option : options) {
+    if (option.empty()) {
+      continue;
+    } else if (option == "header=binary") {
+      binary_header = true;
+    } else if (!config.Parse(option)) {
+      LOG(ERROR) << "Invalid audio option '" << option << "'";
+      return nullptr;
+    }
+  }
+
+  std::string key = config.Key();
+  std::lock_guard<std::mutex> lock(pipelines_mutex);
+  std::shared_ptr<AudioSocket> pipeline = pipelines[key].lock();
+  if (pipeline && !pipeline->IsRunning()) {
+    pipeline.reset();
+  }
+
+  if (pipeline) {
+    LOG(INFO) << "Joining existing audio pipeline " << key;
+  } else {
+    LOG(INFO) << "Creating audio pipeline " << key;
+    pipeline = std::make_shared<AudioSocket>(std::move(config));
+    if (!pipeline->Initialize()) {
+      return nullptr;
+    }
+    pipelines[key] = pipeline;
+  }
+
+  return new AudioSubscriber(std::move(pipeline), binary_header);
+}
+
+bool AudioSocket::createEncoder() {
+  looper_ = new ALooper();
+  looper_->setName("wardenclyffe_audio_looper");
+  looper_->start();
+
+  codec_ = MediaCodec::CreateByType(looper_, kOpusMimeType, true);
+  if (!codec_) {
+    LOG(ERROR) << "Failed to create Opus encoder";
+    return false;
+  }
+
+  auto format = sp<AMessage>::make();
+  format->setString(KEY_MIME, kOpusMimeType);
+  format->setInt32(KEY_SAMPLE_RATE, PcmCapture::kSampleRate);
+  format->setInt32(KEY_CHANNEL_COUNT, PcmCapture::kChannelCount);
+  format->setInt32(KEY_PCM_ENCODING, kAudioEncodingPcm16bit);
+  format->setInt32(KEY_BIT_RATE, config_.bitrate);
+  format->setInt32(KEY_MAX_INPUT_SIZE, capture_.period_bytes());
+  format->setInt32(KEY_PRIORITY, 0);
+
+  status_t err = codec_->configure(format, nullptr, nullptr, MediaCodec::CONFIGURE_FLAG_ENCODE);
+  if (err != NO_ERROR) {
+    LOG(ERROR) << "Failed to configure Opus encoder (err = " << err << ")";
+    return false;
+  }
+
+  err = codec_->start();
+  if (err != NO_ERROR) {
+    LOG(ERROR) << "Failed to start Opus encoder (err = " << err << ")";
+    return false;
+  }
+  return true;
+}
+
+bool AudioSocket::Initialize() {
+  if (!createEncoder() || !capture_.Start()) {
+    return false;
+  }
+
+  running_ = true;
+  capture_thread_ = std::thread([this]() { captureLoop(); });
+  encode_thread_ = std::thread([this]() { encodeLoop(); });
+  return true;
+}
+
+void AudioSocket::Destroy() {
+  running_ = false;
+  capture_.Stop();
+  if (capture_thread_.joinable()) {
+    capture_thread_.join();
+  }
+  if (encode_thread_.joinable()) {
+    encode_thread_.join();
+  }
+
+  if (codec_) {
+    codec_->stop();
+    codec_->release();
+    codec_ = nullptr;
+  }
+  if (looper_) {
+    looper_->stop();
+    looper_ = nullptr;
+  }
+}
+
+void AudioSocket::stop() {
+  running_ = false;
+  std::lock_guard<std::mutex> lock(frame_mutex_);
+  for (FrameQueue* queue : subscribers_) {
+    queue->Wake();
+  }
+}
+
+void AudioSocket::captureLoop() {
+  static constexpr int64_t kTimeoutUs = 250'000;
+  while (running_) {
+    size_t index;
+    status_t err = codec_->dequeueInputBuffer(&index, kTimeoutUs);
+    if (err == -EAGAIN) {
+      continue;
+    } else if (err != NO_ERROR) {
+      LOG(ERROR) << "Failed to dequeue encoder input buffer (err = " << err << ")";
+      break;
+    }
+
+    sp<MediaCodecBuffer> buffer;
+    err = codec_->getInputBuffer(index, &buffer);
+    if (err != NO_ERROR || buffer->capacity() < capture_.period_bytes()) {
+      LOG(ERROR) << "Unusable encoder input buffer (err = " << err << ")";
+      break;
+    }
+
+    // Capture straight into the encoder's buffer.
+    std::optional<int64_t> timestamp = capture_.Read(buffer->data());
+    if (!timestamp) {
+      break;
+    }
+
+    err = codec_->queueInputBuffer(index, 0, capture_.period_bytes(), *timestamp, 0);
+    if (err != NO_ERROR) {
+      LOG(ERROR) << "Failed to queue encoder input buffer (err = " << err << ")";
+      break;
+    }
+  }
+
+  LOG(INFO) << "Audio capture stopping";
+  stop();
+}
+
+void AudioSocket::encodeLoop() {
+  // The encoder might split its config across several buffers, so collect them until the first
+  // packet comes out.
+  sp<Frame> pending_config;
+
+  while (running_) {
+    size_t index, offset, size;
+    int64_t pts_usec;
+    uint32_t flags;
+
+    static constexpr int64_t kTimeoutUs = 250'000;
+    status_t err =
+        codec_->dequeueOutputBuffer(&index, &offset, &size, &pts_usec, &flags, kTimeoutUs);
+    if (err == -EAGAIN || err == INFO_FORMAT_CHANGED || err == INFO_OUTPUT_BUFFERS_CHANGED) {
+      continue;
+    } else if (err != NO_ERROR) {
+      LOG(ERROR) << "Failed to dequeue encoder output buffer (err = " << err << ")";
+      break;
+    }
+
+    sp<MediaCodecBuffer> buffer;
+    err = codec_->getOutputBuffer(index, &buffer);
+    if (err != NO_ERROR) {
+      LOG(ERROR) << "Failed to get encoder output buffer (err = " << err << ")";
+      break;
+    }
+
+    if (size != 0) {
+      const char* p = reinterpret_cast<const char*>(buffer->data());
+      if (flags & BUFFER_FLAG_CODEC_CONFIG) {
+        if (!pending_config) {
+          pending_config = frame_pool_->Acquire(size);
+          pending_config->type = FrameType::Description;
+          pending_config->timestamp = pts_usec;
+        }
+        pending_config->data.insert(pending_config->data.end(), p, p + size);
+      } else {
+        sp<Frame> packet = frame_pool_->Acquire(size);
+        packet->type = FrameType::Keyframe;
+        packet->timestamp = pts_usec;
+        packet->data.insert(packet->data.end(), p, p + size);
+        packet->Describe();
+
+        std::lock_guard<std::mutex> lock(frame_mutex_);
+        if (pending_config) {
+          pending_config->sequence = next_sequence_;
+          pending_config->Describe();
+          pending_config->WriteHeader();
+          codec_config_ = std::move(pending_config);
+        }
+        packet->config = codec_config_;
+        pushPacket(std::move(packet));
+      }
+    }
+
+    codec_->releaseOutputBuffer(index);
+    if (flags & BUFFER_FLAG_END_OF_STREAM) {
+      break;
+    }
+  }
+
+  LOG(INFO) << "Audio encoder stopping";
+  stop();
+}
+
+void AudioSocket::pushPacket(sp<Frame> packet) {
+  packet->sequence = next_sequence_++;
+  packet->WriteHeader();
+
+  sp<const Frame> shared = std::move(packet);
+  for (FrameQueue* queue : subscribers_) {
+    // Any packet is a fine place to start, so a reader that's too far behind skips everything it
+    // hasn't read yet, rather than hearing it late.
+    if (queue->size() >= queue->max_queue_depth) {
+      queue->flush_sequence = shared->sequence;
+    }
+    queue->Push(shared);
+  }
+}
+
+void AudioSocket::Subscribe(FrameQueue* queue) {
+  std::lock_guard<std::mutex> lock(frame_mutex_);
+  subscribers_.push_back(queue);
+}
+
+void AudioSocket::Unsubscribe(FrameQueue* queue) {
+  std::lock_guard<std::mutex> lock(frame_mutex_);
+  subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), queue),
+                     subscribers_.end());
+}
+
+AudioSubscriber::AudioSubscriber(std::shared_ptr<AudioSocket> source, bool binary_header)
+    : source_(std::move(source)),
+      binary_header_(binary_header),
+      queue_(android::base::GetUintProperty<size_t>("wardenclyffe.audio.max_queue_depth",
+                                                    kDefaultMaxQueueDepth)) {
+  source_->Subscribe(&queue_);
+}
+
+AudioSubscriber::~AudioSubscriber() {
+  source_->Unsubscribe(&queue_);
+}
+
+void AudioSubscriber::Destroy() {
+  closed_ = true;
+  queue_.Wake();
+}
+
+void AudioSubscriber::appendFrame(const sp<const Frame>& frame) {
+  // The references taken here are released by the reader through wardenclyffe_release_frame.
+  if (binary_header_) {
+    frame->incStrong(nullptr);
+    reads_[read_count_++] = WardenclyffeRead{
+        .data = frame->data.data(),
+        .size = frame->data.size(),
+        .oob = false,
+        .frame = frame.get(),
+    };
+    return;
+  }
+
+  frame->incStrong(nullptr);
+  reads_[read_count_++] = WardenclyffeRead{
+      .data = frame->description,
+      .size = frame->description_size,
+      .oob = true,
+      .frame = frame.get(),
+  };
+
+  frame->incStrong(nullptr);
+  reads_[read_count_++] = WardenclyffeRead{
+      .data = frame->payload(),
+      .size = frame->payload_size(),
+      .oob = false,
+      .frame = frame.get(),
+  };
+}
+
+WardenclyffeReads AudioSubscriber::Read() {
+  WardenclyffeReads result = {.reads = nullptr, .read_count = -1};
+
+  read_count_ = 0;
+
+  sp<const Frame> packet;
+  while (!(packet = queue_.Pop())) {
+    if (closed_) {
+      result.read_count = 0;
+      return result;
+    } else if (!source_->IsRunning()) {
+      return result;
+    }
+    queue_.Wait();
+  }
+
+  size_t packets = 0;
+  do {
+    if (packet->config && packet->config != config_) {
+      config_ = packet->config;
+      appendFrame(config_);
+    }
+    appendFrame(packet);
+  } while (++packets < kMaxPacketsPerRead && (packet = queue_.Pop()));
+
+  result.reads = reads_.data();
+  result.read_count = read_count_;
+  return result;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <media/stagefright/MediaCodec.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/frame.h"
+#include "wardenclyffe/android/frame_queue.h"
+#include "wardenclyffe/android/socket.h"
+#include "wardenclyffe/wardenclyffe.h"
+
+namespace android {
+class AudioRecord;
+}
+
+// Parameters that identify an audio capture+encode pipeline, from the socket's query string, e.g.
+// /audio/opus/?bitrate=64000.
+struct AudioConfig {
+  std::string codec;
+  int32_t bitrate = 128'000;
+
+  std::string Key() const;
+
+  // Apply a "key=value" query parameter. Returns false if it isn't one of ours or is out of range.
+  bool Parse(std::string_view option);
+};
+
+// Captures the device's audio output, as 16-bit interleaved PCM, one fixed-size period at a time.
+struct PcmCapture {
+  static constexpr uint32_t kSampleRate = 48'000;
+  static constexpr uint32_t kChannelCount = 2;
+  static constexpr size_t kBytesPerFrame = kChannelCount * sizeof(int16_t);
+
+  explicit PcmCapture(size_t period_frames) : period_frames_(period_frames) {}
+  ~PcmCapture();
+
+  bool Start();
+
+  // Stop capturing, and unblock Read.
+  void Stop();
+
+  // Fill |buffer| with the next period_bytes() of audio. Returns the time at which its first sample
+  // was captured, in CLOCK_MONOTONIC microseconds like video timestamps, or nullopt on failure.
+  std::optional<int64_t> Read(void* buffer);
+
+  size_t period_bytes() const { return period_frames_ * kBytesPerFrame; }
+
+ private:
+  const size_t period_frames_;
+  android::sp<android::AudioRecord> record_;
+  int64_t frames_read_ = 0;
+};
+
+// A capture+encode pipeline for the device's audio output, shared between every AudioSubscriber
+// reading from it.
+//
+// Audio is captured in kPeriod chunks, which are read straight into the encoder's input buffers.
+// Every packet can be decoded on its own, so readers that fall behind just skip ahead.
+struct AudioSocket {
+  explicit AudioSocket(AudioConfig config)
+      : config_(std::move(config)), capture_(kPeriodFrames) {}
+  ~AudioSocket() { Destroy(); }
+
+  static Socket* Create(std::string_view path);
+
+  // Opus' default frame duration, so that every period turns into exactly one packet.
+  static constexpr std::chrono::milliseconds kPeriod{20};
+  static constexpr size_t kPeriodFrames = PcmCapture::kSampleRate * kPeriod.count() / 1000;
+
+  bool Initialize();
+  void Destroy();
+
+  void Subscribe(FrameQueue* queue) EXCLUDES(frame_mutex_);
+  void Unsubscribe(FrameQueue* queue) EXCLUDES(frame_mutex_);
+
+  bool IsRunning() const { return running_; }
+
+ private:
+  bool createEncoder();
+  void captureLoop();
+  void encodeLoop();
+  void stop();
+
+  void pushPacket(android::sp<Frame> packet) REQUIRES(frame_mutex_);
+
+  const AudioConfig config_;
+  PcmCapture capture_;
+
+  std::shared_ptr<FramePool> frame_pool_ = std::make_shared<FramePool>();
+
+  android::sp<android::ALooper> looper_;
+  android::sp<android::MediaCodec> codec_;
+
+  std::atomic<bool> running_ = false;
+  std::thread capture_thread_;
+  std::thread encode_thread_;
+
+  std::mutex frame_mutex_;
+  std::vector<FrameQueue*> subscribers_ GUARDED_BY(frame_mutex_);
+  uint64_t next_sequence_ GUARDED_BY(frame_mutex_) = 0;
+
+  // The codec config, which every packet refers to.
+  android::sp<const Frame> codec_config_ GUARDED_BY(frame_mutex_);
+};
+
+// A reader of a shared AudioSocket. Each read returns every packet that's ready, up to
+// kMaxPacketsPerRead, so that a reader that wakes up late catches up in one go.
+struct AudioSubscriber : public Socket {
+  // With |binary_header|, each packet is sent as a single read with its FrameHeader in front.
+  // Otherwise, it's preceded by an out-of-band JSON descriptor.
+  AudioSubscriber(std::shared_ptr<AudioSocket> source, bool binary_header);
+  ~AudioSubscriber();
+
+  // Half a second of audio.
+  static constexpr size_t kDefaultMaxQueueDepth = 25;
+  static constexpr size_t kMaxPacketsPerRead = 8;
+
+  virtual void Destroy() override;
+
+  virtual WardenclyffeReads Read() final;
+  virtual bool SupportsRead() final { return true; }
+
+ private:
+  void appendFrame(const android::sp<const Frame>& frame);
+
+  std::shared_ptr<AudioSocket> source_;
+  const bool binary_header_;
+
+  std::atomic<bool> closed_ = false;
+  FrameQueue queue_;
+
+  // The codec config most recently sent to the reader.
+  android::sp<const Frame> config_;
+
+  // Storage backing the most recently returned WardenclyffeReads: up to kMaxPacketsPerRead packets
+  // plus a config, each with a descriptor.
+  std::array<WardenclyffeRead, (kMaxPacketsPerRead + 1) * 2> reads_;
+  size_t read_count_ = 0;
+};
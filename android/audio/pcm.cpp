@@ -0,0 +1,91 @@
+#include "wardenclyffe/android/audio/audio.h"
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <android-base/logging.h>
+#include <android/content/AttributionSourceState.h>
+#include <binder/Binder.h>
+#include <media/AudioRecord.h>
+#include <media/AudioTimestamp.h>
+#include <utils/Errors.h>
+#include <utils/Timers.h>
+
+using namespace android;
+
+PcmCapture::~PcmCapture() {
+  Stop();
+}
+
+bool PcmCapture::Start() {
+  content::AttributionSourceState attribution;
+  attribution.uid = getuid();
+  attribution.pid = getpid();
+  attribution.packageName = "wardenclyffe";
+  attribution.token = sp<BBinder>::make();
+
+  // The remote submix gets a copy of everything that's played, which is what screen recorders
+  // capture too. Reading it as root doesn't need a MediaProjection.
+  record_ = sp<AudioRecord>::make(attribution);
+  status_t rc = record_->set(AUDIO_SOURCE_REMOTE_SUBMIX, kSampleRate, AUDIO_FORMAT_PCM_16_BIT,
+                             AUDIO_CHANNEL_IN_STEREO, period_frames_ * 4 /* frameCount */,
+                             nullptr /* callback */, 0 /* notificationFrames */,
+                             false /* threadCanCallJava */, AUDIO_SESSION_ALLOCATE,
+                             AudioRecord::TRANSFER_SYNC);
+  if (rc != NO_ERROR || record_->initCheck() != NO_ERROR) {
+    LOG(ERROR) << "Failed to create AudioRecord: " << statusToString(rc);
+    record_ = nullptr;
+    return false;
+  }
+
+  rc = record_->start();
+  if (rc != NO_ERROR) {
+    LOG(ERROR) << "Failed to start AudioRecord: " << statusToString(rc);
+    record_ = nullptr;
+    return false;
+  }
+
+  LOG(INFO) << "Audio capture started (latency = " << record_->latency() << " ms)";
+  return true;
+}
+
+void PcmCapture::Stop() {
+  if (record_) {
+    record_->stop();
+  }
+}
+
+std::optional<int64_t> PcmCapture::Read(void* buffer) {
+  uint8_t* p = static_cast<uint8_t*>(buffer);
+  size_t remaining = period_bytes();
+  while (remaining != 0) {
+    ssize_t rc = record_->read(p, remaining, true /* blocking */);
+    if (rc <= 0) {
+      if (record_->stopped()) {
+        LOG(INFO) << "Audio capture stopped";
+      } else {
+        LOG(ERROR) << "AudioRecord::read failed: " << statusToString(rc);
+      }
+      return std::nullopt;
+    }
+    p += rc;
+    remaining -= rc;
+  }
+
+  int64_t first_frame = frames_read_;
+  frames_read_ += period_frames_;
+
+  // AudioRecord knows when some recent frame was captured. Work back from that to the first frame
+  // of this period, instead of trusting the time at which the read happened to return.
+  ExtendedTimestamp timestamp;
+  int64_t position, time_ns;
+  if (record_->getTimestamp(&timestamp) == NO_ERROR &&
+      timestamp.getBestTimestamp(&position, &time_ns, ExtendedTimestamp::TIMEBASE_MONOTONIC) ==
+          NO_ERROR) {
+    time_ns += (first_frame - position) * 1'000'000'000 / kSampleRate;
+  } else {
+    time_ns = systemTime(SYSTEM_TIME_MONOTONIC) -
+              static_cast<int64_t>(period_frames_) * 1'000'000'000 / kSampleRate;
+  }
+  return time_ns / 1000;
+}
@@ -0,0 +1,370 @@
+// Headless benchmark for the capture/encode pipeline.
+//
+// Reads from a socket through the same C API that the server uses, without any of the transport,
+// and reports frame rate, throughput, capture-to-read latency, CPU and memory use once a second and
+// at the end, followed by the pipeline's own per-stage statistics from /stats/. Comparing the
+// results against `wardenclyffe bench` (the WebSocket client) gives the cost of the transport.
+//
+//   wardenclyffe_bench [--duration <seconds>] [--readers <n>] [--synthetic] [<path>]
+//
+// <path> defaults to /video/h264/, and gets header=binary added if it doesn't have it. With
+// --synthetic, a layer is animated on top of the screen for the whole run, so that the encoder sees
+// the same amount of change every time.
+//
+// The run fails if a pipeline ends up holding more capture buffers than it accounts for, which is
+// what a leak looks like long before the display runs out of them. Throttled frames are the usual
+// suspect, so a frame rate well below the screen's is worth checking after touching that path:
+//
+//   wardenclyffe_bench --synthetic --duration 10 '/video/jpeg/?fps=2'
+
+#include <endian.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <binder/ProcessState.h>
+#include <gui/ISurfaceComposerClient.h>
+#include <gui/SurfaceComposerClient.h>
+#include <gui/SurfaceControl.h>
+#include <json/json.h>
+#include <ui/DisplayState.h>
+#include <ui/Rect.h>
+#include <utils/String8.h>
+
+#include "wardenclyffe/android/frame.h"
+#include "wardenclyffe/android/stats.h"
+#include "wardenclyffe/wardenclyffe.h"
+
+using namespace android;
+using namespace std::chrono_literals;
+
+// A solid square bouncing around the screen, on top of everything else.
+struct SyntheticLayer {
+  ~SyntheticLayer() { Stop(); }
+
+  static constexpr int32_t kSize = 256;
+
+  // Pixels per frame.
+  static constexpr int32_t kSpeed = 8;
+
+  bool Start() {
+    std::optional<PhysicalDisplayId> display_id = SurfaceComposerClient::getInternalDisplayId();
+    if (!display_id) {
+      LOG(ERROR) << "Failed to get ID for internal display";
+      return false;
+    }
+
+    ui::DisplayState display_state;
+    sp<IBinder> display = SurfaceComposerClient::getPhysicalDisplayToken(*display_id);
+    if (!display || SurfaceComposerClient::getDisplayState(display, &display_state) != NO_ERROR) {
+      LOG(ERROR) << "Failed to get display state";
+      return false;
+    }
+    width_ = display_state.layerStackSpaceRect.getWidth();
+    height_ = display_state.layerStackSpaceRect.getHeight();
+
+    client_ = sp<SurfaceComposerClient>::make();
+    surface_ = client_->createSurface(String8("wardenclyffe_bench"), kSize, kSize,
+                                      PIXEL_FORMAT_RGBA_8888,
+                                      ISurfaceComposerClient::eFXSurfaceEffect);
+    if (!surface_) {
+      LOG(ERROR) << "Failed to create synthetic layer";
+      return false;
+    }
+
+    SurfaceComposerClient::Transaction()
+        .setLayer(surface_, INT32_MAX)
+        .setColor(surface_, half3(1.0f, 0.0f, 1.0f))
+        .setCrop(surface_, Rect(kSize, kSize))
+        .show(surface_)
+        .apply();
+
+    running_ = true;
+    thread_ = std::thread([this]() { animate(); });
+    return true;
+  }
+
+  void Stop() {
+    running_ = false;
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    if (surface_) {
+      SurfaceComposerClient::Transaction().hide(surface_).apply(true);
+      surface_ = nullptr;
+    }
+  }
+
+ private:
+  void animate() {
+    int32_t x = 0, y = 0;
+    int32_t dx = kSpeed, dy = kSpeed;
+    while (running_) {
+      x += dx;
+      y += dy;
+      if (x < 0 || x + kSize > width_) dx = -dx;
+      if (y < 0 || y + kSize > height_) dy = -dy;
+      x = std::clamp(x, 0, std::max(width_ - kSize, 0));
+      y = std::clamp(y, 0, std::max(height_ - kSize, 0));
+
+      // Synchronous, so that we move once per composition at most.
+      SurfaceComposerClient::Transaction().setPosition(surface_, x, y).apply(true);
+      std::this_thread::sleep_for(16ms);
+    }
+  }
+
+  int32_t width_ = 0;
+  int32_t height_ = 0;
+
+  sp<SurfaceComposerClient> client_;
+  sp<SurfaceControl> surface_;
+  std::thread thread_;
+  std::atomic<bool> running_ = false;
+};
+
+// Totals across every reader.
+struct Counters {
+  std::atomic<uint64_t> frames = 0;
+  std::atomic<uint64_t> bytes = 0;
+
+  // From capture to wardenclyffe_read returning, over the whole run and since the last report.
+  LatencyHistogram latency;
+  LatencyHistogram recent_latency;
+};
+
+static void readLoop(WardenclyffeSocket socket, Counters* counters) {
+  while (true) {
+    WardenclyffeReads reads = wardenclyffe_read(socket);
+    if (reads.read_count < 0) {
+      LOG(ERROR) << "wardenclyffe_read failed";
+      return;
+    } else if (reads.read_count == 0) {
+      return;
+    }
+
+    int64_t now = PipelineStats::Now();
+    for (ptrdiff_t i = 0; i < reads.read_count; ++i) {
+      const WardenclyffeRead& read = reads.reads[i];
+      counters->bytes += read.size;
+
+      FrameHeader header;
+      if (!read.oob && read.size >= sizeof(header)) {
+        memcpy(&header, read.data, sizeof(header));
+        if (header.type != static_cast<uint8_t>(FrameType::Description)) {
+          int64_t latency = now - static_cast<int64_t>(le64toh(header.timestamp));
+          ++counters->frames;
+          counters->latency.Record(latency);
+          counters->recent_latency.Record(latency);
+        }
+      }
+
+      if (read.frame) {
+        wardenclyffe_release_frame(read.frame);
+      }
+    }
+    wardenclyffe_reads_sent(socket);
+  }
+}
+
+struct ResourceUsage {
+  static ResourceUsage Get() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    ResourceUsage result;
+    result.time = std::chrono::steady_clock::now();
+    result.cpu = std::chrono::seconds(usage.ru_utime.tv_sec) +
+                 std::chrono::microseconds(usage.ru_utime.tv_usec) +
+                 std::chrono::seconds(usage.ru_stime.tv_sec) +
+                 std::chrono::microseconds(usage.ru_stime.tv_usec);
+    result.max_rss_kb = usage.ru_maxrss;
+
+    // statm is in pages: size, resident, ...
+    std::string statm;
+    if (android::base::ReadFileToString("/proc/self/statm", &statm)) {
+      std::vector<std::string> fields = android::base::Split(statm, " ");
+      if (fields.size() >= 2) {
+        result.rss_kb = strtoull(fields[1].c_str(), nullptr, 10) * getpagesize() / 1024;
+      }
+    }
+    return result;
+  }
+
+  // CPU use between |before| and this, as a percentage of one core.
+  double CpuPercent(const ResourceUsage& before) const {
+    std::chrono::duration<double> wall = time - before.time;
+    std::chrono::duration<double> busy = cpu - before.cpu;
+    return wall.count() > 0 ? 100.0 * busy.count() / wall.count() : 0;
+  }
+
+  std::chrono::steady_clock::time_point time;
+  std::chrono::microseconds cpu;
+  uint64_t rss_kb = 0;
+  uint64_t max_rss_kb = 0;
+};
+
+// Returns false if any pipeline in |stats| holds more buffers than its limit.
+static bool checkHeldBuffers(const std::string& stats) {
+  Json::Value root;
+  std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+  if (!reader->parse(stats.data(), stats.data() + stats.size(), &root, nullptr)) {
+    LOG(ERROR) << "Failed to parse pipeline statistics";
+    return false;
+  }
+
+  bool ok = true;
+  for (const Json::Value& pipeline : root.get("video", Json::arrayValue)) {
+    if (!pipeline.isMember("maxHeldBuffers")) {
+      continue;
+    }
+    uint64_t held = pipeline["heldBuffers"].asUInt64();
+    uint64_t limit = pipeline["maxHeldBuffers"].asUInt64();
+    if (held > limit) {
+      fprintf(stderr, "%s: holding %" PRIu64 " buffers, expected at most %" PRIu64 "\n",
+              pipeline["pipeline"].asCString(), held, limit);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [--duration <seconds>] [--readers <n>] [--synthetic] [<path>]\n",
+          argv0);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, android::base::StderrLogger);
+
+  int duration = 30;
+  int reader_count = 1;
+  bool synthetic = false;
+
+  static const option kOptions[] = {
+      {"duration", required_argument, nullptr, 'd'},
+      {"readers", required_argument, nullptr, 'r'},
+      {"synthetic", no_argument, nullptr, 's'},
+      {nullptr, 0, nullptr, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "d:r:s", kOptions, nullptr)) != -1) {
+    switch (c) {
+      case 'd':
+        duration = atoi(optarg);
+        break;
+      case 'r':
+        reader_count = atoi(optarg);
+        break;
+      case 's':
+        synthetic = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (duration <= 0 || reader_count <= 0 || argc - optind > 1) {
+    usage(argv[0]);
+  }
+
+  std::string path = optind < argc ? argv[optind] : "/video/h264/";
+  if (path.find("header=binary") == std::string::npos) {
+    path += path.find('?') == std::string::npos ? "?header=binary" : "&header=binary";
+  }
+
+  ProcessState::self()->startThreadPool();
+
+  SyntheticLayer layer;
+  if (synthetic && !layer.Start()) {
+    return 1;
+  }
+
+  std::vector<WardenclyffeSocket> sockets;
+  for (int i = 0; i < reader_count; ++i) {
+    WardenclyffeSocket socket = wardenclyffe_create_socket(path.c_str());
+    if (!socket) {
+      LOG(ERROR) << "Failed to create socket for " << path;
+      return 1;
+    }
+    sockets.push_back(socket);
+  }
+
+  printf("%s: %d reader(s) for %ds%s\n", path.c_str(), reader_count, duration,
+         synthetic ? ", with synthetic layer" : "");
+
+  Counters counters;
+  std::vector<std::thread> readers;
+  for (WardenclyffeSocket socket : sockets) {
+    readers.emplace_back(readLoop, socket, &counters);
+  }
+
+  auto print = [](const char* label, const ResourceUsage& before, const ResourceUsage& after,
+                  uint64_t frames, uint64_t bytes, const LatencyHistogram& histogram) {
+    std::chrono::duration<double> elapsed = after.time - before.time;
+    Json::Value latency = histogram.ToJson();
+    printf("%s: %.1f fps, %.0f kB/s, latency p50 %.1fms p99 %.1fms, cpu %.0f%%, rss %" PRIu64
+           " kB (max %" PRIu64 " kB)\n",
+           label, frames / elapsed.count(), bytes / elapsed.count() / 1000,
+           latency["p50"].asDouble() / 1000, latency["p99"].asDouble() / 1000,
+           after.CpuPercent(before), after.rss_kb, after.max_rss_kb);
+    fflush(stdout);
+  };
+
+  ResourceUsage start = ResourceUsage::Get();
+  ResourceUsage last = start;
+  uint64_t last_frames = 0, last_bytes = 0;
+  for (int i = 0; i < duration; ++i) {
+    std::this_thread::sleep_until(start.time + std::chrono::seconds(i + 1));
+    ResourceUsage now = ResourceUsage::Get();
+    uint64_t frames = counters.frames, bytes = counters.bytes;
+    print(android::base::StringPrintf("%3ds", i + 1).c_str(), last, now, frames - last_frames,
+          bytes - last_bytes, counters.recent_latency);
+    counters.recent_latency.Reset();
+    last = now;
+    last_frames = frames;
+    last_bytes = bytes;
+  }
+
+  // Grab the pipeline's own numbers before tearing it down.
+  std::string stats;
+  if (WardenclyffeSocket stats_socket = wardenclyffe_create_socket("/stats/")) {
+    WardenclyffeReads reads = wardenclyffe_read(stats_socket);
+    if (reads.read_count > 0) {
+      stats.assign(static_cast<const char*>(reads.reads[0].data), reads.reads[0].size);
+    }
+    wardenclyffe_destroy_socket(stats_socket);
+  }
+
+  for (WardenclyffeSocket socket : sockets) {
+    wardenclyffe_close_socket(socket);
+  }
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  for (WardenclyffeSocket socket : sockets) {
+    wardenclyffe_destroy_socket(socket);
+  }
+  layer.Stop();
+
+  print("total", start, last, counters.frames, counters.bytes, counters.latency);
+  printf("%s\n", stats.c_str());
+  return checkHeldBuffers(stats) ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+#include "wardenclyffe/android/frame.h"
+
+#include <endian.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace android;
+
+void Frame::decStrong(const void*) const {
+  if (refs_.fetch_sub(1, std::memory_order_release) != 1) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  Frame* self = const_cast<Frame*>(this);
+  std::shared_ptr<FramePool> pool = std::move(self->pool_);
+  if (pool) {
+    pool->recycle(self);
+  } else {
+    delete self;
+  }
+}
+
+void Frame::Describe() {
+  const char* frame_type = nullptr;
+  switch (type) {
+    case FrameType::Description:
+      frame_type = "config";
+      break;
+
+    case FrameType::Keyframe:
+      frame_type = "key";
+      break;
+
+    case FrameType::Interframe:
+      frame_type = "delta";
+      break;
+  };
+
+  int rc = snprintf(description, sizeof(description), "{\"type\":\"%s\",\"timestamp\": %" PRId64 "}",
+                    frame_type, timestamp);
+  description_size = rc < 0 ? 0 : std::min(static_cast<size_t>(rc), sizeof(description) - 1);
+}
+
+void Frame::WriteHeader() {
+  FrameHeader header = {
+      .version = FrameHeader::kVersion,
+      .type = static_cast<uint8_t>(type),
+      .flags = htole16(flags),
+      .sequence = htole32(static_cast<uint32_t>(sequence)),
+      .timestamp = static_cast<int64_t>(htole64(timestamp)),
+  };
+  memcpy(data.data(), &header, sizeof(header));
+}
+
+static size_t log2Floor(size_t value) {
+  return 63 - __builtin_clzll(value);
+}
+
+size_t FramePool::sizeClassIndex(size_t capacity) {
+  size_t size_class = capacity <= 1 ? 0 : log2Floor(capacity - 1) + 1;
+  return std::clamp(size_class, kMinSizeClass, kMaxSizeClass) - kMinSizeClass;
+}
+
+FramePool::FramePool() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& free_frames : free_frames_) {
+    free_frames.reserve(kMaxFramesPerSizeClass);
+  }
+}
+
+FramePool::~FramePool() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& free_frames : free_frames_) {
+    for (Frame* frame : free_frames) {
+      delete frame;
+    }
+  }
+}
+
+sp<Frame> FramePool::Acquire(size_t capacity) {
+  capacity += sizeof(FrameHeader);
+
+  Frame* frame = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = sizeClassIndex(capacity); i < kSizeClassCount; ++i) {
+      if (!free_frames_[i].empty()) {
+        frame = free_frames_[i].back();
+        free_frames_[i].pop_back();
+        break;
+      }
+    }
+  }
+
+  if (!frame) {
+    frame = new Frame();
+    frame->data.reserve(size_t(1) << (sizeClassIndex(capacity) + kMinSizeClass));
+  }
+
+  frame->data.resize(sizeof(FrameHeader));
+  frame->pool_ = shared_from_this();
+  return sp<Frame>(frame);
+}
+
+void FramePool::recycle(Frame* frame) {
+  // Drop the config reference outside of the lock, since it might be the last one.
+  frame->config = nullptr;
+  frame->data.clear();
+  frame->flags = 0;
+  frame->description_size = 0;
+
+  // Round down, so that every frame in a class has at least that class's capacity.
+  size_t capacity = frame->data.capacity();
+  size_t size_class = capacity == 0 ? 0 : log2Floor(capacity);
+  if (size_class >= kMinSizeClass) {
+    size_t index = std::min(size_class, kMaxSizeClass) - kMinSizeClass;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_frames_[index].size() < kMaxFramesPerSizeClass) {
+      free_frames_[index].push_back(frame);
+      return;
+    }
+  }
+
+  delete frame;
+}
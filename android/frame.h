@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <utils/StrongPointer.h>
+
+// Values are sent to clients in FrameHeader::type.
+enum class FrameType : uint8_t { Description = 0, Keyframe = 1, Interframe = 2 };
+
+// Fixed-size header at the front of every frame's data, sent to clients that ask for it instead of
+// the JSON descriptor. Fields are little-endian.
+struct __attribute__((packed)) FrameHeader {
+  static constexpr uint8_t kVersion = 1;
+
+  // Set on a codec config that differs from the one before it, which means the decoder needs to be
+  // reconfigured.
+  static constexpr uint16_t kFlagNewConfig = 1 << 0;
+
+  uint8_t version;
+  uint8_t type;  // 0 = config, 1 = key, 2 = delta
+  uint16_t flags;
+  uint32_t sequence;  // Low 32 bits of Frame::sequence.
+  int64_t timestamp;  // Microseconds.
+};
+static_assert(sizeof(FrameHeader) == 16);
+
+struct FramePool;
+
+// An encoded frame.
+//
+// Frames are immutable once they've been queued, and are shared by reference between every reader
+// of a stream. Each WardenclyffeRead that refers to a frame holds a strong reference to it, which
+// is dropped by wardenclyffe_release_frame.
+//
+// Frames are allocated from a FramePool, and return to it when their last reference is dropped.
+struct Frame {
+  // Reference counting, for android::sp.
+  void incStrong(const void*) const { refs_.fetch_add(1, std::memory_order_relaxed); }
+  void decStrong(const void*) const;
+
+  // Format the JSON descriptor for this frame, which is sent ahead of it to old clients.
+  void Describe();
+
+  // Fill in the FrameHeader at the front of |data|.
+  void WriteHeader();
+
+  // The encoded frame, without its header.
+  const char* payload() const { return data.data() + sizeof(FrameHeader); }
+  size_t payload_size() const { return data.size() - sizeof(FrameHeader); }
+
+  // A FrameHeader followed by the encoded frame. Encoders append to this.
+  std::vector<char> data;
+  FrameType type;
+  int64_t timestamp;
+  uint64_t sequence;
+  uint16_t flags = 0;
+
+  char description[64];
+  size_t description_size = 0;
+
+  // For keyframes, the codec configuration that must be fed to the decoder before this frame.
+  android::sp<const Frame> config;
+
+ private:
+  friend struct FramePool;
+
+  Frame() = default;
+  ~Frame() = default;
+
+  mutable std::atomic<int32_t> refs_ = 0;
+  std::shared_ptr<FramePool> pool_;
+};
+
+// A size-classed free list of frames.
+//
+// Buffers keep their capacity when they're recycled, so once a stream reaches a steady state, frames
+// are produced without touching the heap.
+struct FramePool : public std::enable_shared_from_this<FramePool> {
+  FramePool();
+  ~FramePool();
+
+  // Get a frame with room for at least |capacity| bytes of payload, and space for its header.
+  android::sp<Frame> Acquire(size_t capacity) EXCLUDES(mutex_);
+
+ private:
+  friend struct Frame;
+
+  // Size classes are powers of two, from 4 KiB to 64 MiB.
+  static constexpr size_t kMinSizeClass = 12;
+  static constexpr size_t kMaxSizeClass = 26;
+  static constexpr size_t kSizeClassCount = kMaxSizeClass - kMinSizeClass + 1;
+  static constexpr size_t kMaxFramesPerSizeClass = 16;
+
+  // Index of the smallest size class that holds |capacity| bytes.
+  static size_t sizeClassIndex(size_t capacity);
+
+  void recycle(Frame* frame) EXCLUDES(mutex_);
+
+  std::mutex mutex_;
+  std::vector<Frame*> free_frames_[kSizeClassCount] GUARDED_BY(mutex_);
+};
@@ -0,0 +1,120 @@
+#include "wardenclyffe/android/frame_queue.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iterator>
+
+#include <android-base/logging.h>
+
+using namespace android;
+
+FrameQueue::FrameQueue(size_t max_queue_depth)
+    : max_queue_depth(max_queue_depth),
+      // Leave room for a keyframe to get in when the reader is over its limit.
+      ring_(max_queue_depth * 2),
+      event_fd_(eventfd(0, EFD_CLOEXEC)),
+      last_pop_time_(std::chrono::steady_clock::now().time_since_epoch().count()) {
+  if (event_fd_ == -1) {
+    PLOG(FATAL) << "failed to create eventfd";
+  }
+}
+
+void FrameQueue::Push(sp<const Frame> frame) {
+  if (!ring_.Push(std::move(frame))) {
+    // The reader isn't even getting through the frames that are going to be flushed.
+    ++dropped_frames;
+    keyframe_needed = true;
+    return;
+  }
+
+  // Pairs with the fence in Wait: either the reader sees the frame, or we see that it's waiting.
+  // The ring's own ordering doesn't cover a store to one location followed by a load of another.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiting_.exchange(false)) {
+    Wake();
+  }
+}
+
+sp<const Frame> FrameQueue::Pop() {
+  last_pop_time_.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                       std::memory_order_relaxed);
+  while (std::optional<sp<const Frame>> frame = ring_.Pop()) {
+    if ((*frame)->sequence >= flush_sequence) {
+      return std::move(*frame);
+    }
+    ++dropped_frames;
+  }
+  return nullptr;
+}
+
+bool FrameQueue::IsStalled(std::chrono::steady_clock::time_point now,
+                           std::chrono::steady_clock::duration timeout) const {
+  if (ring_.empty()) {
+    return false;
+  }
+  std::chrono::steady_clock::time_point last_pop(
+      std::chrono::steady_clock::duration(last_pop_time_.load(std::memory_order_relaxed)));
+  return now - last_pop > timeout;
+}
+
+void FrameQueue::Wait() {
+  waiting_ = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!ring_.empty()) {
+    waiting_ = false;
+    return;
+  }
+
+  uint64_t count;
+  if (TEMP_FAILURE_RETRY(read(event_fd_.get(), &count, sizeof(count))) != sizeof(count)) {
+    PLOG(FATAL) << "failed to read from eventfd";
+  }
+  waiting_ = false;
+}
+
+void FrameQueue::Wait(FrameQueue& other) {
+  waiting_ = true;
+  other.waiting_ = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (ring_.empty() && other.ring_.empty()) {
+    pollfd fds[] = {
+        {.fd = event_fd_.get(), .events = POLLIN},
+        {.fd = other.event_fd_.get(), .events = POLLIN},
+    };
+    if (TEMP_FAILURE_RETRY(poll(fds, std::size(fds), -1)) == -1) {
+      PLOG(FATAL) << "failed to poll eventfds";
+    }
+
+    // Whichever one didn't fire might still be poked once this returns, which only means an extra
+    // trip around the reader's loop the next time it waits on it.
+    for (const pollfd& fd : fds) {
+      uint64_t count;
+      if ((fd.revents & POLLIN) &&
+          TEMP_FAILURE_RETRY(read(fd.fd, &count, sizeof(count))) != sizeof(count)) {
+        PLOG(FATAL) << "failed to read from eventfd";
+      }
+    }
+  }
+  waiting_ = false;
+  other.waiting_ = false;
+}
+
+void FrameQueue::Reset() {
+  while (ring_.Pop()) {
+  }
+  keyframe_needed = true;
+  started = false;
+  resync_requested = false;
+  flush_sequence = 0;
+}
+
+void FrameQueue::Wake() {
+  uint64_t count = 1;
+  if (TEMP_FAILURE_RETRY(write(event_fd_.get(), &count, sizeof(count))) != sizeof(count)) {
+    PLOG(FATAL) << "failed to write to eventfd";
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+#include <android-base/unique_fd.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/frame.h"
+#include "wardenclyffe/android/spsc_ring.h"
+
+// Frames on their way from a pipeline to one of its readers.
+//
+// The pipeline pushes frames while holding its frame mutex, and the reader pops them without taking
+// any locks. A reader with nothing to do sleeps on an eventfd, which only gets poked if it's
+// actually asleep.
+//
+// Dropping is up to the pipeline, and happens on the way in. VideoSocket drops everything up to the
+// next keyframe once a reader is max_queue_depth frames behind, and that keyframe flushes whatever
+// the reader hasn't gotten to yet. When every frame is a keyframe, this means readers skip straight
+// to the newest frame.
+struct FrameQueue {
+  explicit FrameQueue(size_t max_queue_depth);
+
+  // Called with the pipeline's frame mutex held.
+  void Push(android::sp<const Frame> frame);
+
+  // Returns the next frame, or nullptr if there isn't one yet.
+  android::sp<const Frame> Pop();
+
+  // Sleep until a frame is pushed or Wake is called.
+  void Wait();
+
+  // Sleep until either this queue or |other| has something for the reader, for a reader that's
+  // moving from one pipeline to another.
+  void Wait(FrameQueue& other);
+
+  // Drop every frame and start over, as if newly created. Only for a queue that nothing is pushing
+  // to any more.
+  void Reset();
+
+  // Wake up the reader unconditionally, e.g. because the stream is over.
+  void Wake();
+
+  size_t size() const { return ring_.size(); }
+
+  // Whether frames have been waiting for the reader for more than |timeout| without it taking any.
+  bool IsStalled(std::chrono::steady_clock::time_point now,
+                 std::chrono::steady_clock::duration timeout) const;
+
+  // Number of frames that may be buffered ahead of the reader before some are dropped.
+  const size_t max_queue_depth;
+
+  // Producer state, guarded by the pipeline's frame mutex.
+  bool keyframe_needed = true;
+  bool started = false;
+
+  // Set by the reader when the client has lost sync and wants to restart at a keyframe.
+  std::atomic<bool> resync_requested = false;
+
+  // Frames older than this are discarded by Pop.
+  std::atomic<uint64_t> flush_sequence = 0;
+
+  std::atomic<uint64_t> dropped_frames = 0;
+
+ private:
+  SpscRing<android::sp<const Frame>> ring_;
+
+  android::base::unique_fd event_fd_;
+  std::atomic<bool> waiting_ = false;
+
+  // When the reader last called Pop, as a steady_clock time since epoch.
+  std::atomic<std::chrono::steady_clock::rep> last_pop_time_;
+};
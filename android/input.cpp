@@ -0,0 +1,396 @@
+#include "wardenclyffe/android/input.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/uinput.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <optional>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <gui/SurfaceComposerClient.h>
+#include <ui/DisplayMode.h>
+#include <ui/DisplayState.h>
+#include <utils/Timers.h>
+
+using namespace android;
+
+static constexpr int32_t kAxisMax = UINT16_MAX;
+
+bool UinputDevice::Create(const char* name, const std::vector<std::pair<int, int>>& bits,
+                          const std::vector<int>& absolute_axes,
+                          const std::vector<int>& properties) {
+  fd_.reset(TEMP_FAILURE_RETRY(open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC)));
+  if (fd_ == -1) {
+    PLOG(ERROR) << "failed to open /dev/uinput";
+    return false;
+  }
+
+  for (auto [request, bit] : bits) {
+    if (ioctl(fd_.get(), request, bit) != 0) {
+      PLOG(ERROR) << "failed to set uinput bit " << bit << " for " << name;
+      return false;
+    }
+  }
+
+  for (int property : properties) {
+    if (ioctl(fd_.get(), UI_SET_PROPBIT, property) != 0) {
+      PLOG(ERROR) << "failed to set uinput property " << property << " for " << name;
+      return false;
+    }
+  }
+
+  for (int axis : absolute_axes) {
+    uinput_abs_setup abs = {};
+    abs.code = axis;
+    abs.absinfo.minimum = 0;
+    abs.absinfo.maximum = kAxisMax;
+    if (axis == ABS_MT_SLOT) {
+      abs.absinfo.maximum = InputSocket::kMaxPointers;
+    } else if (axis == ABS_MT_TRACKING_ID) {
+      abs.absinfo.maximum = INT16_MAX;
+    }
+    if (ioctl(fd_.get(), UI_SET_ABSBIT, axis) != 0 || ioctl(fd_.get(), UI_ABS_SETUP, &abs) != 0) {
+      PLOG(ERROR) << "failed to set up axis " << axis << " for " << name;
+      return false;
+    }
+  }
+
+  uinput_setup setup = {};
+  setup.id.bustype = BUS_VIRTUAL;
+  setup.id.vendor = 0x18d1;
+  setup.id.product = 0x5744;
+  strlcpy(setup.name, name, sizeof(setup.name));
+  if (ioctl(fd_.get(), UI_DEV_SETUP, &setup) != 0 || ioctl(fd_.get(), UI_DEV_CREATE) != 0) {
+    PLOG(ERROR) << "failed to create uinput device " << name;
+    return false;
+  }
+  return true;
+}
+
+void UinputDevice::Emit(uint16_t type, uint16_t code, int32_t value) {
+  input_event event = {};
+  event.type = type;
+  event.code = code;
+  event.value = value;
+  if (TEMP_FAILURE_RETRY(write(fd_.get(), &event, sizeof(event))) != sizeof(event)) {
+    PLOG(WARNING) << "failed to write to uinput";
+  }
+}
+
+Socket* InputSocket::Create(std::string_view path) {
+  // There aren't any options yet.
+  path = path.substr(0, path.find('?'));
+  if (!path.empty()) {
+    LOG(ERROR) << "Unsupported input path: " << path;
+    return nullptr;
+  }
+
+  std::unique_ptr<InputSocket> socket(new InputSocket());
+  if (!socket->initialize()) {
+    return nullptr;
+  }
+  return socket.release();
+}
+
+bool InputSocket::initialize() {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  std::vector<std::pair<int, int>> touch_bits = {
+      {UI_SET_EVBIT, EV_KEY},
+      {UI_SET_EVBIT, EV_ABS},
+      {UI_SET_KEYBIT, BTN_TOUCH},
+  };
+  std::vector<int> touch_axes = {
+      ABS_MT_SLOT,
+      ABS_MT_TRACKING_ID,
+      ABS_MT_POSITION_X,
+      ABS_MT_POSITION_Y,
+  };
+  if (!touchscreen_.Create("wardenclyffe-touchscreen", touch_bits, touch_axes,
+                           {INPUT_PROP_DIRECT})) {
+    return false;
+  }
+
+  std::vector<std::pair<int, int>> key_bits = {{UI_SET_EVBIT, EV_KEY}};
+  for (int key = KEY_ESC; key < KEY_MAX; ++key) {
+    key_bits.emplace_back(UI_SET_KEYBIT, key);
+  }
+  if (!keyboard_.Create("wardenclyffe-keyboard", key_bits, {}, {})) {
+    return false;
+  }
+
+  // Movement is flushed at the display's refresh rate.
+  std::optional<PhysicalDisplayId> display_id = SurfaceComposerClient::getInternalDisplayId();
+  if (display_id) {
+    sp<IBinder> display = SurfaceComposerClient::getPhysicalDisplayToken(*display_id);
+    ui::DisplayMode mode;
+    if (display && SurfaceComposerClient::getActiveDisplayMode(display, &mode) == NO_ERROR &&
+        mode.refreshRate > 0) {
+      frame_interval_ = std::chrono::nanoseconds(static_cast<int64_t>(1e9 / mode.refreshRate));
+    }
+  }
+  updateOrientation();
+
+  flush_thread_ = std::thread([this]() { flushLoop(); });
+  LOG(INFO) << "Input devices created";
+  return true;
+}
+
+InputSocket::~InputSocket() {
+  Destroy();
+  if (flush_thread_.joinable()) {
+    flush_thread_.join();
+  }
+}
+
+void InputSocket::Destroy() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+
+  // Don't leave anything stuck down.
+  for (size_t slot = 0; slot < pointers_.size(); ++slot) {
+    if (pointers_[slot].down) {
+      injectTouch(slot, std::nullopt);
+    }
+  }
+  cv_.notify_all();
+}
+
+void InputSocket::updateOrientation() {
+  std::optional<PhysicalDisplayId> display_id = SurfaceComposerClient::getInternalDisplayId();
+  if (!display_id) return;
+
+  sp<IBinder> display = SurfaceComposerClient::getPhysicalDisplayToken(*display_id);
+  ui::DisplayState state;
+  if (display && SurfaceComposerClient::getDisplayState(display, &state) == NO_ERROR) {
+    orientation_ = state.orientation;
+  }
+}
+
+std::pair<int32_t, int32_t> InputSocket::toTouchscreen(uint16_t x, uint16_t y) {
+  // InputFlinger rotates touchscreen coordinates along with the display, so undo that.
+  switch (orientation_) {
+    case ui::ROTATION_0:
+      return {x, y};
+    case ui::ROTATION_90:
+      return {kAxisMax - y, x};
+    case ui::ROTATION_180:
+      return {kAxisMax - x, kAxisMax - y};
+    case ui::ROTATION_270:
+      return {y, kAxisMax - x};
+  }
+  return {x, y};
+}
+
+void InputSocket::injectTouch(size_t slot, std::optional<std::pair<int32_t, int32_t>> position) {
+  Pointer& pointer = pointers_[slot];
+  touchscreen_.Emit(EV_ABS, ABS_MT_SLOT, slot);
+  if (!position) {
+    pointer.down = false;
+    pointer.pending_position.reset();
+    touchscreen_.Emit(EV_ABS, ABS_MT_TRACKING_ID, -1);
+  } else {
+    if (!pointer.down) {
+      pointer.down = true;
+      pointer.tracking_id = next_tracking_id_++ & INT16_MAX;
+      touchscreen_.Emit(EV_ABS, ABS_MT_TRACKING_ID, pointer.tracking_id);
+    }
+    touchscreen_.Emit(EV_ABS, ABS_MT_POSITION_X, position->first);
+    touchscreen_.Emit(EV_ABS, ABS_MT_POSITION_Y, position->second);
+  }
+
+  bool any_down = std::any_of(pointers_.begin(), pointers_.end(),
+                              [](const Pointer& pointer) { return pointer.down; });
+  touchscreen_.Emit(EV_KEY, BTN_TOUCH, any_down);
+  touchscreen_.Sync();
+}
+
+void InputSocket::flushMoves() {
+  for (size_t slot = 0; slot < kMaxPointers; ++slot) {
+    Pointer& pointer = pointers_[slot];
+    if (!pointer.pending_position) continue;
+
+    injectTouch(slot, pointer.pending_position);
+    pointer.pending_position.reset();
+    ack(pointer.pending_sequence);
+  }
+}
+
+void InputSocket::flushScroll(std::chrono::steady_clock::time_point now) {
+  Pointer& pointer = pointers_[kScrollSlot];
+  if (pointer.pending_position) {
+    injectTouch(kScrollSlot, pointer.pending_position);
+    pointer.pending_position.reset();
+    ack(pointer.pending_sequence);
+  } else if (pointer.down && now - last_scroll_ > kScrollIdleTimeout) {
+    injectTouch(kScrollSlot, std::nullopt);
+  }
+}
+
+void InputSocket::ack(uint32_t sequence) {
+  if (sequence == 0) return;
+
+  bool was_empty = acks_.empty();
+  acks_.push_back({sequence, systemTime(SYSTEM_TIME_MONOTONIC) / 1000});
+  if (was_empty) {
+    cv_.notify_all();
+  }
+}
+
+void InputSocket::flushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  base::ScopedLockAssertion lock_assertion(mutex_);
+  auto next_flush = std::chrono::steady_clock::now();
+  while (!closed_) {
+    next_flush += frame_interval_;
+    cv_.wait_until(lock, next_flush, [this]() {
+      base::ScopedLockAssertion lock_assertion(mutex_);
+      return closed_;
+    });
+    if (closed_) break;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - next_flush > frame_interval_) {
+      // We fell behind, don't try to catch up.
+      next_flush = now;
+    }
+    flushMoves();
+    flushScroll(now);
+  }
+}
+
+bool InputSocket::Write(const void* data, size_t len) {
+  if (len % sizeof(InputEvent) != 0) {
+    LOG(WARNING) << "Ignoring input message of " << len << " bytes";
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_) {
+    // Destroy has already lifted every pointer, so anything injected now would stay down.
+    return false;
+  }
+
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  for (size_t offset = 0; offset < len; offset += sizeof(InputEvent)) {
+    InputEvent event;
+    memcpy(&event, p + offset, sizeof(event));
+    event.code = le16toh(event.code);
+    event.x = le16toh(event.x);
+    event.y = le16toh(event.y);
+    event.dx = le16toh(event.dx);
+    event.dy = le16toh(event.dy);
+    event.sequence = le32toh(event.sequence);
+
+    switch (static_cast<InputEventType>(event.type)) {
+      case InputEventType::TouchDown:
+      case InputEventType::TouchMove:
+      case InputEventType::TouchUp: {
+        if (event.pointer >= kMaxPointers) {
+          LOG(WARNING) << "Ignoring touch event for pointer " << event.pointer;
+          break;
+        }
+
+        Pointer& pointer = pointers_[event.pointer];
+        if (event.type == static_cast<uint8_t>(InputEventType::TouchMove)) {
+          if (pointer.down) {
+            pointer.pending_position = toTouchscreen(event.x, event.y);
+            pointer.pending_sequence = event.sequence;
+          }
+          break;
+        }
+
+        // Anything other than movement goes out immediately, in order.
+        flushMoves();
+        if (event.type == static_cast<uint8_t>(InputEventType::TouchDown)) {
+          if (std::none_of(pointers_.begin(), pointers_.end(),
+                           [](const Pointer& other) { return other.down; })) {
+            // Polling is fine here, since rotating takes longer than putting a finger down.
+            updateOrientation();
+          }
+          injectTouch(event.pointer, toTouchscreen(event.x, event.y));
+        } else if (pointer.down) {
+          injectTouch(event.pointer, std::nullopt);
+        }
+        ack(event.sequence);
+        break;
+      }
+
+      case InputEventType::KeyDown:
+      case InputEventType::KeyUp:
+        if (event.code == 0 || event.code >= KEY_MAX) {
+          LOG(WARNING) << "Ignoring key event for key " << event.code;
+          break;
+        }
+        flushMoves();
+        keyboard_.Emit(EV_KEY, event.code,
+                       event.type == static_cast<uint8_t>(InputEventType::KeyDown));
+        keyboard_.Sync();
+        ack(event.sequence);
+        break;
+
+      case InputEventType::Scroll: {
+        // Drag the content, which means that the finger moves against the scroll direction.
+        Pointer& pointer = pointers_[kScrollSlot];
+        if (!pointer.down && !pointer.pending_position) {
+          scroll_x_ = event.x;
+          scroll_y_ = event.y;
+          injectTouch(kScrollSlot, toTouchscreen(scroll_x_, scroll_y_));
+        }
+        scroll_x_ = std::clamp(scroll_x_ - event.dx, 0, kAxisMax);
+        scroll_y_ = std::clamp(scroll_y_ - event.dy, 0, kAxisMax);
+        pointer.pending_position = toTouchscreen(scroll_x_, scroll_y_);
+        pointer.pending_sequence = event.sequence;
+        last_scroll_ = std::chrono::steady_clock::now();
+        break;
+      }
+
+      default:
+        LOG(WARNING) << "Ignoring input event of type " << static_cast<int>(event.type);
+        break;
+    }
+  }
+  return true;
+}
+
+WardenclyffeReads InputSocket::Read() {
+  std::vector<Ack> acks;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    base::ScopedLockAssertion lock_assertion(mutex_);
+    cv_.wait(lock, [this]() {
+      base::ScopedLockAssertion lock_assertion(mutex_);
+      return closed_ || !acks_.empty();
+    });
+    if (closed_) {
+      return {.reads = nullptr, .read_count = 0};
+    }
+    acks.swap(acks_);
+  }
+
+  ack_message_ = R"({"type":"input","acks":[)";
+  for (size_t i = 0; i < acks.size(); ++i) {
+    android::base::StringAppendF(&ack_message_, R"(%s{"sequence":%u,"injected":%)" PRId64 "}",
+                                 i == 0 ? "" : ",", acks[i].sequence, acks[i].injected);
+  }
+  ack_message_ += "]}";
+
+  read_ = WardenclyffeRead{
+      .data = ack_message_.data(),
+      .size = ack_message_.size(),
+      .oob = true,
+      .frame = nullptr,
+  };
+  return {.reads = &read_, .read_count = 1};
+}
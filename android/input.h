@@ -0,0 +1,150 @@
+#pragma once
+
+#include <linux/input.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <ui/Rotation.h>
+
+#include "wardenclyffe/android/socket.h"
+#include "wardenclyffe/wardenclyffe.h"
+
+// Values of InputEvent::type.
+enum class InputEventType : uint8_t {
+  TouchDown = 0,
+  TouchMove = 1,
+  TouchUp = 2,
+  KeyDown = 3,
+  KeyUp = 4,
+  Scroll = 5,
+};
+
+// An event sent by the client. Each message written to an InputSocket holds one or more of these,
+// back to back. Fields are little-endian.
+struct __attribute__((packed)) InputEvent {
+  uint8_t type;     // InputEventType
+  uint8_t pointer;  // Touch events: pointer ID, from 0 to InputSocket::kMaxPointers - 1.
+  uint16_t code;    // Key events: Linux key code, e.g. KEY_A or KEY_BACK.
+
+  // Touch and scroll events: position, in the display's current orientation, scaled so that
+  // 0 and 65535 are its left/top and right/bottom edges.
+  uint16_t x;
+  uint16_t y;
+
+  // Scroll events: distance to scroll, in the same units, positive towards the bottom right.
+  int16_t dx;
+  int16_t dy;
+
+  // Echoed back once the event has been injected. 0 means that the client doesn't need to know.
+  uint32_t sequence;
+};
+static_assert(sizeof(InputEvent) == 16);
+
+// A virtual device created through /dev/uinput.
+struct UinputDevice {
+  bool Create(const char* name, const std::vector<std::pair<int, int>>& bits,
+              const std::vector<int>& absolute_axes, const std::vector<int>& properties);
+
+  void Emit(uint16_t type, uint16_t code, int32_t value);
+  void Sync() { Emit(EV_SYN, SYN_REPORT, 0); }
+
+ private:
+  android::base::unique_fd fd_;
+};
+
+// Injects touch, key and scroll events from the client through a set of uinput devices, owned by
+// this socket. The kernel timestamps events as they're written, so they go through InputFlinger
+// exactly like events from real hardware.
+//
+// Touch movement is coalesced, and injected once per display refresh. Everything else is injected
+// as soon as it arrives, after any movement that came before it.
+//
+// Reads return out-of-band JSON acks for injected events that had a sequence number:
+//   {"type": "input", "acks": [{"sequence": <n>, "injected": <CLOCK_MONOTONIC microseconds>}]}
+// which is the same clock as video frame timestamps, so that the client can tell which frame is the
+// first that could possibly show the effect of an event.
+struct InputSocket : public Socket {
+  ~InputSocket();
+
+  static Socket* Create(std::string_view path);
+
+  static constexpr size_t kMaxPointers = 10;
+
+  virtual void Destroy() override EXCLUDES(mutex_);
+
+  virtual WardenclyffeReads Read() final EXCLUDES(mutex_);
+  virtual bool SupportsRead() final { return true; }
+
+  virtual bool Write(const void* data, size_t len) final EXCLUDES(mutex_);
+  virtual bool SupportsWrite() final { return true; }
+
+ private:
+  InputSocket() = default;
+
+  bool initialize();
+  void flushLoop() EXCLUDES(mutex_);
+
+  // Map a position from the client to the touchscreen's natural orientation.
+  std::pair<int32_t, int32_t> toTouchscreen(uint16_t x, uint16_t y) REQUIRES(mutex_);
+  void updateOrientation() REQUIRES(mutex_);
+
+  void injectTouch(size_t slot, std::optional<std::pair<int32_t, int32_t>> position)
+      REQUIRES(mutex_);
+  void flushMoves() REQUIRES(mutex_);
+  void flushScroll(std::chrono::steady_clock::time_point now) REQUIRES(mutex_);
+  void ack(uint32_t sequence) REQUIRES(mutex_);
+
+  std::chrono::nanoseconds frame_interval_{16'666'667};
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool closed_ GUARDED_BY(mutex_) = false;
+  std::thread flush_thread_;
+
+  UinputDevice touchscreen_ GUARDED_BY(mutex_);
+  UinputDevice keyboard_ GUARDED_BY(mutex_);
+  android::ui::Rotation orientation_ GUARDED_BY(mutex_) = android::ui::ROTATION_0;
+
+  struct Pointer {
+    bool down = false;
+    int32_t tracking_id = -1;
+
+    // Movement waiting for the next flush.
+    std::optional<std::pair<int32_t, int32_t>> pending_position;
+    uint32_t pending_sequence = 0;
+  };
+
+  // Touch slots, plus one more for scrolling, which is done by dragging.
+  std::array<Pointer, kMaxPointers + 1> pointers_ GUARDED_BY(mutex_);
+  int32_t next_tracking_id_ GUARDED_BY(mutex_) = 0;
+
+  // Scrolls arriving close together are one drag. Once they stop, the finger is held still for a
+  // bit before it's lifted, so that the drag doesn't turn into a fling.
+  static constexpr size_t kScrollSlot = kMaxPointers;
+  static constexpr std::chrono::milliseconds kScrollIdleTimeout{150};
+  int32_t scroll_x_ GUARDED_BY(mutex_) = 0;
+  int32_t scroll_y_ GUARDED_BY(mutex_) = 0;
+  std::chrono::steady_clock::time_point last_scroll_ GUARDED_BY(mutex_);
+
+  struct Ack {
+    uint32_t sequence;
+    int64_t injected;
+  };
+  std::vector<Ack> acks_ GUARDED_BY(mutex_);
+
+  // Backing storage for the most recently returned read.
+  std::string ack_message_;
+  WardenclyffeRead read_;
+};
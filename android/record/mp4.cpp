@@ -0,0 +1,466 @@
+#include "wardenclyffe/android/record/mp4.h"
+
+#include <endian.h>
+#include <string.h>
+
+#include <algorithm>
+#include <initializer_list>
+#include <iterator>
+
+#include <android-base/logging.h>
+
+static constexpr uint32_t kTimescale = 1'000'000;
+static constexpr uint32_t kTrackId = 1;
+
+static constexpr uint8_t kNalTypeSps = 7;
+static constexpr uint8_t kNalTypePps = 8;
+
+// Split an Annex B bitstream on its start codes.
+static std::vector<std::string_view> splitNalUnits(std::string_view annex_b) {
+  std::vector<std::string_view> result;
+  size_t start = std::string_view::npos;
+  size_t i = 0;
+  while (i + 3 <= annex_b.size()) {
+    if (annex_b[i] != 0 || annex_b[i + 1] != 0 || annex_b[i + 2] != 1) {
+      ++i;
+      continue;
+    }
+
+    if (start != std::string_view::npos) {
+      // A 4 byte start code leaves a zero behind on the end of the previous NAL unit.
+      size_t end = i > start && annex_b[i - 1] == 0 ? i - 1 : i;
+      result.push_back(annex_b.substr(start, end - start));
+    }
+    i += 3;
+    start = i;
+  }
+
+  if (start != std::string_view::npos && start < annex_b.size()) {
+    result.push_back(annex_b.substr(start));
+  }
+  return result;
+}
+
+// Reads Exp-Golomb coded fields out of an RBSP, skipping emulation prevention bytes. Reading past
+// the end sets |overrun| and returns zeroes.
+struct BitReader {
+  explicit BitReader(std::string_view nal_unit) {
+    rbsp_.reserve(nal_unit.size());
+    for (size_t i = 0; i < nal_unit.size(); ++i) {
+      if (i >= 2 && nal_unit[i] == 3 && nal_unit[i - 1] == 0 && nal_unit[i - 2] == 0) {
+        continue;
+      }
+      rbsp_.push_back(static_cast<uint8_t>(nal_unit[i]));
+    }
+  }
+
+  uint32_t Bit() {
+    if (position_ >= rbsp_.size() * 8) {
+      overrun = true;
+      return 0;
+    }
+    uint32_t bit = (rbsp_[position_ / 8] >> (7 - position_ % 8)) & 1;
+    ++position_;
+    return bit;
+  }
+
+  uint32_t Bits(int count) {
+    uint32_t result = 0;
+    for (int i = 0; i < count; ++i) {
+      result = (result << 1) | Bit();
+    }
+    return result;
+  }
+
+  uint32_t UnsignedExpGolomb() {
+    int leading_zeros = 0;
+    while (!Bit() && !overrun) {
+      if (++leading_zeros > 31) {
+        overrun = true;
+        return 0;
+      }
+    }
+    return (uint32_t(1) << leading_zeros) - 1 + Bits(leading_zeros);
+  }
+
+  int32_t SignedExpGolomb() {
+    uint32_t value = UnsignedExpGolomb();
+    return value & 1 ? (value + 1) / 2 : -static_cast<int32_t>(value / 2);
+  }
+
+  bool overrun = false;
+
+ private:
+  std::vector<uint8_t> rbsp_;
+  size_t position_ = 0;
+};
+
+// Pull the display size out of an SPS (ITU-T H.264 7.3.2.1.1).
+static bool parseSpsSize(std::string_view sps, uint32_t* width, uint32_t* height) {
+  BitReader reader(sps);
+  reader.Bits(8);  // NAL unit header
+  uint32_t profile_idc = reader.Bits(8);
+  reader.Bits(16);             // constraint flags, level_idc
+  reader.UnsignedExpGolomb();  // seq_parameter_set_id
+
+  uint32_t chroma_format_idc = 1;
+  bool separate_colour_plane = false;
+  // Profiles with chroma format and scaling matrices in their SPS.
+  static constexpr uint32_t kHighProfiles[] = {100, 110, 122, 244, 44, 83, 86,
+                                               118, 128, 138, 139, 134, 135};
+  if (std::find(std::begin(kHighProfiles), std::end(kHighProfiles), profile_idc) !=
+      std::end(kHighProfiles)) {
+    chroma_format_idc = reader.UnsignedExpGolomb();
+    if (chroma_format_idc == 3) {
+      separate_colour_plane = reader.Bit();
+    }
+    reader.UnsignedExpGolomb();  // bit_depth_luma_minus8
+    reader.UnsignedExpGolomb();  // bit_depth_chroma_minus8
+    reader.Bit();                // qpprime_y_zero_transform_bypass_flag
+    if (reader.Bit()) {          // seq_scaling_matrix_present_flag
+      for (int i = 0; i < (chroma_format_idc == 3 ? 12 : 8); ++i) {
+        if (!reader.Bit()) {
+          continue;
+        }
+        int32_t last_scale = 8, next_scale = 8;
+        for (int j = 0; j < (i < 6 ? 16 : 64) && next_scale != 0; ++j) {
+          next_scale = (last_scale + reader.SignedExpGolomb() + 256) % 256;
+          last_scale = next_scale == 0 ? last_scale : next_scale;
+        }
+      }
+    }
+  }
+
+  reader.UnsignedExpGolomb();  // log2_max_frame_num_minus4
+  uint32_t pic_order_cnt_type = reader.UnsignedExpGolomb();
+  if (pic_order_cnt_type == 0) {
+    reader.UnsignedExpGolomb();  // log2_max_pic_order_cnt_lsb_minus4
+  } else if (pic_order_cnt_type == 1) {
+    reader.Bit();              // delta_pic_order_always_zero_flag
+    reader.SignedExpGolomb();  // offset_for_non_ref_pic
+    reader.SignedExpGolomb();  // offset_for_top_to_bottom_field
+    uint32_t cycle_length = reader.UnsignedExpGolomb();
+    for (uint32_t i = 0; i < cycle_length && !reader.overrun; ++i) {
+      reader.SignedExpGolomb();  // offset_for_ref_frame
+    }
+  }
+
+  reader.UnsignedExpGolomb();  // max_num_ref_frames
+  reader.Bit();                // gaps_in_frame_num_value_allowed_flag
+  uint32_t width_in_mbs = reader.UnsignedExpGolomb() + 1;
+  uint32_t height_in_map_units = reader.UnsignedExpGolomb() + 1;
+  bool frame_mbs_only = reader.Bit();
+  if (!frame_mbs_only) {
+    reader.Bit();  // mb_adaptive_frame_field_flag
+  }
+  reader.Bit();  // direct_8x8_inference_flag
+
+  uint32_t crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+  if (reader.Bit()) {  // frame_cropping_flag
+    crop_left = reader.UnsignedExpGolomb();
+    crop_right = reader.UnsignedExpGolomb();
+    crop_top = reader.UnsignedExpGolomb();
+    crop_bottom = reader.UnsignedExpGolomb();
+  }
+  if (reader.overrun) {
+    return false;
+  }
+
+  // Crop offsets are in chroma samples, or in luma samples without chroma (table 6-1).
+  uint32_t crop_unit_x = 1, crop_unit_y = 1;
+  if (chroma_format_idc != 0 && !separate_colour_plane) {
+    crop_unit_x = chroma_format_idc == 3 ? 1 : 2;
+    crop_unit_y = chroma_format_idc == 1 ? 2 : 1;
+  }
+  crop_unit_y *= frame_mbs_only ? 1 : 2;
+
+  uint32_t frame_width = width_in_mbs * 16;
+  uint32_t frame_height = height_in_map_units * 16 * (frame_mbs_only ? 1 : 2);
+  uint32_t crop_x = (crop_left + crop_right) * crop_unit_x;
+  uint32_t crop_y = (crop_top + crop_bottom) * crop_unit_y;
+  if (crop_x >= frame_width || crop_y >= frame_height) {
+    return false;
+  }
+  *width = frame_width - crop_x;
+  *height = frame_height - crop_y;
+  return true;
+}
+
+std::optional<AvcConfig> AvcConfig::Parse(std::string_view annex_b) {
+  AvcConfig config;
+  for (std::string_view nal_unit : splitNalUnits(annex_b)) {
+    if (nal_unit.empty()) {
+      continue;
+    }
+    uint8_t type = nal_unit[0] & 0x1f;
+    if (type == kNalTypeSps && config.sps.empty()) {
+      config.sps = nal_unit;
+    } else if (type == kNalTypePps && config.pps.empty()) {
+      config.pps = nal_unit;
+    }
+  }
+
+  if (config.sps.size() < 4 || config.pps.empty()) {
+    LOG(ERROR) << "H.264 codec config is missing its SPS or PPS";
+    return std::nullopt;
+  }
+  if (!parseSpsSize(config.sps, &config.width, &config.height)) {
+    LOG(ERROR) << "Failed to parse H.264 SPS";
+    return std::nullopt;
+  }
+  return config;
+}
+
+Mp4Sample::Mp4Sample(std::string_view annex_b) : nal_units(splitNalUnits(annex_b)) {
+  for (std::string_view nal_unit : nal_units) {
+    size += sizeof(uint32_t) + nal_unit.size();
+  }
+}
+
+// Appends big-endian fields and nested boxes to a buffer.
+struct BoxWriter {
+  void U8(uint8_t value) { out.push_back(static_cast<char>(value)); }
+
+  void U16(uint16_t value) {
+    value = htobe16(value);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void U32(uint32_t value) {
+    value = htobe32(value);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void U64(uint64_t value) {
+    value = htobe64(value);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void Bytes(std::string_view bytes) { out.append(bytes); }
+  void Zeroes(size_t count) { out.append(count, '\0'); }
+
+  // The identity matrix, in 16.16 and 2.30 fixed point.
+  void Matrix() {
+    for (uint32_t value : {0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000}) {
+      U32(value);
+    }
+  }
+
+  // Start a box, which lasts until the matching End. Returns where it started.
+  size_t Begin(const char* type) {
+    size_t start = out.size();
+    U32(0);
+    out.append(type, 4);
+    return start;
+  }
+
+  size_t BeginFull(const char* type, uint8_t version, uint32_t flags) {
+    size_t start = Begin(type);
+    U32((uint32_t(version) << 24) | flags);
+    return start;
+  }
+
+  void End(size_t start) { Patch32(start, out.size() - start); }
+
+  void Patch32(size_t offset, uint32_t value) {
+    value = htobe32(value);
+    memcpy(&out[offset], &value, sizeof(value));
+  }
+
+  std::string out;
+};
+
+std::string Mp4InitSegment(const AvcConfig& config) {
+  BoxWriter w;
+
+  size_t ftyp = w.Begin("ftyp");
+  w.Bytes("isom");
+  w.U32(0x200);
+  w.Bytes("isomiso5iso6avc1mp41");
+  w.End(ftyp);
+
+  size_t moov = w.Begin("moov");
+  {
+    size_t mvhd = w.BeginFull("mvhd", 0, 0);
+    w.U32(0);  // creation_time
+    w.U32(0);  // modification_time
+    w.U32(kTimescale);
+    w.U32(0);        // duration, which is in the fragments
+    w.U32(0x10000);  // rate
+    w.U16(0x100);    // volume
+    w.Zeroes(10);
+    w.Matrix();
+    w.Zeroes(24);  // pre_defined
+    w.U32(kTrackId + 1);
+    w.End(mvhd);
+
+    size_t trak = w.Begin("trak");
+    {
+      // Enabled, and in the movie.
+      size_t tkhd = w.BeginFull("tkhd", 0, 0x3);
+      w.U32(0);  // creation_time
+      w.U32(0);  // modification_time
+      w.U32(kTrackId);
+      w.U32(0);  // reserved
+      w.U32(0);  // duration
+      w.Zeroes(8);
+      w.U16(0);  // layer
+      w.U16(0);  // alternate_group
+      w.U16(0);  // volume
+      w.U16(0);
+      w.Matrix();
+      w.U32(config.width << 16);
+      w.U32(config.height << 16);
+      w.End(tkhd);
+
+      size_t mdia = w.Begin("mdia");
+      {
+        size_t mdhd = w.BeginFull("mdhd", 0, 0);
+        w.U32(0);  // creation_time
+        w.U32(0);  // modification_time
+        w.U32(kTimescale);
+        w.U32(0);       // duration
+        w.U16(0x55c4);  // "und"
+        w.U16(0);
+        w.End(mdhd);
+
+        size_t hdlr = w.BeginFull("hdlr", 0, 0);
+        w.U32(0);
+        w.Bytes("vide");
+        w.Zeroes(12);
+        w.Bytes(std::string_view("wardenclyffe", sizeof("wardenclyffe")));
+        w.End(hdlr);
+
+        size_t minf = w.Begin("minf");
+        {
+          size_t vmhd = w.BeginFull("vmhd", 0, 0x1);
+          w.Zeroes(8);  // graphicsmode, opcolor
+          w.End(vmhd);
+
+          size_t dinf = w.Begin("dinf");
+          size_t dref = w.BeginFull("dref", 0, 0);
+          w.U32(1);
+          // Self-contained.
+          w.End(w.BeginFull("url ", 0, 0x1));
+          w.End(dref);
+          w.End(dinf);
+
+          size_t stbl = w.Begin("stbl");
+          {
+            size_t stsd = w.BeginFull("stsd", 0, 0);
+            w.U32(1);
+            size_t avc1 = w.Begin("avc1");
+            w.Zeroes(6);
+            w.U16(1);  // data_reference_index
+            w.Zeroes(16);
+            w.U16(config.width);
+            w.U16(config.height);
+            w.U32(0x480000);  // 72 dpi
+            w.U32(0x480000);
+            w.U32(0);
+            w.U16(1);      // frame_count
+            w.Zeroes(32);  // compressorname
+            w.U16(0x18);   // depth
+            w.U16(0xffff);
+
+            size_t avcc = w.Begin("avcC");
+            w.U8(1);              // configurationVersion
+            w.U8(config.sps[1]);  // profile
+            w.U8(config.sps[2]);  // profile compatibility
+            w.U8(config.sps[3]);  // level
+            w.U8(0xfc | 3);       // 4 byte NAL unit lengths
+            w.U8(0xe0 | 1);       // one SPS
+            w.U16(config.sps.size());
+            w.Bytes(config.sps);
+            w.U8(1);  // one PPS
+            w.U16(config.pps.size());
+            w.Bytes(config.pps);
+            w.End(avcc);
+            w.End(avc1);
+            w.End(stsd);
+
+            // Every sample is in the fragments, so the sample tables are empty.
+            for (const char* type : {"stts", "stsc", "stco"}) {
+              size_t box = w.BeginFull(type, 0, 0);
+              w.U32(0);
+              w.End(box);
+            }
+            size_t stsz = w.BeginFull("stsz", 0, 0);
+            w.U32(0);
+            w.U32(0);
+            w.End(stsz);
+          }
+          w.End(stbl);
+        }
+        w.End(minf);
+      }
+      w.End(mdia);
+    }
+    w.End(trak);
+
+    size_t mvex = w.Begin("mvex");
+    size_t trex = w.BeginFull("trex", 0, 0);
+    w.U32(kTrackId);
+    w.U32(1);  // default_sample_description_index
+    w.U32(0);  // default_sample_duration
+    w.U32(0);  // default_sample_size
+    w.U32(0);  // default_sample_flags
+    w.End(trex);
+    w.End(mvex);
+  }
+  w.End(moov);
+
+  return std::move(w.out);
+}
+
+std::string Mp4FragmentHeader(uint32_t sequence, uint64_t decode_time, uint32_t duration,
+                              bool keyframe, const Mp4Sample& sample) {
+  // sample_depends_on = 2 for keyframes. Everything else depends on something, and isn't a sync
+  // sample.
+  static constexpr uint32_t kKeyframeFlags = 0x02000000;
+  static constexpr uint32_t kInterframeFlags = 0x01010000;
+
+  // data-offset, sample-duration, sample-size and sample-flags present.
+  static constexpr uint32_t kTrunFlags = 0x000001 | 0x000100 | 0x000200 | 0x000400;
+
+  // default-base-is-moof, so that data offsets are relative to the moof.
+  static constexpr uint32_t kTfhdFlags = 0x020000;
+
+  BoxWriter w;
+  size_t data_offset = 0;
+  size_t moof = w.Begin("moof");
+  {
+    size_t mfhd = w.BeginFull("mfhd", 0, 0);
+    w.U32(sequence);
+    w.End(mfhd);
+
+    size_t traf = w.Begin("traf");
+    {
+      size_t tfhd = w.BeginFull("tfhd", 0, kTfhdFlags);
+      w.U32(kTrackId);
+      w.End(tfhd);
+
+      size_t tfdt = w.BeginFull("tfdt", 1, 0);
+      w.U64(decode_time);
+      w.End(tfdt);
+
+      size_t trun = w.BeginFull("trun", 0, kTrunFlags);
+      w.U32(1);  // sample_count
+      data_offset = w.out.size();
+      w.U32(0);
+      w.U32(duration);
+      w.U32(sample.size);
+      w.U32(keyframe ? kKeyframeFlags : kInterframeFlags);
+      w.End(trun);
+    }
+    w.End(traf);
+  }
+  w.End(moof);
+
+  // The sample starts right after the mdat's header.
+  w.Patch32(data_offset, w.out.size() + 8);
+
+  w.U32(8 + sample.size);
+  w.Bytes("mdat");
+  return std::move(w.out);
+}
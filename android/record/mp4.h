@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Just enough fragmented MP4 (ISO/IEC 14496-12) to record H.264: an init segment describing one
+// video track, followed by one fragment per frame. Timestamps are in microseconds, like frame
+// timestamps, so the track's timescale is 1 MHz.
+
+// What goes into the avcC box, from an Annex B codec config holding an SPS and a PPS.
+struct AvcConfig {
+  static std::optional<AvcConfig> Parse(std::string_view annex_b);
+
+  std::string sps;
+  std::string pps;
+
+  // Display size, after cropping.
+  uint32_t width = 0;
+  uint32_t height = 0;
+};
+
+// ftyp and moov for a single H.264 track.
+std::string Mp4InitSegment(const AvcConfig& config);
+
+// A frame, with its NAL units split out of the Annex B bitstream.
+struct Mp4Sample {
+  explicit Mp4Sample(std::string_view annex_b);
+
+  std::vector<std::string_view> nal_units;
+
+  // Size of the sample in the mdat, with a 4 byte length in front of every NAL unit.
+  size_t size = 0;
+};
+
+// The moof and mdat header for one sample, which goes in front of the sample's NAL units.
+// |decode_time| is relative to the start of the track.
+std::string Mp4FragmentHeader(uint32_t sequence, uint64_t decode_time, uint32_t duration,
+                              bool keyframe, const Mp4Sample& sample);
@@ -0,0 +1,522 @@
+#include "wardenclyffe/android/record/record.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <optional>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <json/json.h>
+
+#include "wardenclyffe/android/stats.h"
+#include "wardenclyffe/android/video/video.h"
+
+using namespace android;
+using namespace std::chrono_literals;
+
+static constexpr off_t kDefaultMaxSize = off_t(256) << 20;
+static constexpr std::chrono::seconds kDefaultSegmentDuration = 10s;
+
+// The current (or last) recording. Segments are appended by the recording thread, and read by
+// ClipSockets.
+static std::mutex recording_mutex;
+static bool recording GUARDED_BY(recording_mutex) = false;
+static std::deque<RecordedSegment> segments GUARDED_BY(recording_mutex);
+
+// Delete what's left of the last recording, and make sure that there's somewhere to put the next.
+static bool prepareDirectory(const std::string& directory) {
+  size_t end = 0;
+  do {
+    end = directory.find('/', end + 1);
+    std::string prefix = directory.substr(0, end);
+    if (mkdir(prefix.c_str(), 0700) != 0 && errno != EEXIST) {
+      PLOG(ERROR) << "failed to create " << prefix;
+      return false;
+    }
+  } while (end != std::string::npos);
+
+  std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(directory.c_str()), closedir);
+  if (!dir) {
+    PLOG(ERROR) << "failed to open " << directory;
+    return false;
+  }
+  while (dirent* entry = readdir(dir.get())) {
+    std::string_view name = entry->d_name;
+    if (android::base::StartsWith(name, "segment-") && android::base::EndsWith(name, ".mp4") &&
+        unlinkat(dirfd(dir.get()), entry->d_name, 0) != 0) {
+      PLOG(WARNING) << "failed to delete " << directory << "/" << name;
+    }
+  }
+  return true;
+}
+
+// writev everything in |iov|, however many calls it takes.
+static bool writeFully(int fd, std::vector<iovec> iov) {
+  size_t index = 0;
+  while (index < iov.size()) {
+    ssize_t rc = TEMP_FAILURE_RETRY(
+        writev(fd, &iov[index], std::min<size_t>(iov.size() - index, IOV_MAX)));
+    if (rc < 0) {
+      return false;
+    }
+
+    size_t written = rc;
+    while (index < iov.size() && written >= iov[index].iov_len) {
+      written -= iov[index].iov_len;
+      ++index;
+    }
+    if (index < iov.size()) {
+      iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + written;
+      iov[index].iov_len -= written;
+    }
+  }
+  return true;
+}
+
+static bool sameConfig(const sp<const Frame>& a, const sp<const Frame>& b) {
+  return a == b || (a->payload_size() == b->payload_size() &&
+                    !memcmp(a->payload(), b->payload(), a->payload_size()));
+}
+
+Socket* RecordSocket::Create(std::string_view path) {
+  if (android::base::ConsumePrefix(&path, "clip/")) {
+    return ClipSocket::Create(path);
+  }
+
+  // Everything that isn't ours picks the pipeline.
+  std::vector<std::string> video_options = {"header=binary"};
+  off_t max_size = kDefaultMaxSize;
+  std::chrono::microseconds segment_duration = kDefaultSegmentDuration;
+  if (size_t query_start = path.find('?'); query_start != std::string_view::npos) {
+    for (const std::string& option :
+         android::base::Split(std::string(path.substr(query_start + 1)), "&")) {
+      std::string_view value = option;
+      uint32_t parsed;
+      if (option.empty() || option == "header=binary") {
+        continue;
+      } else if (android::base::ConsumePrefix(&value, "max_size=")) {
+        if (!android::base::ParseUint(std::string(value), &parsed) || parsed == 0) {
+          LOG(ERROR) << "Invalid record option '" << option << "'";
+          return nullptr;
+        }
+        max_size = off_t(parsed) << 20;
+      } else if (android::base::ConsumePrefix(&value, "segment=")) {
+        if (!android::base::ParseUint(std::string(value), &parsed) || parsed == 0) {
+          LOG(ERROR) << "Invalid record option '" << option << "'";
+          return nullptr;
+        }
+        segment_duration = std::chrono::seconds(parsed);
+      } else {
+        video_options.push_back(option);
+      }
+    }
+    path = path.substr(0, query_start);
+  }
+  if (!path.empty()) {
+    LOG(ERROR) << "Unknown record path '" << path << "'";
+    return nullptr;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+    if (recording) {
+      LOG(ERROR) << "Already recording";
+      return nullptr;
+    }
+    recording = true;
+    segments.clear();
+  }
+
+  std::string directory =
+      android::base::GetProperty("wardenclyffe.record.dir", "/data/local/tmp/wardenclyffe/record");
+  std::unique_ptr<Socket> source;
+  if (prepareDirectory(directory)) {
+    source.reset(VideoSocket::Create("h264/?" + android::base::Join(video_options, "&")));
+  }
+  if (!source) {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+    recording = false;
+    return nullptr;
+  }
+
+  LOG(INFO) << "Recording to " << directory << ", up to " << (max_size >> 20) << " MiB";
+  return new RecordSocket(std::move(source), std::move(directory), max_size, segment_duration);
+}
+
+RecordSocket::RecordSocket(std::unique_ptr<Socket> source, std::string directory, off_t max_size,
+                           std::chrono::microseconds segment_duration)
+    : source_(std::move(source)),
+      directory_(std::move(directory)),
+      max_size_(max_size),
+      segment_duration_(segment_duration) {
+  thread_ = std::thread([this]() { run(); });
+}
+
+RecordSocket::~RecordSocket() {
+  RecordSocket::Destroy();
+  thread_.join();
+
+  std::lock_guard<std::mutex> lock(recording_mutex);
+  recording = false;
+}
+
+void RecordSocket::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+
+  // Unblocks the recording thread, which finishes off the segment that it's writing.
+  source_->Destroy();
+}
+
+void RecordSocket::run() {
+  bool ok = true;
+  while (true) {
+    WardenclyffeReads reads = source_->Read();
+    if (reads.read_count < 0) {
+      LOG(ERROR) << "Failed to read frames to record";
+      ok = false;
+      break;
+    } else if (reads.read_count == 0) {
+      break;
+    }
+
+    for (ptrdiff_t i = 0; i < reads.read_count; ++i) {
+      const WardenclyffeRead& read = reads.reads[i];
+      if (!read.frame) {
+        continue;
+      }
+
+      // Trade the read's reference for our own.
+      sp<const Frame> frame = static_cast<const Frame*>(read.frame);
+      frame->decStrong(nullptr);
+      if (ok && !read.oob) {
+        ok = handleFrame(frame);
+      }
+    }
+    source_->OnReadsSent();
+
+    if (!ok) {
+      break;
+    }
+  }
+
+  if (ok && pending_frame_) {
+    writePendingFrame(pending_frame_->timestamp + last_duration_);
+  }
+  segment_fd_.reset();
+  source_->Destroy();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    failed_ = !ok;
+  }
+  cv_.notify_all();
+}
+
+bool RecordSocket::handleFrame(const sp<const Frame>& frame) {
+  // Keyframes carry their own config.
+  if (frame->type == FrameType::Description) {
+    return true;
+  }
+
+  // Segments have to start with a keyframe.
+  bool keyframe = frame->type == FrameType::Keyframe;
+  if (!segment_fd_.ok() && (!keyframe || !frame->config)) {
+    return true;
+  }
+
+  if (!writePendingFrame(frame->timestamp)) {
+    return false;
+  }
+
+  int64_t segment_age = frame->timestamp - segment_start_;
+  if (keyframe) {
+    bool config_changed = frame->config && (!config_ || !sameConfig(config_, frame->config));
+    if (config_changed) {
+      config_ = frame->config;
+      ++config_id_;
+    }
+    if (!segment_fd_.ok() || config_changed || segment_age >= segment_duration_.count()) {
+      if (!startSegment(*frame)) {
+        return false;
+      }
+    }
+  } else if (!keyframe_requested_ && segment_age >= segment_duration_.count()) {
+    // Keyframes only happen on demand, so ask for one to start the next segment with.
+    static constexpr std::string_view kKeyframeRequest = R"({"type":"keyframe"})";
+    source_->Write(kKeyframeRequest.data(), kKeyframeRequest.size());
+    keyframe_requested_ = true;
+  }
+
+  pending_frame_ = frame;
+  return true;
+}
+
+bool RecordSocket::startSegment(const Frame& keyframe) {
+  std::optional<AvcConfig> config =
+      AvcConfig::Parse(std::string_view(config_->payload(), config_->payload_size()));
+  if (!config) {
+    return false;
+  }
+  std::string init_segment = Mp4InitSegment(*config);
+
+  std::string path = android::base::StringPrintf("%s/segment-%06" PRIu64 ".mp4",
+                                                 directory_.c_str(), next_segment_);
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  if (!fd.ok()) {
+    PLOG(ERROR) << "failed to create " << path;
+    return false;
+  }
+  if (!writeFully(fd.get(), {{init_segment.data(), init_segment.size()}})) {
+    PLOG(ERROR) << "failed to write to " << path;
+    return false;
+  }
+
+  if (next_segment_++ == 0) {
+    first_timestamp_ = keyframe.timestamp;
+  }
+  segment_fd_ = std::move(fd);
+  segment_start_ = keyframe.timestamp;
+  keyframe_requested_ = false;
+
+  RecordedSegment segment;
+  segment.path = std::move(path);
+  segment.config_id = config_id_;
+  segment.init_size = init_segment.size();
+  segment.size = init_segment.size();
+  segment.end_timestamp = keyframe.timestamp;
+
+  std::lock_guard<std::mutex> lock(recording_mutex);
+  segments.push_back(std::move(segment));
+  return true;
+}
+
+bool RecordSocket::writePendingFrame(int64_t next_timestamp) {
+  if (!pending_frame_) {
+    return true;
+  }
+  sp<const Frame> frame = std::move(pending_frame_);
+  pending_frame_ = nullptr;
+
+  // Timestamps should always go up, but don't write a zero-length frame if they don't.
+  int64_t duration = next_timestamp - frame->timestamp;
+  if (duration <= 0) {
+    duration = std::max<int64_t>(last_duration_, 1);
+  }
+  last_duration_ = duration;
+
+  bool keyframe = frame->type == FrameType::Keyframe;
+  Mp4Sample sample(std::string_view(frame->payload(), frame->payload_size()));
+  std::string header = Mp4FragmentHeader(next_fragment_sequence_++,
+                                         frame->timestamp - first_timestamp_, duration, keyframe,
+                                         sample);
+
+  // Write the NAL units straight out of the frame, each with its length in front.
+  std::vector<uint32_t> lengths;
+  lengths.reserve(sample.nal_units.size());
+  std::vector<iovec> iov = {{header.data(), header.size()}};
+  for (std::string_view nal_unit : sample.nal_units) {
+    lengths.push_back(htobe32(nal_unit.size()));
+    iov.push_back({&lengths.back(), sizeof(uint32_t)});
+    iov.push_back({const_cast<char*>(nal_unit.data()), nal_unit.size()});
+  }
+  if (!writeFully(segment_fd_.get(), std::move(iov))) {
+    PLOG(ERROR) << "failed to write recording segment";
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+    RecordedSegment& segment = segments.back();
+    if (keyframe) {
+      segment.keyframes.push_back({.timestamp = frame->timestamp, .offset = segment.size});
+    }
+    segment.size += header.size() + sample.size;
+    segment.end_timestamp = frame->timestamp;
+  }
+  trimRing();
+  return true;
+}
+
+void RecordSocket::trimRing() {
+  std::vector<std::string> doomed;
+  {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+    off_t total_size = 0;
+    for (const RecordedSegment& segment : segments) {
+      total_size += segment.size;
+    }
+
+    // Never the one that's being written.
+    while (segments.size() > 1 && total_size > max_size_) {
+      total_size -= segments.front().size;
+      doomed.push_back(std::move(segments.front().path));
+      segments.pop_front();
+    }
+  }
+
+  for (const std::string& path : doomed) {
+    if (unlink(path.c_str()) != 0) {
+      PLOG(WARNING) << "failed to delete " << path;
+    }
+  }
+}
+
+WardenclyffeReads RecordSocket::Read() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (status_sent_) {
+      cv_.wait_for(lock, 1s);
+    }
+    if (failed_) {
+      return {.reads = nullptr, .read_count = -1};
+    } else if (stopped_) {
+      return {.reads = nullptr, .read_count = 0};
+    }
+  }
+
+  Json::Value status;
+  {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+    off_t size = 0;
+    for (const RecordedSegment& segment : segments) {
+      size += segment.size;
+    }
+    status["segments"] = Json::UInt64(segments.size());
+    status["size"] = Json::Int64(size);
+    status["duration"] =
+        segments.empty() || segments.front().keyframes.empty()
+            ? 0.0
+            : (segments.back().end_timestamp - segments.front().keyframes.front().timestamp) / 1e6;
+  }
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  status_ = Json::writeString(builder, status);
+  status_sent_ = true;
+
+  read_ = WardenclyffeRead{
+      .data = status_.data(),
+      .size = status_.size(),
+      .oob = true,
+      .frame = nullptr,
+  };
+  return {.reads = &read_, .read_count = 1};
+}
+
+Socket* ClipSocket::Create(std::string_view path) {
+  std::optional<int64_t> since;
+  if (size_t query_start = path.find('?'); query_start != std::string_view::npos) {
+    for (const std::string& option :
+         android::base::Split(std::string(path.substr(query_start + 1)), "&")) {
+      std::string_view value = option;
+      uint32_t seconds;
+      if (option.empty()) {
+        continue;
+      } else if (android::base::ConsumePrefix(&value, "since=") &&
+                 android::base::ParseUint(std::string(value), &seconds)) {
+        since = int64_t(seconds) * 1'000'000;
+      } else {
+        LOG(ERROR) << "Invalid clip option '" << option << "'";
+        return nullptr;
+      }
+    }
+    path = path.substr(0, query_start);
+  }
+  if (!path.empty()) {
+    LOG(ERROR) << "Unknown clip path '" << path << "'";
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(recording_mutex);
+
+  // Find the last keyframe that's old enough, or the first one if none are.
+  std::optional<std::pair<size_t, off_t>> start;
+  int64_t cutoff = since ? PipelineStats::Now() - *since : 0;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    for (const RecordedSegment::Keyframe& keyframe : segments[i].keyframes) {
+      if (!start || (since && keyframe.timestamp <= cutoff)) {
+        start = {i, keyframe.offset};
+      }
+    }
+  }
+  if (!start) {
+    LOG(ERROR) << "Nothing has been recorded";
+    return nullptr;
+  }
+
+  // The first segment's init segment, and then every fragment from the start onwards.
+  std::vector<android::base::unique_fd> files;
+  std::vector<Range> ranges;
+  auto [first, offset] = *start;
+  for (size_t i = first; i < segments.size(); ++i) {
+    const RecordedSegment& segment = segments[i];
+    if (segment.config_id != segments[first].config_id) {
+      break;
+    }
+
+    android::base::unique_fd fd(
+        TEMP_FAILURE_RETRY(open(segment.path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (!fd.ok()) {
+      PLOG(ERROR) << "failed to open " << segment.path;
+      return nullptr;
+    }
+    files.push_back(std::move(fd));
+
+    if (i == first) {
+      ranges.push_back({.file = files.size() - 1, .offset = 0, .end = segment.init_size});
+    } else {
+      offset = segment.init_size;
+    }
+    ranges.push_back({.file = files.size() - 1, .offset = offset, .end = segment.size});
+  }
+
+  return new ClipSocket(std::move(files), std::move(ranges));
+}
+
+WardenclyffeReads ClipSocket::Read() {
+  while (current_ < ranges_.size() && ranges_[current_].offset >= ranges_[current_].end) {
+    ++current_;
+  }
+  if (current_ == ranges_.size()) {
+    return {.reads = nullptr, .read_count = 0};
+  }
+
+  Range& range = ranges_[current_];
+  size_t size = std::min<off_t>(kChunkSize, range.end - range.offset);
+  buffer_.resize(size);
+  ssize_t rc =
+      TEMP_FAILURE_RETRY(pread(files_[range.file].get(), buffer_.data(), size, range.offset));
+  if (rc <= 0) {
+    PLOG(ERROR) << "failed to read recording";
+    return {.reads = nullptr, .read_count = -1};
+  }
+  range.offset += rc;
+
+  read_ = WardenclyffeRead{
+      .data = buffer_.data(),
+      .size = static_cast<size_t>(rc),
+      .oob = false,
+      .frame = nullptr,
+  };
+  return {.reads = &read_, .read_count = 1};
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/frame.h"
+#include "wardenclyffe/android/record/mp4.h"
+#include "wardenclyffe/android/socket.h"
+#include "wardenclyffe/wardenclyffe.h"
+
+// One file in the recording ring: an init segment, so that it plays on its own, followed by a
+// fragment per frame. Segments always start with a keyframe.
+struct RecordedSegment {
+  struct Keyframe {
+    int64_t timestamp;
+
+    // Where the keyframe's fragment starts in the file.
+    off_t offset;
+  };
+
+  std::string path;
+
+  // Segments with the same config can be played back to back, with only the first one's init
+  // segment.
+  uint64_t config_id = 0;
+  off_t init_size = 0;
+
+  // How much of the file has been written, and the timestamp of the last frame in it.
+  off_t size = 0;
+  int64_t end_timestamp = 0;
+
+  std::vector<Keyframe> keyframes;
+};
+
+// Records H.264 from a VideoSocket pipeline for as long as the socket is open, into a ring of
+// fragmented MP4 segments in wardenclyffe.record.dir. Frames are written as they arrive, without
+// re-encoding, and the oldest segments are deleted to keep the ring under its size limit.
+//
+//   /record/?max_size=<MiB>&segment=<seconds>&<video options>
+//
+// Video options are the same as for /video/h264/, and pick the pipeline to record; recording from
+// the same pipeline as a viewer costs nothing extra. Each read returns a status message, once a
+// second:
+//   {"segments": <n>, "size": <bytes>, "duration": <seconds>}
+//
+// Only one recording runs at a time. The recording stays on disk after the socket is closed, until
+// the next one starts, and clips of it are served by /record/clip/, see ClipSocket.
+struct RecordSocket : public Socket {
+  ~RecordSocket();
+
+  static Socket* Create(std::string_view path);
+
+  virtual void Destroy() final;
+
+  virtual WardenclyffeReads Read() final;
+  virtual bool SupportsRead() final { return true; }
+
+ private:
+  RecordSocket(std::unique_ptr<Socket> source, std::string directory, off_t max_size,
+               std::chrono::microseconds segment_duration);
+
+  void run();
+  bool handleFrame(const android::sp<const Frame>& frame);
+
+  // Close the current segment, and start a new one with |keyframe|'s config.
+  bool startSegment(const Frame& keyframe);
+
+  // Write out the frame that's waiting for the next one to know how long it lasts.
+  bool writePendingFrame(int64_t next_timestamp);
+
+  // Delete the oldest segments until the ring fits in max_size_.
+  void trimRing();
+
+  const std::unique_ptr<Socket> source_;
+  const std::string directory_;
+  const off_t max_size_;
+  const std::chrono::microseconds segment_duration_;
+
+  // Recording state, only touched by the recording thread.
+  android::base::unique_fd segment_fd_;
+  android::sp<const Frame> config_;
+  uint64_t config_id_ = 0;
+  uint64_t next_segment_ = 0;
+  uint32_t next_fragment_sequence_ = 1;
+  int64_t first_timestamp_ = 0;
+  int64_t segment_start_ = 0;
+  bool keyframe_requested_ = false;
+  android::sp<const Frame> pending_frame_;
+  int64_t last_duration_ = 0;
+
+  std::thread thread_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopped_ GUARDED_BY(mutex_) = false;
+  bool failed_ GUARDED_BY(mutex_) = false;
+
+  bool status_sent_ = false;
+  std::string status_;
+  WardenclyffeRead read_;
+};
+
+// Serves a clip of the recording as a single fragmented MP4 file, in chunks:
+//
+//   /record/clip/?since=<seconds>
+//
+// The clip starts at the last keyframe that's at least |since| seconds old, or at the start of the
+// recording if there isn't one, and runs up to the newest frame recorded when the socket was
+// created, or up to the first change of codec config after its start.
+struct ClipSocket : public Socket {
+  static Socket* Create(std::string_view path);
+
+  virtual WardenclyffeReads Read() final;
+  virtual bool SupportsRead() final { return true; }
+
+ private:
+  // A range of one of files_ to send.
+  struct Range {
+    size_t file;
+    off_t offset;
+    off_t end;
+  };
+
+  ClipSocket(std::vector<android::base::unique_fd> files, std::vector<Range> ranges)
+      : files_(std::move(files)), ranges_(std::move(ranges)) {}
+
+  static constexpr size_t kChunkSize = 256 * 1024;
+
+  // Segments are opened up front, so that they can be read even if they're deleted from the ring.
+  std::vector<android::base::unique_fd> files_;
+  std::vector<Range> ranges_;
+  size_t current_ = 0;
+  std::vector<char> buffer_;
+  WardenclyffeRead read_;
+};
@@ -0,0 +1,97 @@
+#include "wardenclyffe/android/scheduling.h"
+
+#include <sched.h>
+#include <sys/resource.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+using namespace android;
+
+// Parses a list of CPUs and ranges of CPUs like "0,2,4-7".
+static bool parseCpuSet(const std::string& value, cpu_set_t* set) {
+  CPU_ZERO(set);
+  for (const std::string& part : base::Split(value, ",")) {
+    std::vector<std::string> range = base::Split(part, "-");
+    unsigned first, last;
+    if (range.size() > 2 || !base::ParseUint(range[0], &first, unsigned(CPU_SETSIZE - 1))) {
+      return false;
+    }
+    last = first;
+    if (range.size() == 2 &&
+        (!base::ParseUint(range[1], &last, unsigned(CPU_SETSIZE - 1)) || last < first)) {
+      return false;
+    }
+    for (unsigned cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+void TuneCurrentThread(std::string_view role) {
+  std::string prefix = "wardenclyffe." + std::string(role) + ".";
+
+  std::string priority = base::GetProperty(prefix + "priority", "");
+  if (std::string_view fifo = priority; base::ConsumePrefix(&fifo, "fifo:")) {
+    sched_param param = {};
+    if (!base::ParseInt(std::string(fifo), &param.sched_priority, 1, 99)) {
+      LOG(ERROR) << "Invalid " << prefix << "priority '" << priority << "'";
+    } else if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+      PLOG(WARNING) << "failed to set SCHED_FIFO priority for " << role << " thread";
+    }
+  } else if (!priority.empty()) {
+    int nice;
+    if (!base::ParseInt(priority, &nice, -20, 19)) {
+      LOG(ERROR) << "Invalid " << prefix << "priority '" << priority << "'";
+    } else if (setpriority(PRIO_PROCESS, 0, nice) != 0) {
+      PLOG(WARNING) << "failed to set nice value for " << role << " thread";
+    }
+  }
+
+  std::string cpus = base::GetProperty(prefix + "cpus", "");
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    if (!parseCpuSet(cpus, &set)) {
+      LOG(ERROR) << "Invalid " << prefix << "cpus '" << cpus << "'";
+    } else if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      PLOG(WARNING) << "failed to set CPU affinity for " << role << " thread";
+    }
+  }
+}
+
+namespace {
+
+// Runs TuneCurrentThread on a looper's thread, and then gets out of the way.
+struct TuneHandler : public AHandler {
+  explicit TuneHandler(std::string_view role) : role_(role) {}
+
+  virtual void onMessageReceived(const sp<AMessage>&) final {
+    TuneCurrentThread(role_);
+    if (sp<ALooper> self = looper()) {
+      self->unregisterHandler(id());
+    }
+  }
+
+ private:
+  const std::string role_;
+};
+
+}  // namespace
+
+void TuneLooper(const sp<ALooper>& looper, std::string_view role) {
+  auto handler = sp<TuneHandler>::make(role);
+  looper->registerHandler(handler);
+
+  // Loopers only hold weak references to their handlers, so the message keeps this one alive.
+  auto msg = sp<AMessage>::make(0, handler);
+  msg->setObject("handler", handler);
+  msg->post();
+}
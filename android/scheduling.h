@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string_view>
+
+#include <media/stagefright/foundation/ALooper.h>
+#include <utils/StrongPointer.h>
+
+// Scheduling for the threads on the frame path, so that the stream holds up while the foreground
+// app keeps the device busy. It's configured with system properties, per role:
+//
+//   wardenclyffe.<role>.priority  "fifo:<1-99>" for SCHED_FIFO, or a nice value
+//   wardenclyffe.<role>.cpus      the CPUs to run on, e.g. "4-7" or "0,2,4-5"
+//
+// Properties that aren't set leave the thread alone. SCHED_FIFO needs CAP_SYS_NICE, and failing to
+// get it is only a warning. Roles are "encoder", for the encoder's loopers, and "binder", for the
+// binder thread pool.
+void TuneCurrentThread(std::string_view role);
+
+// Apply |role|'s settings to the thread running |looper|, once it gets to it.
+void TuneLooper(const android::sp<android::ALooper>& looper, std::string_view role);
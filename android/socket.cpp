@@ -5,32 +5,69 @@
 #include <android-base/strings.h>
 #include <binder/IPCThreadState.h>
 
+#include "wardenclyffe/android/audio/audio.h"
+#include "wardenclyffe/android/frame.h"
+#include "wardenclyffe/android/input.h"
+#include "wardenclyffe/android/record/record.h"
+#include "wardenclyffe/android/scheduling.h"
 #include "wardenclyffe/android/socket.h"
+#include "wardenclyffe/android/stats.h"
 #include "wardenclyffe/android/video/video.h"
 #include "wardenclyffe/wardenclyffe.h"
 
+WardenclyffeReads MessageSocket::Read() {
+  if (sent_) {
+    return {.reads = nullptr, .read_count = 0};
+  }
+
+  sent_ = true;
+  read_ = WardenclyffeRead{
+      .data = message_.data(),
+      .size = message_.size(),
+      .oob = true,
+      .frame = nullptr,
+  };
+  return {.reads = &read_, .read_count = 1};
+}
+
 static std::once_flag once;
 
 WardenclyffeSocket wardenclyffe_create_socket(const char* path_str) {
   std::call_once(once, []() {
     // Start Binder thread pool.  MediaCodec needs to be able to receive
     // messages from mediaserver.
-    android::sp<android::ProcessState> self = android::ProcessState::self();
-    self->startThreadPool();
+    //
+    // Pool threads inherit their scheduling from the thread that starts them, so start them from
+    // a thread of their own to keep the caller's as it was.
+    std::thread([]() {
+      TuneCurrentThread("binder");
+      android::sp<android::ProcessState> self = android::ProcessState::self();
+      self->startThreadPool();
+    }).join();
+
+    VideoSocket::ProbeCodecs();
   });
 
   std::string_view path(path_str);
   if (android::base::ConsumePrefix(&path, "/video/")) {
     return VideoSocket::Create(path);
   } else if (android::base::ConsumePrefix(&path, "/audio/")) {
-    // TODO
+    return AudioSocket::Create(path);
   } else if (android::base::ConsumePrefix(&path, "/input/")) {
-    // TODO
+    return InputSocket::Create(path);
+  } else if (android::base::ConsumePrefix(&path, "/stats/")) {
+    return CreateStatsSocket(path);
+  } else if (android::base::ConsumePrefix(&path, "/record/")) {
+    return RecordSocket::Create(path);
   }
 
   return nullptr;
 }
 
+void wardenclyffe_close_socket(WardenclyffeSocket socket) {
+  static_cast<Socket*>(socket)->Destroy();
+}
+
 void wardenclyffe_destroy_socket(WardenclyffeSocket socket) {
   auto s = static_cast<Socket*>(socket);
   s->Destroy();
@@ -45,6 +82,14 @@ WardenclyffeReads wardenclyffe_read(WardenclyffeSocket socket) {
   return static_cast<Socket*>(socket)->Read();
 }
 
+void wardenclyffe_reads_sent(WardenclyffeSocket socket) {
+  static_cast<Socket*>(socket)->OnReadsSent();
+}
+
+void wardenclyffe_release_frame(WardenclyffeFrame frame) {
+  static_cast<const Frame*>(frame)->decStrong(nullptr);
+}
+
 bool wardenclyffe_supports_write(WardenclyffeSocket socket) {
   return static_cast<Socket*>(socket)->SupportsWrite();
 }
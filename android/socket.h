@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <string>
 #include <string_view>
 #include <utility>
 
@@ -13,6 +14,8 @@
 
 struct Socket {
   virtual ~Socket() = default;
+
+  // Stop the socket, and wake up any blocked readers. May be called more than once.
   virtual void Destroy() {}
 
   virtual WardenclyffeReads Read() { return {.reads = nullptr, .read_count = 0}; }
@@ -22,4 +25,20 @@ struct Socket {
     return false;
   }
   virtual bool SupportsWrite() { return false; }
+
+  // Called, in order, once everything returned by each Read has been sent to the client.
+  virtual void OnReadsSent() {}
+};
+
+// Sends a single out-of-band message, then EOF.
+struct MessageSocket : public Socket {
+  explicit MessageSocket(std::string message) : message_(std::move(message)) {}
+
+  virtual WardenclyffeReads Read() final;
+  virtual bool SupportsRead() final { return true; }
+
+ private:
+  std::string message_;
+  WardenclyffeRead read_;
+  bool sent_ = false;
 };
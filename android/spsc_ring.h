@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// A bounded lock-free queue, with one producer thread and one consumer thread.
+//
+// Each side owns one of the indices and only reads the other, so neither can block the other. The
+// producer role may move between threads, as long as something else orders the handoff (e.g. a
+// mutex that every producer holds while pushing). Same for the consumer.
+template <typename T>
+struct SpscRing {
+  // |capacity| is rounded up to a power of two.
+  explicit SpscRing(size_t capacity) : slots_(roundUpToPowerOfTwo(capacity)) {}
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  size_t capacity() const { return slots_.size(); }
+
+  // Exact when called from either the producer or the consumer, approximate anywhere else.
+  size_t size() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+
+  // Producer only. Returns false, without consuming |value|, if the ring is full.
+  bool Push(T&& value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+    slots_[head & (slots_.size() - 1)] = std::move(value);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only.
+  std::optional<T> Pop() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return std::nullopt;
+    }
+    T& slot = slots_[tail & (slots_.size() - 1)];
+    std::optional<T> value(std::move(slot));
+    slot = T();
+    tail_.store(tail + 1, std::memory_order_release);
+    return value;
+  }
+
+ private:
+  static size_t roundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  std::vector<T> slots_;
+
+  // Kept on separate cache lines, so that the two sides don't bounce one between them.
+  alignas(64) std::atomic<size_t> head_ = 0;
+  alignas(64) std::atomic<size_t> tail_ = 0;
+};
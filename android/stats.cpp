@@ -0,0 +1,125 @@
+#include "wardenclyffe/android/stats.h"
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <json/json.h>
+#include <utils/Timers.h>
+
+#include "wardenclyffe/android/video/video.h"
+
+size_t LatencyHistogram::bucketIndex(uint64_t value) {
+  value = std::min<uint64_t>(value, (uint64_t(1) << kMaxBits) - 1);
+  if (value < kSubBuckets) {
+    return value;
+  }
+
+  // The top kSubBucketBits + 1 bits pick the bucket, and the rest are dropped.
+  int shift = 64 - __builtin_clzll(value) - 1 - kSubBucketBits;
+  size_t sub_bucket = (value >> shift) & (kSubBuckets - 1);
+  return (shift + 1) * kSubBuckets + sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucketValue(size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  int shift = index / kSubBuckets - 1;
+  uint64_t lower = (kSubBuckets + index % kSubBuckets) << shift;
+  return lower + ((uint64_t(1) << shift) >> 1);
+}
+
+void LatencyHistogram::Record(int64_t latency_us) {
+  latency_us = std::max<int64_t>(latency_us, 0);
+  buckets_[bucketIndex(latency_us)].fetch_add(1, std::memory_order_relaxed);
+
+  int64_t max = max_.load(std::memory_order_relaxed);
+  while (latency_us > max &&
+         !max_.compare_exchange_weak(max, latency_us, std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::Reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  max_.store(0, std::memory_order_relaxed);
+}
+
+Json::Value LatencyHistogram::ToJson() const {
+  std::array<uint64_t, kBucketCount> counts;
+  uint64_t total = 0;
+  for (size_t i = 0; i < kBucketCount; ++i) {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+
+  auto percentile = [&](uint64_t percent) -> uint64_t {
+    uint64_t rank = std::max<uint64_t>((total * percent + 99) / 100, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return bucketValue(i);
+      }
+    }
+    return 0;
+  };
+
+  Json::Value result;
+  result["count"] = Json::UInt64(total);
+  result["p50"] = Json::UInt64(percentile(50));
+  result["p99"] = Json::UInt64(percentile(99));
+  result["max"] = Json::Int64(max_.load(std::memory_order_relaxed));
+  return result;
+}
+
+int64_t PipelineStats::Now() {
+  return systemTime(SYSTEM_TIME_MONOTONIC) / 1000;
+}
+
+void PipelineStats::Reset() {
+  for (LatencyHistogram& histogram : histograms_) {
+    histogram.Reset();
+  }
+}
+
+Json::Value PipelineStats::ToJson() const {
+  static constexpr const char* kStageNames[] = {
+      "acquire", "encoderInput", "encoderOutput", "enqueue", "read", "sent", "decode", "buffer",
+      "render",
+  };
+  static_assert(std::size(kStageNames) == static_cast<size_t>(LatencyStage::Count));
+
+  Json::Value result(Json::objectValue);
+  for (size_t i = 0; i < histograms_.size(); ++i) {
+    result[kStageNames[i]] = histograms_[i].ToJson();
+  }
+  return result;
+}
+
+Socket* CreateStatsSocket(std::string_view path) {
+  bool reset = false;
+  if (size_t query_start = path.find('?'); query_start != std::string_view::npos) {
+    for (const std::string& option :
+         android::base::Split(std::string(path.substr(query_start + 1)), "&")) {
+      if (option == "reset=1") {
+        reset = true;
+      } else if (!option.empty()) {
+        LOG(ERROR) << "Invalid stats option '" << option << "'";
+        return nullptr;
+      }
+    }
+  }
+
+  Json::Value stats;
+  stats["video"] = VideoSocket::DescribeStats(reset);
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  return new MessageSocket(Json::writeString(builder, stats));
+}
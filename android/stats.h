@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <string_view>
+
+#include <json/value.h>
+
+#include "wardenclyffe/android/socket.h"
+
+// A histogram of latencies, in microseconds, that any number of threads can record into without
+// taking a lock.
+//
+// Buckets are exact up to kSubBuckets, and then split each power of two into kSubBuckets, so
+// percentiles are within about 6% of the real value.
+struct LatencyHistogram {
+  void Record(int64_t latency_us);
+
+  // Not atomic with respect to concurrent Records, which might be lost.
+  void Reset();
+
+  // {"count": <n>, "p50": <us>, "p99": <us>, "max": <us>}
+  Json::Value ToJson() const;
+
+ private:
+  static constexpr int kSubBucketBits = 3;
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+
+  // Anything above 2^kMaxBits microseconds (about 16 seconds) lands in the last bucket.
+  static constexpr int kMaxBits = 24;
+  static constexpr size_t kBucketCount = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+  static size_t bucketIndex(uint64_t value);
+
+  // The middle of the range of values that land in bucket |index|.
+  static uint64_t bucketValue(size_t index);
+
+  std::array<std::atomic<uint64_t>, kBucketCount> buckets_ = {};
+  std::atomic<int64_t> max_ = 0;
+};
+
+// Points on a video frame's way from the screen to the client. Server-side stages are measured
+// from when the compositor queued the frame into the virtual display, which is the frame's
+// timestamp, so each one includes the stages before it.
+enum class LatencyStage : size_t {
+  // The buffer was acquired from the virtual display.
+  Acquire,
+
+  // The buffer was handed to the encoder: queued to MediaCodec, or picked up by a JPEG worker.
+  EncoderInput,
+
+  // The encoded frame came out of the encoder.
+  EncoderOutput,
+
+  // The frame was queued for readers.
+  Enqueue,
+
+  // A reader took the frame, through wardenclyffe_read.
+  Read,
+
+  // The WebSocket finished sending the frame, as reported through wardenclyffe_reads_sent.
+  Sent,
+
+  // Reported by clients, as durations: from handing the frame to the decoder to getting it back,
+  // waiting in the client's jitter buffer, and uploading and drawing it.
+  Decode,
+  Buffer,
+  Render,
+
+  Count,
+};
+
+// A set of LatencyHistograms, one per stage, for one pipeline.
+struct PipelineStats {
+  // CLOCK_MONOTONIC, in microseconds, like frame timestamps.
+  static int64_t Now();
+
+  void Record(LatencyStage stage, int64_t latency_us) {
+    histograms_[static_cast<size_t>(stage)].Record(latency_us);
+  }
+
+  // Record how long ago |timestamp_us| was.
+  void RecordSince(LatencyStage stage, int64_t timestamp_us) {
+    Record(stage, Now() - timestamp_us);
+  }
+
+  void Reset();
+
+  // {"acquire": <histogram>, "encoderInput": <histogram>, ...}
+  Json::Value ToJson() const;
+
+ private:
+  std::array<LatencyHistogram, static_cast<size_t>(LatencyStage::Count)> histograms_;
+};
+
+// Returns a socket that reads statistics for every running pipeline as a single JSON message:
+//   {"video": [{"pipeline": <key>, "subscribers": <n>, "droppedFrames": <n>,
+//               "latency": <PipelineStats>}, ...]}
+// JPEG pipelines also report "heldBuffers", the capture buffers they haven't released yet, and
+// "maxHeldBuffers", how many they should ever need at once.
+// With ?reset=1, histograms are cleared once they've been read, so that the next read only covers
+// what happened in between.
+Socket* CreateStatsSocket(std::string_view path);
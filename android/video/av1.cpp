@@ -0,0 +1,19 @@
+#include <media/stagefright/MediaCodecConstants.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/video/video.h"
+
+using namespace android;
+
+const char* AV1Socket::getCodecMimeType() {
+  return "video/av01";
+}
+
+sp<AMessage> AV1Socket::getCodecFormat() {
+  // Keep in sync with the WebCodecs codec string in video.cpp.
+  sp<AMessage> format = getBaseCodecFormat();
+  format->setInt32(KEY_PROFILE, AV1ProfileMain8);
+  format->setInt32(KEY_LEVEL, AV1Level41);
+  return format;
+}
@@ -0,0 +1,19 @@
+#include <media/stagefright/MediaCodecConstants.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/video/video.h"
+
+using namespace android;
+
+const char* HEVCSocket::getCodecMimeType() {
+  return "video/hevc";
+}
+
+sp<AMessage> HEVCSocket::getCodecFormat() {
+  // Keep in sync with the WebCodecs codec string in video.cpp.
+  sp<AMessage> format = getBaseCodecFormat();
+  format->setInt32(KEY_PROFILE, HEVCProfileMain);
+  format->setInt32(KEY_LEVEL, HEVCMainTierLevel41);
+  return format;
+}
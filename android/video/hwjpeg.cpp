@@ -0,0 +1,21 @@
+#include <media/stagefright/MediaCodecConstants.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/video/video.h"
+
+using namespace android;
+
+const char* HardwareJPEGSocket::getCodecMimeType() {
+  return kMimeType;
+}
+
+sp<AMessage> HardwareJPEGSocket::getCodecFormat() {
+  sp<AMessage> format = getBaseCodecFormat();
+
+  // Image encoders are driven by quality rather than bitrate, and every frame stands on its own.
+  format->setInt32(KEY_BITRATE_MODE, BITRATE_MODE_CQ);
+  format->setInt32(KEY_QUALITY, config_.quality.value_or(JPEGSocket::kDefaultQuality));
+  format->setInt32(KEY_I_FRAME_INTERVAL, 0);
+  return format;
+}
@@ -1,4 +1,13 @@
+#include <endian.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <android/bitmap.h>
 #include <binder/IPCThreadState.h>
 #include <media/openmax/OMX_IVCommon.h>
@@ -12,72 +21,441 @@
 
 using namespace android;
 
+bool JPEGSocket::createEncoder() {
+  worker_count_ = android::base::GetUintProperty<size_t>("wardenclyffe.jpeg.workers",
+                                                         kDefaultWorkerCount);
+  worker_count_ = std::max<size_t>(worker_count_, 1);
+
+  // One buffer per worker, one waiting for a worker and one held back by the frame rate limit.
+  max_held_buffers_ = worker_count_ + 2;
+  return true;
+}
+
+bool JPEGSocket::startEncoder() {
+  CHECK(!running_);
+  size_t worker_count = worker_count_;
+
+  {
+    std::lock_guard<std::mutex> lock(jpeg_mutex_);
+    workers_running_ = true;
+
+    // Each worker has at most one frame in flight, but fast workers can get ahead of a slow one.
+    completed_jobs_.resize(worker_count * 2);
+  }
+
+  running_ = true;
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers_.emplace_back([this]() { workerLoop(); });
+  }
+  LOG(INFO) << "Started " << worker_count << " JPEG worker(s)";
+  return true;
+}
+
+void JPEGSocket::stopEncoder() {
+  running_ = false;
+  if (throttled_job_) {
+    releaseBufferLocked(throttled_job_->item);
+  }
+  throttled_job_.reset();
+
+  std::optional<CompressJob> pending_job;
+  {
+    std::lock_guard<std::mutex> lock(jpeg_mutex_);
+    workers_running_ = false;
+    pending_job = std::move(pending_job_);
+    pending_job_.reset();
+  }
+  jpeg_cv_.notify_all();
+  WakeReaders();
+
+  // Workers release buffers back to the display, which needs the lock.
+  buffer_queue_mutex_.unlock();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+  if (pending_job) {
+    releaseBuffer(pending_job->item);
+  }
+  buffer_queue_mutex_.lock();
+}
+
 void JPEGSocket::onFrameReceived() {
-  status_t rc;
-  BufferItem item;
+  CompressJob job;
 
   {
-    std::lock_guard<std::mutex> lock1(frame_mutex_);
-    std::lock_guard<std::mutex> lock2(buffer_queue_mutex_);
+    std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
 
     if (!display_consumer_) {
       LOG(INFO) << "display consumer was destroyed";
       return;
     }
 
-    rc = display_consumer_->acquireBuffer(&item, 0);
+    status_t rc = display_consumer_->acquireBuffer(&job.item, 0);
     if (rc != NO_ERROR) {
       LOG(FATAL) << "failed to acquire buffer from IGraphicBufferConsumer: " << statusToString(rc);
     }
+    ++held_buffers_;
+    stats_.RecordSince(LatencyStage::Acquire, job.item.mTimestamp / 1000);
 
-    // TODO: Hand this buffer back to the virtual display.
-    rc = display_consumer_->detachBuffer(item.mSlot);
-    if (rc != NO_ERROR) {
-      LOG(FATAL) << "failed to detach buffer from IGraphicBufferConsumer: " << statusToString(rc);
+    // A slot's buffer is only sent with its first acquire, so we have to remember it.
+    if (job.item.mGraphicBuffer) {
+      slot_buffers_[job.item.mSlot] = job.item.mGraphicBuffer;
+    }
+    job.buffer = slot_buffers_[job.item.mSlot];
+
+    // Nobody is taking frames: keep only the newest one, to send once somebody is.
+    auto now = std::chrono::steady_clock::now();
+    if (paused_) {
+      holdBack(std::move(job));
+      return;
+    }
+
+    // The virtual display produces frames as fast as the screen changes, so enforce the frame rate
+    // here. The newest early frame is held back rather than dropped, so that the last change before
+    // the screen goes idle still gets sent by the control thread.
+    if (now - last_capture_time_ < std::chrono::duration<float>(1.0f / video_framerate_)) {
+      holdBack(std::move(job));
+      return;
+    }
+    last_capture_time_ = now;
+    if (throttled_job_) {
+      releaseBufferLocked(throttled_job_->item);
+      throttled_job_.reset();
     }
   }
 
-  sp<GraphicBuffer> buffer = item.mGraphicBuffer;
-  void* base = nullptr;
-  rc = buffer->lock(GraphicBuffer::USAGE_SW_READ_OFTEN, &base);
-  if (rc != NO_ERROR) {
-    LOG(FATAL) << "failed to lock GraphicBuffer: " << statusToString(rc);
+  submitJob(std::move(job));
+}
+
+void JPEGSocket::holdBack(CompressJob job) {
+  std::optional<CompressJob> old = std::exchange(throttled_job_, std::move(job));
+  if (old && old->buffer) {
+    releaseBufferLocked(old->item);
+  }
+}
+
+void JPEGSocket::onControlTick() {
+  CompressJob job;
+  {
+    std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    if (paused_ || !throttled_job_ ||
+        now - last_capture_time_ < std::chrono::duration<float>(1.0f / video_framerate_)) {
+      return;
+    }
+    last_capture_time_ = now;
+    job = std::move(*throttled_job_);
+    throttled_job_.reset();
+  }
+  submitJob(std::move(job));
+}
+
+void JPEGSocket::onIdleChanged(bool idle) {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  paused_ = idle;
+  if (!idle) {
+    requestSyncFrame();
+  }
+}
+
+void JPEGSocket::submitJob(CompressJob job) {
+  std::optional<CompressJob> skipped_job;
+  {
+    std::lock_guard<std::mutex> lock(jpeg_mutex_);
+    if (!workers_running_) {
+      skipped_job = std::move(job);
+    } else {
+      if (pending_job_) {
+        // Every worker is busy, and the frame waiting for one is already stale.
+        skipped_job = std::move(pending_job_);
+        if (++skipped_jobs_ % 100 == 1) {
+          LOG(INFO) << "JPEG workers falling behind, skipped " << skipped_jobs_ << " frame(s)";
+        }
+      }
+      pending_job_ = std::move(job);
+    }
+  }
+  jpeg_cv_.notify_one();
+
+  if (skipped_job) {
+    releaseBuffer(skipped_job->item);
+  }
+}
+
+void JPEGSocket::workerLoop() {
+  while (true) {
+    CompressJob job;
+    uint64_t sequence;
+    {
+      std::unique_lock<std::mutex> lock(jpeg_mutex_);
+      base::ScopedLockAssertion lock_assertion(jpeg_mutex_);
+      jpeg_cv_.wait(lock, [this]() {
+        base::ScopedLockAssertion lock_assertion(jpeg_mutex_);
+        if (!workers_running_) return true;
+        return pending_job_ &&
+               next_job_sequence_ - next_output_sequence_ < completed_jobs_.size();
+      });
+
+      if (!workers_running_) {
+        return;
+      }
+
+      job = std::move(*pending_job_);
+      pending_job_.reset();
+      sequence = next_job_sequence_++;
+
+      job.keyframe = keyframe_requested_.exchange(false);
+      job.previous_hashes = std::move(last_hashes_);
+      last_hashes_ = job.hashes.get_future().share();
+    }
+
+    stats_.RecordSince(LatencyStage::EncoderInput, job.item.mTimestamp / 1000);
+    sp<Frame> frame = compress(job);
+    stats_.RecordSince(LatencyStage::EncoderOutput, job.item.mTimestamp / 1000);
+    releaseBuffer(job.item);
+
+    bool new_frames = false;
+    {
+      std::lock_guard<std::mutex> lock(jpeg_mutex_);
+      CompletedJob& completed = completed_jobs_[sequence % completed_jobs_.size()];
+      completed.done = true;
+      completed.frame = std::move(frame);
+
+      // Queue everything that's ready, in capture order.
+      while (true) {
+        CompletedJob& next = completed_jobs_[next_output_sequence_ % completed_jobs_.size()];
+        if (!next.done) break;
+
+        // Frames where nothing changed aren't sent at all.
+        if (next.frame) {
+          encode_timer_.Tick();
+          bool sync_needed;
+          {
+            std::lock_guard<std::mutex> frame_lock(frame_mutex_);
+            sync_needed = pushFrame(std::move(next.frame));
+          }
+          if (sync_needed) {
+            requestSyncFrame();
+          }
+        }
+        next.done = false;
+        next.frame = nullptr;
+        ++next_output_sequence_;
+        new_frames = true;
+      }
+    }
+
+    if (new_frames) {
+      jpeg_cv_.notify_all();
+    }
+  }
+}
+
+static inline uint64_t rotateLeft(uint64_t value, int shift) {
+  return (value << shift) | (value >> (64 - shift));
+}
+
+// Hash |size| bytes into |hash|. The bulk of the input goes through four independent lanes, so that
+// the loop can be vectorized.
+static uint64_t hashBytes(const uint8_t* data, size_t size, uint64_t hash) {
+  static constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15;
+
+  uint64_t lanes[4] = {hash, hash ^ 1, hash ^ 2, hash ^ 3};
+  size_t i = 0;
+  for (; i + sizeof(lanes) <= size; i += sizeof(lanes)) {
+    for (size_t lane = 0; lane < 4; ++lane) {
+      uint64_t word;
+      memcpy(&word, data + i + lane * sizeof(word), sizeof(word));
+      lanes[lane] = (lanes[lane] ^ word) * kMultiplier;
+    }
+  }
+
+  hash = lanes[0] ^ rotateLeft(lanes[1], 16) ^ rotateLeft(lanes[2], 32) ^ rotateLeft(lanes[3], 48);
+  for (; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t)) {
+    uint32_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * kMultiplier;
+  }
+  return hash;
+}
+
+void JPEGSocket::appendJpeg(Frame* frame, const uint8_t* pixels, size_t stride,
+                            uint32_t frame_width, uint32_t frame_height, uint32_t x, uint32_t y,
+                            uint32_t width, uint32_t height) {
+  size_t header_offset = frame->data.size();
+  if (config_.tiles) {
+    frame->data.resize(header_offset + sizeof(PatchHeader));
   }
 
   AndroidBitmapInfo info;
   info.format = ANDROID_BITMAP_FORMAT_RGBA_8888;
   info.flags = ANDROID_BITMAP_FLAGS_ALPHA_PREMUL;
-  info.width = buffer->getWidth();
-  info.height = buffer->getHeight();
-  info.stride = buffer->getStride() * bytesPerPixel(buffer->getPixelFormat());
-
-  std::vector<char> buf;
-  int result =
-      AndroidBitmap_compress(&info, ADATASPACE_SRGB, base, ANDROID_BITMAP_COMPRESS_FORMAT_JPEG, 90,
-                             &buf, [](void* userdata, const void* data, size_t size) -> bool {
-                               auto buf = static_cast<std::vector<char>*>(userdata);
-                               auto p = static_cast<const char*>(data);
-                               buf->insert(buf->end(), p, p + size);
-                               return true;
-                             });
+  info.width = width;
+  info.height = height;
+  info.stride = stride;
+
+  const uint8_t* base = pixels + y * stride + x * 4;
+  int result = AndroidBitmap_compress(&info, ADATASPACE_SRGB, base,
+                                      ANDROID_BITMAP_COMPRESS_FORMAT_JPEG,
+                                      config_.quality.value_or(kDefaultQuality), &frame->data,
+                                      [](void* userdata, const void* data, size_t size) -> bool {
+                                        auto buf = static_cast<std::vector<char>*>(userdata);
+                                        auto p = static_cast<const char*>(data);
+                                        buf->insert(buf->end(), p, p + size);
+                                        return true;
+                                      });
 
   if (result != ANDROID_BITMAP_RESULT_SUCCESS) {
     LOG(FATAL) << "AndroidBitmap_compress failed (rc = " << result << ")";
   }
 
+  if (config_.tiles) {
+    PatchHeader header = {
+        .frame_width = htole16(frame_width),
+        .frame_height = htole16(frame_height),
+        .x = htole16(x),
+        .y = htole16(y),
+        .width = htole16(width),
+        .height = htole16(height),
+        .size = htole32(frame->data.size() - header_offset - sizeof(PatchHeader)),
+    };
+    memcpy(frame->data.data() + header_offset, &header, sizeof(header));
+  }
+}
+
+sp<Frame> JPEGSocket::compress(CompressJob& job) {
+  status_t rc;
+  const sp<GraphicBuffer>& buffer = job.buffer;
+
+  if (job.item.mFence != nullptr) {
+    rc = job.item.mFence->waitForever("JPEGSocket::compress");
+    if (rc != NO_ERROR) {
+      LOG(FATAL) << "failed to wait for acquire fence: " << statusToString(rc);
+    }
+  }
+
+  void* base = nullptr;
+  rc = buffer->lock(GraphicBuffer::USAGE_SW_READ_OFTEN, &base);
+  if (rc != NO_ERROR) {
+    LOG(FATAL) << "failed to lock GraphicBuffer: " << statusToString(rc);
+  }
+
+  const uint8_t* pixels = static_cast<const uint8_t*>(base);
+  uint32_t width = buffer->getWidth();
+  uint32_t height = buffer->getHeight();
+  size_t stride = buffer->getStride() * bytesPerPixel(buffer->getPixelFormat());
+
+  // Hash the frame, and hand the hashes to the next frame before waiting for our own predecessor's.
+  uint32_t tiles_x = (width + kTileSize - 1) / kTileSize;
+  uint32_t tiles_y = (height + kTileSize - 1) / kTileSize;
+  auto hashes = std::make_shared<TileHashes>();
+  hashes->width = width;
+  hashes->height = height;
+  hashes->hashes.assign(tiles_x * tiles_y, 0);
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t* row = pixels + y * stride;
+    uint64_t* tile_hashes = &hashes->hashes[(y / kTileSize) * tiles_x];
+    for (uint32_t tile_x = 0; tile_x < tiles_x; ++tile_x) {
+      uint32_t x = tile_x * kTileSize;
+      uint32_t tile_width = std::min(kTileSize, width - x);
+      tile_hashes[tile_x] = hashBytes(row + x * 4, tile_width * 4, tile_hashes[tile_x]);
+    }
+  }
+  job.hashes.set_value(hashes);
+
+  std::shared_ptr<const TileHashes> previous;
+  if (job.previous_hashes.valid()) {
+    previous = job.previous_hashes.get();
+  }
+
+  bool keyframe = job.keyframe || !previous || previous->width != width ||
+                  previous->height != height;
+  std::vector<bool> changed(hashes->hashes.size(), true);
+  size_t changed_count = changed.size();
+  if (!keyframe) {
+    changed_count = 0;
+    for (size_t i = 0; i < changed.size(); ++i) {
+      changed[i] = hashes->hashes[i] != previous->hashes[i];
+      changed_count += changed[i];
+    }
+  }
+
+  sp<Frame> frame;
+  if (!keyframe && changed_count == 0) {
+    // Nothing to send.
+  } else if (keyframe || !config_.tiles || changed_count * 2 > changed.size()) {
+    // Leave some headroom over the previous frames, so that the buffer doesn't have to grow while
+    // compressing.
+    size_t expected_size = expected_frame_size_;
+    frame = frame_pool_->Acquire(expected_size + expected_size / 4);
+    appendJpeg(frame.get(), pixels, stride, width, height, 0, 0, width, height);
+
+    // Track the frame size with a moving average that reacts quickly to growth.
+    size_t frame_size = frame->payload_size();
+    expected_frame_size_ =
+        frame_size > expected_size ? frame_size : (expected_size * 7 + frame_size) / 8;
+    frame->type = FrameType::Keyframe;
+  } else {
+    size_t expected_size = expected_frame_size_ * changed_count / changed.size();
+    frame = frame_pool_->Acquire(expected_size + expected_size / 4);
+
+    // Send each horizontal run of changed tiles as one patch.
+    for (uint32_t tile_y = 0; tile_y < tiles_y; ++tile_y) {
+      uint32_t tile_x = 0;
+      while (tile_x < tiles_x) {
+        if (!changed[tile_y * tiles_x + tile_x]) {
+          ++tile_x;
+          continue;
+        }
+
+        uint32_t run_start = tile_x;
+        while (tile_x < tiles_x && changed[tile_y * tiles_x + tile_x]) {
+          ++tile_x;
+        }
+
+        uint32_t x = run_start * kTileSize;
+        uint32_t y = tile_y * kTileSize;
+        appendJpeg(frame.get(), pixels, stride, width, height, x, y,
+                   std::min(tile_x * kTileSize, width) - x, std::min(kTileSize, height - y));
+      }
+    }
+    frame->type = FrameType::Interframe;
+  }
+
   rc = buffer->unlock();
   if (rc != NO_ERROR) {
     LOG(FATAL) << "failed to unlock GraphicBuffer: " << statusToString(rc);
   }
 
-  Frame frame;
-  frame.type = FrameType::Keyframe;
+  if (frame) {
+    // Buffer timestamps are in nanoseconds, MediaCodec's (and ours) are in microseconds.
+    frame->timestamp = job.item.mTimestamp / 1000;
+    if (emit_descriptors_) {
+      frame->Describe();
+    }
+  }
+  return frame;
+}
 
-  {
-    std::lock_guard<std::mutex> lock(frame_mutex_);
-    frame.data = std::move(buf);
-    frame.timestamp = item.mTimestamp;
-    frames_.push_back(std::move(frame));
+void JPEGSocket::describeStats(Json::Value* entry) {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  (*entry)["heldBuffers"] = Json::UInt64(held_buffers_);
+  (*entry)["maxHeldBuffers"] = Json::UInt64(max_held_buffers_);
+}
+
+void JPEGSocket::releaseBuffer(const BufferItem& item) {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  releaseBufferLocked(item);
+}
+
+void JPEGSocket::releaseBufferLocked(const BufferItem& item) {
+  // Hand the buffer back to the virtual display.
+  --held_buffers_;
+  if (display_consumer_) {
+    status_t rc = display_consumer_->releaseBuffer(item.mSlot, item.mFrameNumber, Fence::NO_FENCE);
+    if (rc != NO_ERROR) {
+      LOG(WARNING) << "failed to release buffer to IGraphicBufferConsumer: " << statusToString(rc);
+    }
   }
-  cv_.notify_one();
 }
@@ -0,0 +1,429 @@
+#define EGL_EGLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <gui/BufferItem.h>
+#include <gui/BufferQueueDefs.h>
+#include <gui/Surface.h>
+#include <ui/Fence.h>
+#include <ui/GraphicBuffer.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/video/video.h"
+
+using namespace android;
+
+static std::string eglError() {
+  return android::base::StringPrintf("%#x", eglGetError());
+}
+
+// Scales captured frames into every smaller layer's input surface, on the GPU.
+//
+// It's only used with its SimulcastSocket's buffer_queue_mutex_ held, but on whichever thread the
+// frame came in on, so its context is only current for as long as it takes to draw one frame.
+struct GLScaler {
+  ~GLScaler();
+
+  // Each of |outputs| gets drawn into through a window surface of its own, at its own size.
+  static std::unique_ptr<GLScaler> Create(const std::vector<sp<IGraphicBufferProducer>>& outputs);
+
+  // Draw |item| into every output, where it goes to the encoder with the same timestamp. Returns a
+  // fence that signals once the GPU is done reading |item|, or nullptr if nothing was drawn.
+  sp<Fence> Draw(const BufferItem& item);
+
+ private:
+  struct Output {
+    sp<Surface> surface;
+    EGLSurface egl_surface = EGL_NO_SURFACE;
+    EGLint width = 0;
+    EGLint height = 0;
+  };
+
+  struct Image {
+    sp<GraphicBuffer> buffer;
+    EGLImageKHR image = EGL_NO_IMAGE_KHR;
+  };
+
+  bool initialize(const std::vector<sp<IGraphicBufferProducer>>& outputs);
+  bool createProgram();
+  EGLImageKHR imageFor(const sp<GraphicBuffer>& buffer);
+  void destroyImages();
+
+  EGLDisplay display_ = EGL_NO_DISPLAY;
+  EGLContext context_ = EGL_NO_CONTEXT;
+  std::vector<Output> outputs_;
+
+  GLuint program_ = 0;
+  GLuint texture_ = 0;
+  GLint position_location_ = -1;
+  GLint tex_coord_location_ = -1;
+  GLint tap_offset_location_ = -1;
+
+  // The virtual display hands out the same few buffers over and over, so their images are kept
+  // around. Buffers can still come and go, e.g. when the encoder drops one, so there's a limit.
+  static constexpr size_t kMaxImages = BufferQueueDefs::NUM_BUFFER_SLOTS;
+  std::map<uint64_t, Image> images_;
+};
+
+static const char kVertexShader[] = R"(
+attribute vec2 position;
+attribute vec2 texCoord;
+varying vec2 vTexCoord;
+void main() {
+  gl_Position = vec4(position, 0.0, 1.0);
+  vTexCoord = texCoord;
+}
+)";
+
+// Each output pixel averages a square of source pixels, 2x2 for the 1/2 layer and 4x4 for the 1/4
+// layer. Four taps, each a quarter of an output pixel from its center, land where bilinear
+// filtering averages one quarter of that square.
+static const char kFragmentShader[] = R"(#extension GL_OES_EGL_image_external : require
+precision mediump float;
+uniform samplerExternalOES frame;
+uniform vec2 tapOffset;
+varying vec2 vTexCoord;
+void main() {
+  gl_FragColor = 0.25 * (texture2D(frame, vTexCoord - tapOffset) +
+                         texture2D(frame, vTexCoord + tapOffset) +
+                         texture2D(frame, vTexCoord + vec2(tapOffset.x, -tapOffset.y)) +
+                         texture2D(frame, vTexCoord + vec2(-tapOffset.x, tapOffset.y)));
+}
+)";
+
+// A quad that covers the whole output. Buffers start at the top row, and GL surfaces at the
+// bottom one, so the texture is flipped to keep the picture the right way up.
+static const GLfloat kPositions[] = {-1, -1, 1, -1, -1, 1, 1, 1};
+static const GLfloat kTexCoords[] = {0, 1, 1, 1, 0, 0, 1, 0};
+
+static GLuint compileShader(GLenum type, const char* source) {
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, nullptr);
+  glCompileShader(shader);
+
+  GLint compiled = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+  if (!compiled) {
+    char log[512] = {};
+    glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+    LOG(ERROR) << "Failed to compile shader: " << log;
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+std::unique_ptr<GLScaler> GLScaler::Create(const std::vector<sp<IGraphicBufferProducer>>& outputs) {
+  auto scaler = std::make_unique<GLScaler>();
+  if (!scaler->initialize(outputs)) {
+    return nullptr;
+  }
+  return scaler;
+}
+
+bool GLScaler::initialize(const std::vector<sp<IGraphicBufferProducer>>& outputs) {
+  display_ = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display_ == EGL_NO_DISPLAY || !eglInitialize(display_, nullptr, nullptr)) {
+    LOG(ERROR) << "Failed to initialize EGL: " << eglError();
+    display_ = EGL_NO_DISPLAY;
+    return false;
+  }
+
+  // Surfaces that feed an encoder have to be recordable.
+  const EGLint config_attribs[] = {EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+                                   EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT, EGL_SURFACE_TYPE,
+                                   EGL_WINDOW_BIT, EGL_RECORDABLE_ANDROID, EGL_TRUE, EGL_NONE};
+  EGLConfig config;
+  EGLint config_count = 0;
+  if (!eglChooseConfig(display_, config_attribs, &config, 1, &config_count) || config_count == 0) {
+    LOG(ERROR) << "Failed to find a recordable EGL config: " << eglError();
+    return false;
+  }
+
+  const EGLint context_attribs[] = {EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE};
+  context_ = eglCreateContext(display_, config, EGL_NO_CONTEXT, context_attribs);
+  if (context_ == EGL_NO_CONTEXT) {
+    LOG(ERROR) << "Failed to create EGL context: " << eglError();
+    return false;
+  }
+
+  for (const sp<IGraphicBufferProducer>& producer : outputs) {
+    Output& output = outputs_.emplace_back();
+    output.surface = sp<Surface>::make(producer, true /* controlledByApp */);
+    output.egl_surface = eglCreateWindowSurface(display_, config, output.surface.get(), nullptr);
+    if (output.egl_surface == EGL_NO_SURFACE) {
+      LOG(ERROR) << "Failed to create EGL surface for encoder: " << eglError();
+      return false;
+    }
+    eglQuerySurface(display_, output.egl_surface, EGL_WIDTH, &output.width);
+    eglQuerySurface(display_, output.egl_surface, EGL_HEIGHT, &output.height);
+
+    if (!eglMakeCurrent(display_, output.egl_surface, output.egl_surface, context_)) {
+      LOG(ERROR) << "Failed to make EGL context current: " << eglError();
+      return false;
+    }
+
+    // A layer that can't keep up skips frames, rather than holding up the capture.
+    eglSwapInterval(display_, 0);
+  }
+
+  bool created = createProgram();
+  eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  return created;
+}
+
+bool GLScaler::createProgram() {
+  GLuint vertex_shader = compileShader(GL_VERTEX_SHADER, kVertexShader);
+  GLuint fragment_shader = compileShader(GL_FRAGMENT_SHADER, kFragmentShader);
+  if (!vertex_shader || !fragment_shader) {
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    return false;
+  }
+
+  program_ = glCreateProgram();
+  glAttachShader(program_, vertex_shader);
+  glAttachShader(program_, fragment_shader);
+  glLinkProgram(program_);
+  glDeleteShader(vertex_shader);
+  glDeleteShader(fragment_shader);
+
+  GLint linked = GL_FALSE;
+  glGetProgramiv(program_, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    char log[512] = {};
+    glGetProgramInfoLog(program_, sizeof(log), nullptr, log);
+    LOG(ERROR) << "Failed to link shader program: " << log;
+    return false;
+  }
+
+  position_location_ = glGetAttribLocation(program_, "position");
+  tex_coord_location_ = glGetAttribLocation(program_, "texCoord");
+  tap_offset_location_ = glGetUniformLocation(program_, "tapOffset");
+
+  glGenTextures(1, &texture_);
+  glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture_);
+  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  return true;
+}
+
+GLScaler::~GLScaler() {
+  if (display_ == EGL_NO_DISPLAY) {
+    return;
+  }
+
+  // Deleting GL objects needs the context, which needs a surface.
+  EGLSurface surface = outputs_.empty() ? EGL_NO_SURFACE : outputs_[0].egl_surface;
+  if (context_ != EGL_NO_CONTEXT && surface != EGL_NO_SURFACE &&
+      eglMakeCurrent(display_, surface, surface, context_)) {
+    glDeleteTextures(1, &texture_);
+    glDeleteProgram(program_);
+  }
+  destroyImages();
+  eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+  // Destroying the EGL surfaces disconnects from the encoders' input surfaces.
+  for (Output& output : outputs_) {
+    if (output.egl_surface != EGL_NO_SURFACE) {
+      eglDestroySurface(display_, output.egl_surface);
+    }
+  }
+  outputs_.clear();
+
+  if (context_ != EGL_NO_CONTEXT) {
+    eglDestroyContext(display_, context_);
+  }
+
+  // EGL counts initializations, so this doesn't pull the display out from under anyone else.
+  eglTerminate(display_);
+}
+
+EGLImageKHR GLScaler::imageFor(const sp<GraphicBuffer>& buffer) {
+  if (auto it = images_.find(buffer->getId()); it != images_.end()) {
+    return it->second.image;
+  }
+  if (images_.size() >= kMaxImages) {
+    destroyImages();
+  }
+
+  const EGLint attribs[] = {EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE};
+  EGLImageKHR image =
+      eglCreateImageKHR(display_, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_ANDROID,
+                        static_cast<EGLClientBuffer>(buffer->getNativeBuffer()), attribs);
+  if (image == EGL_NO_IMAGE_KHR) {
+    LOG(ERROR) << "Failed to create EGL image: " << eglError();
+    return EGL_NO_IMAGE_KHR;
+  }
+  images_[buffer->getId()] = Image{.buffer = buffer, .image = image};
+  return image;
+}
+
+void GLScaler::destroyImages() {
+  for (const auto& [id, image] : images_) {
+    eglDestroyImageKHR(display_, image.image);
+  }
+  images_.clear();
+}
+
+sp<Fence> GLScaler::Draw(const BufferItem& item) {
+  if (outputs_.empty() || !item.mGraphicBuffer) {
+    return nullptr;
+  }
+
+  if (!eglMakeCurrent(display_, outputs_[0].egl_surface, outputs_[0].egl_surface, context_)) {
+    LOG(ERROR) << "Failed to make EGL context current: " << eglError();
+    return nullptr;
+  }
+
+  EGLImageKHR image = imageFor(item.mGraphicBuffer);
+  if (image == EGL_NO_IMAGE_KHR) {
+    eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    return nullptr;
+  }
+
+  // Have the GPU wait for the display to finish compositing the frame, rather than blocking here.
+  if (item.mFence->isValid()) {
+    const EGLint attribs[] = {EGL_SYNC_NATIVE_FENCE_FD_ANDROID, item.mFence->dup(), EGL_NONE};
+    EGLSyncKHR sync = eglCreateSyncKHR(display_, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+    if (sync == EGL_NO_SYNC_KHR) {
+      close(attribs[1]);
+      item.mFence->waitForever("wardenclyffe_simulcast");
+    } else {
+      eglWaitSyncKHR(display_, sync, 0);
+      eglDestroySyncKHR(display_, sync);
+    }
+  }
+
+  glUseProgram(program_);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture_);
+  glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, static_cast<GLeglImageOES>(image));
+  glVertexAttribPointer(position_location_, 2, GL_FLOAT, GL_FALSE, 0, kPositions);
+  glEnableVertexAttribArray(position_location_);
+  glVertexAttribPointer(tex_coord_location_, 2, GL_FLOAT, GL_FALSE, 0, kTexCoords);
+  glEnableVertexAttribArray(tex_coord_location_);
+
+  for (const Output& output : outputs_) {
+    if (!eglMakeCurrent(display_, output.egl_surface, output.egl_surface, context_)) {
+      LOG(ERROR) << "Failed to make EGL context current: " << eglError();
+      continue;
+    }
+    glViewport(0, 0, output.width, output.height);
+    glUniform2f(tap_offset_location_, 0.25f / output.width, 0.25f / output.height);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    eglPresentationTimeANDROID(display_, output.egl_surface, item.mTimestamp);
+    if (!eglSwapBuffers(display_, output.egl_surface)) {
+      LOG(WARNING) << "Failed to queue frame for simulcast layer: " << eglError();
+    }
+  }
+
+  // Everything the GPU reads from the frame has been submitted by now.
+  sp<Fence> fence = Fence::NO_FENCE;
+  EGLSyncKHR sync = eglCreateSyncKHR(display_, EGL_SYNC_NATIVE_FENCE_ANDROID, nullptr);
+  if (sync != EGL_NO_SYNC_KHR) {
+    glFlush();
+    int fd = eglDupNativeFenceFDANDROID(display_, sync);
+    eglDestroySyncKHR(display_, sync);
+    if (fd != EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+      fence = sp<Fence>::make(fd);
+    }
+  }
+  if (fence == Fence::NO_FENCE) {
+    glFinish();
+  }
+
+  eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  return fence;
+}
+
+bool SimulcastLayerSocket::Start() {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  return createEncoder() && startEncoder() && startControlThread();
+}
+
+sp<IGraphicBufferProducer> SimulcastLayerSocket::InputSurface() {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  return codec_producer_;
+}
+
+SimulcastSocket::SimulcastSocket(VideoConfig config) : H264Socket(std::move(config)) {}
+
+SimulcastSocket::~SimulcastSocket() {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  SimulcastSocket::DestroyLocked();
+}
+
+VideoSocket* SimulcastSocket::Layer(size_t index) {
+  if (index == 0) {
+    return this;
+  }
+  return index <= layers_.size() ? layers_[index - 1].get() : nullptr;
+}
+
+void SimulcastSocket::DestroyLocked() {
+  // Stop capturing before taking away what the frames are drawn into.
+  MediaCodecSocket::DestroyLocked();
+  scaler_.reset();
+  for (const std::shared_ptr<SimulcastLayerSocket>& layer : layers_) {
+    layer->Destroy();
+  }
+}
+
+bool SimulcastSocket::createEncoder() {
+  if (!MediaCodecSocket::createEncoder()) {
+    return false;
+  }
+
+  std::vector<sp<IGraphicBufferProducer>> outputs;
+  for (size_t index = 1; index < kLayerCount; ++index) {
+    VideoConfig config = config_;
+    config.simulcast = false;
+
+    // Encoders generally can't handle odd sizes.
+    config.width = (video_width_ >> index) & ~1u;
+    config.height = (video_height_ >> index) & ~1u;
+    config.bitrate = std::max(config_.bitrate >> (2 * index), kMinBitrate);
+
+    auto layer = std::make_shared<SimulcastLayerSocket>(config);
+    if (!layer->Start()) {
+      LOG(ERROR) << "Failed to start simulcast layer " << index << " at " << config.width << "x"
+                 << config.height;
+      return false;
+    }
+    outputs.push_back(layer->InputSurface());
+    layers_.push_back(std::move(layer));
+  }
+
+  scaler_ = GLScaler::Create(outputs);
+  if (!scaler_) {
+    LOG(ERROR) << "Failed to set up scaling for simulcast layers";
+    return false;
+  }
+  LOG(INFO) << "Simulcasting " << kLayerCount << " layers from " << video_width_ << "x"
+            << video_height_;
+  return true;
+}
+
+sp<Fence> SimulcastSocket::shareFrame(const BufferItem& item) {
+  // The scaler waits for the frame to be ready before reading it, so its fence covers both. If it
+  // couldn't draw, the smaller layers skip this frame.
+  sp<Fence> fence = scaler_ ? scaler_->Draw(item) : nullptr;
+  return fence ? fence : item.mFence;
+}
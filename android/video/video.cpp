@@ -1,14 +1,21 @@
 #include "wardenclyffe/android/video/video.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
-#include <deque>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string_view>
 #include <thread>
+#include <utility>
 #include <vector>
 
 // libbase has CHECK macros that conflict with stagefright's ADebug.h
@@ -17,22 +24,31 @@
 #include <android-base/logging.h>
 #pragma clang diagnostic pop
 
+#include <android-base/parsebool.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/thread_annotations.h>
 #include <binder/IPCThreadState.h>
 #include <gui/Surface.h>
 #include <gui/SurfaceComposerClient.h>
+#include <json/json.h>
 #include <media/MediaCodecBuffer.h>
 #include <media/openmax/OMX_IVCommon.h>
 #include <media/stagefright/MediaCodec.h>
 #include <media/stagefright/MediaCodecConstants.h>
+#include <media/MediaCodecInfo.h>
+#include <media/stagefright/MediaCodecList.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/foundation/AString.h>
 #include <mediadrm/ICrypto.h>
 #include <ui/DisplayState.h>
 #include <utils/String8.h>
+#include <utils/ThreadDefs.h>
 
+#include "wardenclyffe/android/scheduling.h"
 #include "wardenclyffe/android/socket.h"
 
 using namespace android;
@@ -59,94 +75,721 @@ bool FrameTimer::Tick(size_t amount) {
   return false;
 }
 
-VideoSocket* VideoSocket::Create(std::string_view path) {
-  VideoSocket* result = nullptr;
-  if (android::base::ConsumePrefix(&path, "h264/")) {
-    result = new H264Socket();
-  } else if (android::base::ConsumePrefix(&path, "jpeg/")) {
-    result = new JPEGSocket();
+std::string VideoConfig::Key() const {
+  std::string key =
+      android::base::StringPrintf("%s:%ux%u@%u:%d:%u%s", codec.c_str(), width, height, fps,
+                                  bitrate, quality.value_or(0), tiles ? ":tiles" : "");
+  if (display) {
+    key += android::base::StringPrintf(":display=%" PRIu64, *display);
   }
+  if (layer_stack) {
+    key += android::base::StringPrintf(":layer_stack=%u", *layer_stack);
+  }
+  if (crop) {
+    key += android::base::StringPrintf(":crop=%d,%d,%d,%d", crop->left, crop->top,
+                                       crop->getWidth(), crop->getHeight());
+  }
+  if (simulcast) {
+    key += ":simulcast";
+  }
+  return key;
+}
+
+static bool parseFlag(const std::string& value, bool* flag) {
+  android::base::ParseBoolResult result = android::base::ParseBool(value);
+  if (result == android::base::ParseBoolResult::kError) {
+    return false;
+  }
+  *flag = result == android::base::ParseBoolResult::kTrue;
+  return true;
+}
+
+bool VideoConfig::Parse(std::string_view option) {
+  static constexpr uint32_t kMaxDimension = 8192;
+  static constexpr uint32_t kMaxFps = 240;
+
+  size_t equals = option.find('=');
+  if (equals == std::string_view::npos) {
+    return false;
+  }
+  std::string_view key = option.substr(0, equals);
+  std::string value(option.substr(equals + 1));
+
+  if (key == "width") {
+    return android::base::ParseUint(value, &width, kMaxDimension);
+  } else if (key == "height") {
+    return android::base::ParseUint(value, &height, kMaxDimension);
+  } else if (key == "fps") {
+    return android::base::ParseUint(value, &fps, kMaxFps) && fps != 0;
+  } else if (key == "bitrate") {
+    return android::base::ParseInt(value, &bitrate, MediaCodecSocket::kMinBitrate);
+  } else if (key == "tiles") {
+    return parseFlag(value, &tiles);
+  } else if (key == "simulcast") {
+    return parseFlag(value, &simulcast);
+  } else if (key == "quality") {
+    uint32_t result;
+    if (!android::base::ParseUint(value, &result, 100u) || result == 0) {
+      return false;
+    }
+    quality = result;
+    return true;
+  } else if (key == "display") {
+    uint64_t result;
+    if (!android::base::ParseUint(value, &result)) {
+      return false;
+    }
+    display = result;
+    return true;
+  } else if (key == "layer_stack") {
+    uint32_t result;
+    if (!android::base::ParseUint(value, &result)) {
+      return false;
+    }
+    layer_stack = result;
+    return true;
+  } else if (key == "crop") {
+    std::vector<std::string> parts = android::base::Split(value, ",");
+    uint32_t x, y, w, h;
+    if (parts.size() != 4 || !android::base::ParseUint(parts[0], &x, kMaxDimension) ||
+        !android::base::ParseUint(parts[1], &y, kMaxDimension) ||
+        !android::base::ParseUint(parts[2], &w, kMaxDimension) ||
+        !android::base::ParseUint(parts[3], &h, kMaxDimension) || w == 0 || h == 0) {
+      return false;
+    }
+    crop = Rect(x, y, x + w, y + h);
+    return true;
+  }
+  return false;
+}
+
+// Everything that VideoSocket::Create knows how to make.
+struct VideoCodec {
+  const char* name;
+
+  // The MediaCodec encoder's MIME type, or nullptr if the codec doesn't use one.
+  const char* mime_type;
+
+  // WebCodecs codec string for the profile and level that we encode at.
+  const char* webcodecs_codec;
+
+  std::shared_ptr<VideoSocket> (*create)(VideoConfig config);
+
+  // What to use instead if the pipeline from |create| fails to initialize, if anything.
+  std::shared_ptr<VideoSocket> (*fallback)(VideoConfig config) = nullptr;
+};
+
+static bool hasHardwareEncoder(const char* mime_type) {
+  Vector<AString> matches;
+  MediaCodecList::findMatchingCodecs(mime_type, true /* encoder */,
+                                     MediaCodecList::kHardwareCodecsOnly, &matches);
+  return !matches.empty();
+}
+
+template <typename T>
+static std::shared_ptr<VideoSocket> createPipeline(VideoConfig config) {
+  return std::make_shared<T>(std::move(config));
+}
+
+// Prefer a hardware JPEG encoder, which doesn't need CPU access to the display's buffers. Tiles
+// need the pixels for change detection, so they always go through software. In other words,
+// /video/jpeg/ gets HardwareJPEGSocket unless it has tiles=1, wardenclyffe.jpeg.hardware is false
+// or the device has no hardware image/jpeg encoder. html/jpeg/ only asks for tiles when its own URL
+// does, and plays either stream.
+static std::shared_ptr<VideoSocket> createJPEGPipeline(VideoConfig config) {
+  static const bool hardware_available =
+      android::base::GetBoolProperty("wardenclyffe.jpeg.hardware", true) &&
+      hasHardwareEncoder(HardwareJPEGSocket::kMimeType);
+  if (hardware_available && !config.tiles) {
+    return std::make_shared<HardwareJPEGSocket>(std::move(config));
+  }
+  return std::make_shared<JPEGSocket>(std::move(config));
+}
+
+// Keeping every layer's encoder fed from one capture is up to SimulcastSocket.
+static std::shared_ptr<VideoSocket> createH264Pipeline(VideoConfig config) {
+  if (config.simulcast) {
+    return std::make_shared<SimulcastSocket>(std::move(config));
+  }
+  return std::make_shared<H264Socket>(std::move(config));
+}
+
+// In order of preference. H.264 and JPEG are always available: everything else is only worth using
+// with a hardware encoder.
+static const VideoCodec kVideoCodecs[] = {
+    {"av1", "video/av01", "av01.0.09M.08", createPipeline<AV1Socket>},
+    {"hevc", "video/hevc", "hvc1.1.6.L123.B0", createPipeline<HEVCSocket>},
+    {"vp9", "video/x-vnd.on2.vp9", "vp09.00.41.08", createPipeline<VP9Socket>},
+    {"h264", "video/avc", "avc1.4d0029", createH264Pipeline},
+    {"jpeg", nullptr, nullptr, createJPEGPipeline, createPipeline<JPEGSocket>},
+};
+
+static const std::vector<const VideoCodec*>& availableCodecs() {
+  static const std::vector<const VideoCodec*> codecs = []() {
+    std::vector<const VideoCodec*> result;
+    for (const VideoCodec& codec : kVideoCodecs) {
+      bool always_available = !strcmp(codec.name, "h264") || !strcmp(codec.name, "jpeg");
+      if (always_available || hasHardwareEncoder(codec.mime_type)) {
+        LOG(INFO) << "Video codec available: " << codec.name;
+        result.push_back(&codec);
+      }
+    }
+    return result;
+  }();
+  return codecs;
+}
+
+void VideoSocket::ProbeCodecs() {
+  availableCodecs();
+}
+
+// Lists the codecs that this device can encode, most efficient first, as a single JSON message:
+//   [{"name": "hevc", "codec": "hvc1.1.6.L123.B0"}, ...]
+// where "codec" is the matching WebCodecs codec string.
+static Socket* createCodecListSocket() {
+  Json::Value codecs(Json::arrayValue);
+  for (const VideoCodec* codec : availableCodecs()) {
+    if (!codec->webcodecs_codec) continue;
+    Json::Value entry;
+    entry["name"] = codec->name;
+    entry["codec"] = codec->webcodecs_codec;
+    codecs.append(std::move(entry));
+  }
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  return new MessageSocket(Json::writeString(builder, codecs));
+}
+
+// Lists the physical displays that can be captured, as a single JSON message:
+//   [{"id": "4619827259835644672", "width": 1080, "height": 2400, "layerStack": 0,
+//     "internal": true}, ...]
+// IDs are strings, since they don't fit in a double. Pass one as display=<id> to capture it.
+static Socket* createDisplayListSocket() {
+  std::optional<PhysicalDisplayId> internal = SurfaceComposerClient::getInternalDisplayId();
+  Json::Value displays(Json::arrayValue);
+  for (PhysicalDisplayId id : SurfaceComposerClient::getPhysicalDisplayIds()) {
+    sp<IBinder> token = SurfaceComposerClient::getPhysicalDisplayToken(id);
+    ui::DisplayState state;
+    if (!token || SurfaceComposerClient::getDisplayState(token, &state) != NO_ERROR) {
+      LOG(WARNING) << "Failed to get state of display " << id.value;
+      continue;
+    }
+    Json::Value entry;
+    entry["id"] = std::to_string(id.value);
+    entry["width"] = state.layerStackSpaceRect.getWidth();
+    entry["height"] = state.layerStackSpaceRect.getHeight();
+    entry["layerStack"] = state.layerStack.id;
+    entry["internal"] = internal == id;
+    displays.append(std::move(entry));
+  }
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  return new MessageSocket(Json::writeString(builder, displays));
+}
+
+static std::mutex pipelines_mutex;
+static std::map<std::string, std::weak_ptr<VideoSocket>> pipelines GUARDED_BY(pipelines_mutex);
+
+Socket* VideoSocket::Create(std::string_view path) {
+  std::vector<std::string> options;
+  if (size_t query_start = path.find('?'); query_start != std::string_view::npos) {
+    options = android::base::Split(std::string(path.substr(query_start + 1)), "&");
+    path = path.substr(0, query_start);
+  }
+
+  if (path == "codecs" || path == "codecs/") {
+    return createCodecListSocket();
+  } else if (path == "displays" || path == "displays/") {
+    return createDisplayListSocket();
+  }
+
+  const VideoCodec* codec = nullptr;
+  for (const VideoCodec* candidate : availableCodecs()) {
+    if (android::base::ConsumePrefix(&path, std::string(candidate->name) + "/")) {
+      codec = candidate;
+      break;
+    }
+  }
+  if (!codec) {
+    LOG(ERROR) << "Unsupported video codec: " << path;
+    return nullptr;
+  }
+
+  // Options either pick how this connection receives frames, or pick which pipeline it reads from.
+  VideoConfig config;
+  config.codec = codec->name;
+  bool binary_header = false;
+  size_t layer = 0;
+  for (const std::string& option : options) {
+    if (option.empty()) {
+      continue;
+    } else if (option == "header=binary") {
+      binary_header = true;
+    } else if (std::string_view value = option; android::base::ConsumePrefix(&value, "layer=")) {
+      if (!android::base::ParseUint(std::string(value), &layer)) {
+        LOG(ERROR) << "Invalid video option '" << option << "'";
+        return nullptr;
+      }
+    } else if (!config.Parse(option)) {
+      LOG(ERROR) << "Invalid video option '" << option << "'";
+      return nullptr;
+    }
+  }
+
+  if (config.quality && config.codec != "jpeg") {
+    LOG(ERROR) << "quality is only supported for jpeg, use bitrate instead";
+    return nullptr;
+  } else if (config.tiles && config.codec != "jpeg") {
+    LOG(ERROR) << "tiles is only supported for jpeg";
+    return nullptr;
+  } else if (config.simulcast && config.codec != "h264") {
+    LOG(ERROR) << "simulcast is only supported for h264";
+    return nullptr;
+  }
+
+  std::string key = config.Key();
+  std::lock_guard<std::mutex> lock(pipelines_mutex);
 
-  if (result && !result->Initialize()) {
-    delete result;
-    result = nullptr;
+  // Pipelines are destroyed along with their last reader, which leaves an expired entry behind.
+  for (auto it = pipelines.begin(); it != pipelines.end();) {
+    it = it->second.expired() ? pipelines.erase(it) : std::next(it);
   }
 
+  std::shared_ptr<VideoSocket> pipeline;
+  if (auto it = pipelines.find(key); it != pipelines.end()) {
+    pipeline = it->second.lock();
+  }
+  if (pipeline && !pipeline->IsRunning()) {
+    pipeline.reset();
+  }
+
+  if (pipeline) {
+    LOG(INFO) << "Joining existing video pipeline " << key;
+  } else {
+    LOG(INFO) << "Creating video pipeline " << key;
+    pipeline = codec->create(config);
+
+    if (!pipeline->Initialize()) {
+      if (!codec->fallback) {
+        return nullptr;
+      }
+
+      LOG(WARNING) << "Failed to initialize video pipeline " << key << ", falling back";
+      pipeline = codec->fallback(std::move(config));
+      if (!pipeline->Initialize()) {
+        return nullptr;
+      }
+    }
+    pipelines[key] = pipeline;
+  }
+
+  if (!pipeline->Layer(layer)) {
+    LOG(ERROR) << "Video pipeline " << key << " has no layer " << layer;
+    return nullptr;
+  }
+  return new VideoSubscriber(std::move(pipeline), layer, binary_header);
+}
+
+Json::Value VideoSocket::DescribeStats(bool reset) {
+  // Pipelines might be destroyed when we let go of them, so don't do it with the lock held.
+  std::vector<std::pair<std::string, std::shared_ptr<VideoSocket>>> running;
+  {
+    std::lock_guard<std::mutex> lock(pipelines_mutex);
+    for (const auto& [key, weak_pipeline] : pipelines) {
+      std::shared_ptr<VideoSocket> pipeline = weak_pipeline.lock();
+      if (pipeline && pipeline->IsRunning()) {
+        running.emplace_back(key, std::move(pipeline));
+      }
+    }
+  }
+
+  Json::Value result(Json::arrayValue);
+  for (const auto& [key, pipeline] : running) {
+    // Simulcast layers are listed as pipelines of their own.
+    VideoSocket* layer;
+    for (size_t index = 0; (layer = pipeline->Layer(index)); ++index) {
+      Json::Value entry;
+      entry["pipeline"] = index == 0 ? key : key + ":layer=" + std::to_string(index);
+      {
+        std::lock_guard<std::mutex> lock(layer->frame_mutex_);
+        uint64_t dropped_frames = 0;
+        for (const FrameQueue* queue : layer->subscribers_) {
+          dropped_frames += queue->dropped_frames;
+        }
+        entry["subscribers"] = Json::UInt64(layer->subscribers_.size());
+        entry["droppedFrames"] = Json::UInt64(dropped_frames);
+      }
+      entry["latency"] = layer->stats_.ToJson();
+      layer->describeStats(&entry);
+      if (reset) {
+        layer->stats_.Reset();
+      }
+      result.append(std::move(entry));
+    }
+  }
   return result;
 }
 
-WardenclyffeReads VideoSocket::Read() {
-  std::unique_lock<std::mutex> lock(frame_mutex_);
-  base::ScopedLockAssertion lock_assertion(frame_mutex_);
-  cv_.wait(lock, [this]() {
-    base::ScopedLockAssertion lock_assertion(frame_mutex_);
-    if (!running_) return true;
-    if (reads_.empty()) {
-      return !frames_.empty();
-    } else {
-      return frames_.size() > 1;
+bool VideoSocket::pushFrame(sp<Frame> frame) {
+  frame->sequence = next_sequence_++;
+  frame->WriteHeader();
+  sp<const Frame> shared = std::move(frame);
+
+  if (shared->type == FrameType::Keyframe) {
+    history_.clear();
+    history_.push_back(shared);
+    sync_frame_requested_ = false;
+  } else if (!history_.empty() && history_.size() < kMaxHistoryFrames) {
+    history_.push_back(shared);
+  } else {
+    // Too far from the last keyframe for anyone to join from it.
+    history_.clear();
+  }
+
+  bool sync_needed = false;
+  for (FrameQueue* queue : subscribers_) {
+    offerFrame(queue, shared);
+    sync_needed |= queue->keyframe_needed;
+  }
+
+  stats_.RecordSince(LatencyStage::Enqueue, shared->timestamp);
+
+  if (sync_needed && !sync_frame_requested_) {
+    sync_frame_requested_ = true;
+    return true;
+  }
+  return false;
+}
+
+void VideoSocket::offerFrame(FrameQueue* queue, const sp<const Frame>& frame) {
+  if (queue->resync_requested.exchange(false)) {
+    LOG(INFO) << "Reader requested a keyframe";
+    queue->keyframe_needed = true;
+  }
+
+  bool keyframe = frame->type == FrameType::Keyframe;
+  size_t queue_depth = queue->size();
+  if (queue->started && queue_depth > queue->max_queue_depth / 2) {
+    congested_ = true;
+  }
+
+  if (queue_depth >= queue->max_queue_depth && !queue->keyframe_needed && !keyframe) {
+    // Anything short of the next keyframe is undecodable without the frames before it.
+    LOG(WARNING) << "Reader fell behind by " << queue_depth << " frame(s), resyncing";
+    queue->keyframe_needed = true;
+  }
+
+  if (keyframe && (queue->keyframe_needed || queue_depth >= queue->max_queue_depth)) {
+    // Nothing before a keyframe is needed to decode it, so skip whatever the reader hasn't gotten
+    // to yet.
+    queue->flush_sequence = frame->sequence;
+    queue->keyframe_needed = false;
+  } else if (queue->keyframe_needed) {
+    if (queue->started) {
+      ++queue->dropped_frames;
     }
-  });
+    return;
+  }
 
-  WardenclyffeReads result = {.reads = nullptr, .read_count = -1};
+  queue->started = true;
+  queue->Push(frame);
+}
 
-  if (!running_) {
-    return result;
+void VideoSocket::Subscribe(FrameQueue* queue, bool join_history) {
+  {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+
+    // Start from the last keyframe if it's recent enough that catching up from it won't make the
+    // reader look congested. Otherwise, get the encoder to make a new one.
+    if (join_history && !history_.empty() && history_.size() <= queue->max_queue_depth / 2) {
+      for (const sp<const Frame>& frame : history_) {
+        queue->Push(frame);
+      }
+      queue->keyframe_needed = false;
+      queue->started = true;
+    }
+    subscribers_.push_back(queue);
+
+    if (!queue->keyframe_needed) {
+      return;
+    }
   }
+  RequestSyncFrame();
+}
 
-  if (!reads_.empty()) {
-    reads_.clear();
-    frames_.pop_front();
-    if (emit_descriptors_) {
-      descriptions_.pop_front();
+void VideoSocket::Unsubscribe(FrameQueue* queue) {
+  std::lock_guard<std::mutex> lock(frame_mutex_);
+  subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), queue),
+                     subscribers_.end());
+}
+
+void VideoSocket::RequestSyncFrame() {
+  {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    if (sync_frame_requested_) {
+      return;
     }
+    sync_frame_requested_ = true;
   }
+  requestSyncFrame();
+}
 
-  const Frame& frame = frames_.at(0);
-  if (emit_descriptors_) {
-    const char* frame_type = nullptr;
-    switch (frame.type) {
-      case FrameType::Description:
-        frame_type = "config";
-        break;
+void VideoSocket::ReportFeedback(const ClientFeedback& feedback) {
+  static constexpr uint32_t kMaxDecodeQueueDepth = 2;
+  static constexpr double kMaxPacketLoss = 0.02;
+  static constexpr uint32_t kMaxJitterMs = 50;
+  if (feedback.decode_queue_depth > kMaxDecodeQueueDepth || feedback.packet_loss > kMaxPacketLoss ||
+      feedback.jitter_ms > kMaxJitterMs) {
+    congested_ = true;
+  }
 
-      case FrameType::Keyframe:
-        frame_type = "key";
-        break;
+  if (feedback.receive_kbps != 0) {
+    uint32_t current = min_receive_kbps_;
+    while (feedback.receive_kbps < current &&
+           !min_receive_kbps_.compare_exchange_weak(current, feedback.receive_kbps)) {
+    }
+  }
+}
 
-      case FrameType::Interframe:
-        frame_type = "delta";
-        break;
-    };
+void VideoSocket::WakeReaders() {
+  std::lock_guard<std::mutex> lock(frame_mutex_);
+  for (FrameQueue* queue : subscribers_) {
+    queue->Wake();
+  }
+}
 
-    descriptions_.push_back(android::base::StringPrintf(
-        "{\"type\":\"%s\",\"timestamp\": %" PRId64 "}", frame_type, frame.timestamp));
+static size_t maxQueueDepth() {
+  return android::base::GetUintProperty<size_t>("wardenclyffe.video.max_queue_depth",
+                                                VideoSubscriber::kDefaultMaxQueueDepth);
+}
 
-    reads_.push_back(WardenclyffeRead{
-        .data = descriptions_.back().data(),
-        .size = descriptions_.back().size(),
+VideoSubscriber::VideoSubscriber(std::shared_ptr<VideoSocket> pipeline, size_t layer,
+                                 bool binary_header)
+    : pipeline_(std::move(pipeline)),
+      binary_header_(binary_header),
+      transport_timer_("Transport"),
+      source_(pipeline_->Layer(layer)),
+      queue_(&queues_[0]),
+      queues_{FrameQueue(maxQueueDepth()), FrameQueue(maxQueueDepth())},
+      next_queue_(&queues_[1]) {
+  source_->Subscribe(queue_);
+}
+
+VideoSubscriber::~VideoSubscriber() {
+  if (next_source_) {
+    next_source_->Unsubscribe(next_queue_);
+  }
+  source_->Unsubscribe(queue_);
+}
+
+void VideoSubscriber::Destroy() {
+  closed_ = true;
+  for (FrameQueue& queue : queues_) {
+    queue.Wake();
+  }
+}
+
+void VideoSubscriber::appendFrame(const sp<const Frame>& frame) {
+  // The references taken here are released by the reader through wardenclyffe_release_frame.
+  if (binary_header_) {
+    frame->incStrong(nullptr);
+    reads_[read_count_++] = WardenclyffeRead{
+        .data = frame->data.data(),
+        .size = frame->data.size(),
+        .oob = false,
+        .frame = frame.get(),
+    };
+    return;
+  }
+
+  if (source_->EmitsDescriptors()) {
+    frame->incStrong(nullptr);
+    reads_[read_count_++] = WardenclyffeRead{
+        .data = frame->description,
+        .size = frame->description_size,
         .oob = true,
-    });
+        .frame = frame.get(),
+    };
   }
-  reads_.push_back(WardenclyffeRead{
-      .data = frame.data.data(),
-      .size = frame.data.size(),
+
+  frame->incStrong(nullptr);
+  reads_[read_count_++] = WardenclyffeRead{
+      .data = frame->payload(),
+      .size = frame->payload_size(),
       .oob = false,
-  });
+      .frame = frame.get(),
+  };
+}
+
+bool VideoSubscriber::Write(const void* data, size_t len) {
+  const char* begin = static_cast<const char*>(data);
+  Json::Value message;
+  std::string errors;
+  std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+  if (!reader->parse(begin, begin + len, &message, &errors) || !message.isObject()) {
+    LOG(WARNING) << "Failed to parse control message: " << errors;
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(layer_mutex_);
+  std::string type = message.get("type", "").asString();
+  if (type == "feedback") {
+    ClientFeedback feedback;
+    feedback.decode_queue_depth = message.get("decodeQueue", 0).asUInt();
+    feedback.receive_kbps = message.get("receiveKbps", 0).asUInt();
+    feedback.packet_loss = message.get("packetLoss", 0).asDouble();
+    feedback.jitter_ms = message.get("jitter", 0).asUInt();
+    source_->ReportFeedback(feedback);
+
+    static constexpr std::pair<const char*, LatencyStage> kClientStages[] = {
+        {"decodeTimes", LatencyStage::Decode},
+        {"bufferTimes", LatencyStage::Buffer},
+        {"renderTimes", LatencyStage::Render},
+    };
+    for (const auto& [name, stage] : kClientStages) {
+      for (const Json::Value& time : message.get(name, Json::arrayValue)) {
+        source_->Stats().Record(stage, time.asInt64());
+      }
+    }
+  } else if (type == "keyframe") {
+    queue_->resync_requested = true;
+    source_->RequestSyncFrame();
+  } else if (type == "layer") {
+    Json::Value layer = message.get("layer", Json::nullValue);
+    if (!layer.isUInt() || !pipeline_->Layer(layer.asUInt())) {
+      LOG(WARNING) << "Invalid video layer in control message";
+    } else {
+      requested_layer_ = layer.asUInt();
+      queue_->Wake();
+    }
+  } else {
+    LOG(WARNING) << "Unknown control message type '" << type << "'";
+  }
+  return true;
+}
+
+void VideoSubscriber::beginLayerSwitch(size_t index) {
+  VideoSocket* layer = pipeline_->Layer(index);
+
+  std::lock_guard<std::mutex> lock(layer_mutex_);
+  if (next_source_) {
+    // Give up on the switch that was already underway.
+    next_source_->Unsubscribe(next_queue_);
+    next_queue_->Reset();
+    next_source_ = nullptr;
+  }
+  if (layer == source_) {
+    return;
+  }
+
+  LOG(INFO) << "Switching to video layer " << index;
+  next_source_ = layer;
+
+  // Frames from the history would be older than the ones already sent.
+  next_source_->Subscribe(next_queue_, false /* join_history */);
+}
+
+void VideoSubscriber::finishLayerSwitch() {
+  std::lock_guard<std::mutex> lock(layer_mutex_);
+  source_->Unsubscribe(queue_);
+  queue_->Reset();
+  std::swap(queue_, next_queue_);
+  source_ = next_source_;
+  next_source_ = nullptr;
+}
+
+sp<const Frame> VideoSubscriber::nextFrame() {
+  if (int layer = requested_layer_.exchange(-1); layer != -1) {
+    beginLayerSwitch(layer);
+  }
+
+  // The new layer's first frame is a keyframe. Whatever the old one hasn't sent by then is dropped
+  // in favor of it.
+  if (next_source_) {
+    if (sp<const Frame> frame = next_queue_->Pop()) {
+      finishLayerSwitch();
+      return frame;
+    }
+  }
+  return queue_->Pop();
+}
+
+static bool samePayload(const Frame& a, const Frame& b) {
+  return a.payload_size() == b.payload_size() &&
+         !memcmp(a.payload(), b.payload(), a.payload_size());
+}
+
+// A copy of |config| that tells the reader to reconfigure its decoder.
+static sp<const Frame> markNewConfig(FramePool& pool, const Frame& config) {
+  sp<Frame> copy = pool.Acquire(config.payload_size());
+  copy->data.insert(copy->data.end(), config.payload(), config.payload() + config.payload_size());
+  copy->type = config.type;
+  copy->timestamp = config.timestamp;
+  copy->sequence = config.sequence;
+  copy->flags = config.flags | FrameHeader::kFlagNewConfig;
+  memcpy(copy->description, config.description, config.description_size);
+  copy->description_size = config.description_size;
+  copy->WriteHeader();
+  return copy;
+}
+
+WardenclyffeReads VideoSubscriber::Read() {
+  WardenclyffeReads result = {.reads = nullptr, .read_count = -1};
+
+  read_count_ = 0;
+
+  sp<const Frame> frame;
+  while (!(frame = nextFrame())) {
+    if (closed_) {
+      result.read_count = 0;
+      return result;
+    } else if (!source_->IsRunning()) {
+      return result;
+    }
+
+    if (next_source_) {
+      queue_->Wait(*next_queue_);
+    } else {
+      queue_->Wait();
+    }
+  }
+
+  if (frame->config && frame->config != config_) {
+    // After switching layers, the config comes from another encoder, so it's new to the reader
+    // even if it's the first one that encoder has made.
+    bool changed = config_ && !(frame->config->flags & FrameHeader::kFlagNewConfig) &&
+                   !samePayload(*config_, *frame->config);
+    config_ = frame->config;
+    appendFrame(changed ? markNewConfig(source_->Pool(), *config_) : config_);
+  }
+  appendFrame(frame);
+
+  source_->Stats().RecordSince(LatencyStage::Read, frame->timestamp);
+  unsent_reads_.Push(UnsentRead{.stats = &source_->Stats(), .timestamp = frame->timestamp});
+
   result.reads = reads_.data();
-  result.read_count = reads_.size();
+  result.read_count = read_count_;
 
-  transport_timer_.Tick();
+  if (transport_timer_.Tick()) {
+    LOG(INFO) << "Transport: queue depth = " << queue_->size()
+              << ", dropped frames = " << queue_->dropped_frames;
+  }
   return result;
 }
 
+void VideoSubscriber::OnReadsSent() {
+  if (std::optional<UnsentRead> read = unsent_reads_.Pop()) {
+    read->stats->RecordSince(LatencyStage::Sent, read->timestamp);
+  }
+}
+
 void VideoSocket::DisplayBufferConsumerCallbacks::onFrameAvailable(const BufferItem&) {
-  parent_.checkOrientation();
   parent_.onFrameReceived();
 }
 
 void VideoSocket::DisplayBufferConsumerCallbacks::onFrameReplaced(const BufferItem&) {
-  parent_.checkOrientation();
   parent_.onFrameReceived();
 }
 
@@ -167,10 +810,24 @@ void VideoSocket::DisplayBufferProducerCallbacks::onBuffersDiscarded(const std::
 }
 
 bool VideoSocket::fetchDisplayParameters() {
-  std::optional<PhysicalDisplayId> displayId = SurfaceComposerClient::getInternalDisplayId();
-  if (!displayId) {
-    LOG(ERROR) << "Failed to get ID for internal display";
-    return false;
+  std::optional<PhysicalDisplayId> displayId;
+  if (config_.display) {
+    for (PhysicalDisplayId id : SurfaceComposerClient::getPhysicalDisplayIds()) {
+      if (id.value == *config_.display) {
+        displayId = id;
+        break;
+      }
+    }
+    if (!displayId) {
+      LOG(ERROR) << "No such display " << *config_.display;
+      return false;
+    }
+  } else {
+    displayId = SurfaceComposerClient::getInternalDisplayId();
+    if (!displayId) {
+      LOG(ERROR) << "Failed to get ID for internal display";
+      return false;
+    }
   }
 
   physical_display_ = SurfaceComposerClient::getPhysicalDisplayToken(*displayId);
@@ -191,23 +848,109 @@ bool VideoSocket::fetchDisplayParameters() {
     return false;
   }
 
-  if (video_width_ == 0) {
-    video_width_ = floorToEven(display_state_.layerStackSpaceRect.getWidth()) * 0.5;
+  Rect source = sourceRect();
+  if (config_.crop && source != *config_.crop) {
+    LOG(ERROR) << "Crop " << config_.crop->left << "," << config_.crop->top << " "
+               << config_.crop->getWidth() << "x" << config_.crop->getHeight()
+               << " doesn't fit in the display";
+    return false;
   }
-  if (video_height_ == 0) {
-    video_height_ = floorToEven(display_state_.layerStackSpaceRect.getHeight()) * 0.5;
+
+  uint32_t display_width = source.getWidth();
+  uint32_t display_height = source.getHeight();
+  if (video_width_ == 0 && video_height_ == 0) {
+    // A crop is usually there to read small details, so keep it at native resolution. Simulcast
+    // has smaller layers for readers that want less. Encoders that can't go that big shrink it back
+    // down in checkCapabilities.
+    double scale = config_.crop || config_.simulcast ? 1.0 : 0.5;
+    video_width_ = floorToEven(display_width) * scale;
+    video_height_ = floorToEven(display_height) * scale;
+  } else if (video_width_ == 0) {
+    video_width_ = static_cast<uint64_t>(video_height_) * display_width / display_height;
+  } else if (video_height_ == 0) {
+    video_height_ = static_cast<uint64_t>(video_width_) * display_height / display_width;
   }
 
+  // Encoders generally can't handle odd sizes.
+  video_width_ = floorToEven(video_width_);
+  video_height_ = floorToEven(video_height_);
+  if (video_width_ == 0 || video_height_ == 0) {
+    LOG(ERROR) << "Invalid video size " << video_width_ << "x" << video_height_;
+    return false;
+  }
+
+  return true;
+}
+
+bool VideoSocket::startControlThread() {
+  {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    control_running_ = true;
+  }
+  control_thread_ = std::thread([this]() { controlLoop(); });
   return true;
 }
 
+void VideoSocket::stopControlThread() {
+  {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    control_running_ = false;
+  }
+  control_cv_.notify_all();
+
+  // The control thread might be waiting on the lock to reconfigure the encoder.
+  buffer_queue_mutex_.unlock();
+  if (control_thread_.joinable()) {
+    control_thread_.join();
+  }
+  buffer_queue_mutex_.lock();
+}
+
+void VideoSocket::controlLoop() {
+  std::unique_lock<std::mutex> lock(control_mutex_);
+  base::ScopedLockAssertion lock_assertion(control_mutex_);
+  while (control_running_) {
+    lock.unlock();
+    checkOrientation();
+    checkIdle();
+    onControlTick();
+    lock.lock();
+
+    control_cv_.wait_for(lock, kControlInterval, [this]() {
+      base::ScopedLockAssertion lock_assertion(control_mutex_);
+      return !control_running_;
+    });
+  }
+}
+
+void VideoSocket::checkIdle() {
+  auto now = std::chrono::steady_clock::now();
+  bool idle;
+  {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    idle = !subscribers_.empty() &&
+           std::all_of(subscribers_.begin(), subscribers_.end(), [&](const FrameQueue* queue) {
+             return queue->IsStalled(now, kIdleTimeout);
+           });
+  }
+
+  if (idle != idle_) {
+    LOG(INFO) << (idle ? "Every reader has stalled, pausing" : "Readers are back, resuming");
+    idle_ = idle;
+    onIdleChanged(idle);
+  }
+}
+
 void VideoSocket::checkOrientation() {
+  if (!physical_display_) {
+    // Simulcast layers are fed by another pipeline's display.
+    return;
+  }
+
   // Check orientation, update if it has changed.
   //
   // Polling for changes is inefficient and wrong, but the
   // useful stuff is hard to get at without a Dalvik VM.
-  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
-
   ui::DisplayState current_display_state;
   status_t rc = SurfaceComposerClient::getDisplayState(physical_display_, &current_display_state);
   if (rc != NO_ERROR) {
@@ -217,25 +960,36 @@ void VideoSocket::checkOrientation() {
     LOG(INFO) << "Updating display state";
     display_state_ = current_display_state;
 
-    // We can't directly apply the new display projection, because we're being called with locks
-    // held. As an awful hack around this, spawn a thread that does it for us.
-    sp<IBinder> display = display_;
-    uint32_t width = video_width_;
-    uint32_t height = video_height_;
+    SurfaceComposerClient::Transaction t;
+    setDisplayProjection(t, display_, sourceRect(), video_width_, video_height_);
+    t.setDisplayLayerStack(display_, layerStack());
+    t.apply();
+  }
+}
 
-    std::thread([display, current_display_state, width, height]() {
-      SurfaceComposerClient::Transaction t;
-      setDisplayProjection(t, display, current_display_state, width, height);
-      t.apply();
-    }).detach();
+Rect VideoSocket::sourceRect() const {
+  Rect display_rect(display_state_.layerStackSpaceRect);
+  if (!config_.crop) {
+    return display_rect;
   }
+
+  // If the display has rotated under the crop, capture what's left of it, or else everything.
+  Rect source;
+  if (!config_.crop->intersect(display_rect, &source)) {
+    return display_rect;
+  }
+  return source;
+}
+
+ui::LayerStack VideoSocket::layerStack() const {
+  return config_.layer_stack ? ui::LayerStack::fromValue(*config_.layer_stack)
+                             : display_state_.layerStack;
 }
 
 void VideoSocket::setDisplayProjection(SurfaceComposerClient::Transaction& t, sp<IBinder> display,
-                                       const ui::DisplayState& display_state, uint32_t width,
-                                       uint32_t height) {
-  // Set the region of the layer stack we're interested in, which in our case is "all of it".
-  Rect layer_stack_rect(display_state.layerStackSpaceRect);
+                                       const Rect& source, uint32_t width, uint32_t height) {
+  // Set the region of the layer stack we're interested in: all of it, or the crop.
+  Rect layer_stack_rect(source);
 
   // We need to preserve the aspect ratio of the display.
   float display_aspect =
@@ -290,11 +1044,30 @@ bool VideoSocket::createVirtualDisplay() {
   display_consumer_->setDefaultBufferSize(video_width_, video_height_);
 
   display_consumer_->setConsumerUsageBits(getGrallocUsageBits());
+
+  // Both limits have to be set before the producer connects.
+  if (std::optional<int> max_acquired = getMaxAcquiredBufferCount()) {
+    status_t rc = display_consumer_->setMaxAcquiredBufferCount(*max_acquired);
+    if (rc == NO_ERROR) {
+      rc = display_consumer_->setMaxBufferCount(*max_acquired + kDisplayProducerBufferCount);
+    }
+    if (rc != NO_ERROR) {
+      LOG(ERROR) << "failed to size display BufferQueue for " << *max_acquired
+                 << " acquired buffer(s): " << statusToString(rc);
+      return false;
+    }
+  }
+
   display_consumer_->consumerConnect(display_consumer_callbacks, true);
   display_producer_->connect(display_producer_callbacks, NATIVE_WINDOW_API_MEDIA, true,
                              &queue_buffer_output);
   LOG(INFO) << "connected to display BufferQueue";
 
+  // Allocate the display's buffers up front. Buffers that we hand off to an encoder are returned
+  // to the queue once they've been consumed, so this should be the only allocation we do.
+  display_producer_->allocateBuffers(video_width_, video_height_, PIXEL_FORMAT_RGBA_8888,
+                                     getGrallocUsageBits());
+
   SurfaceComposerClient::Transaction t;
   t.setDisplaySurface(display_, display_producer_);
   t.apply();
@@ -304,8 +1077,8 @@ bool VideoSocket::createVirtualDisplay() {
 
 bool VideoSocket::prepareVirtualDisplay() {
   SurfaceComposerClient::Transaction t;
-  setDisplayProjection(t, display_, display_state_, video_width_, video_height_);
-  t.setDisplayLayerStack(display_, display_state_.layerStack);
+  setDisplayProjection(t, display_, sourceRect(), video_width_, video_height_);
+  t.setDisplayLayerStack(display_, layerStack());
   t.apply();
   return true;
 }
@@ -328,11 +1101,11 @@ void VideoSocket::destroyVirtualDisplay() {
 }
 
 void MediaCodecSocket::CodecBufferProducerCallbacks::onBufferReleased() {
-  // TODO: Pass the buffer back over to the virtual display.
+  parent_.onCodecBufferReleased();
 }
 
 bool MediaCodecSocket::CodecBufferProducerCallbacks::needsReleaseNotify() {
-  return false;
+  return true;
 }
 
 void MediaCodecSocket::CodecBufferProducerCallbacks::onBuffersDiscarded(
@@ -354,6 +1127,16 @@ void MediaCodecSocket::onFrameReceived() {
     LOG(FATAL) << "failed to acquire buffer from IGraphicBufferConsumer: " << statusToString(rc);
   }
 
+  // Buffer timestamps are in nanoseconds, frames' are in microseconds.
+  int64_t timestamp = item.mTimestamp / 1000;
+  stats_.RecordSince(LatencyStage::Acquire, timestamp);
+
+  if (!codec_producer_) {
+    // The encoder is being reconfigured, drop the frame.
+    display_consumer_->releaseBuffer(item.mSlot, item.mFrameNumber, item.mFence);
+    return;
+  }
+
   rc = display_consumer_->detachBuffer(item.mSlot);
   if (rc != NO_ERROR) {
     LOG(FATAL) << "failed to detach buffer from IGraphicBufferConsumer: " << statusToString(rc);
@@ -367,27 +1150,89 @@ void MediaCodecSocket::onFrameReceived() {
 
   BnGraphicBufferProducer::QueueBufferInput queue_buffer_input(
       item.mTimestamp, item.mIsAutoTimestamp, item.mDataSpace, item.mCrop, item.mScalingMode,
-      item.mTransform, item.mFence);
+      item.mTransform, shareFrame(item));
   BnGraphicBufferProducer::QueueBufferOutput output;
   rc = codec_producer_->queueBuffer(codec_slot, queue_buffer_input, &output);
   if (rc != NO_ERROR) {
     LOG(FATAL) << "failed to queue buffer to IGraphicBufferProducer: " << statusToString(rc);
   }
+  stats_.RecordSince(LatencyStage::EncoderInput, timestamp);
+}
+
+void MediaCodecSocket::requestSyncFrame() {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  if (codec_) {
+    LOG(INFO) << "Requesting sync frame";
+    codec_->requestIDRFrame();
+  }
+}
+
+void MediaCodecSocket::onCodecBufferReleased() {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  if (!codec_producer_ || !display_consumer_) {
+    return;
+  }
+
+  sp<GraphicBuffer> buffer;
+  sp<Fence> fence;
+  status_t rc = codec_producer_->detachNextBuffer(&buffer, &fence);
+  if (rc != NO_ERROR) {
+    LOG(WARNING) << "failed to detach buffer from encoder: " << statusToString(rc);
+    return;
+  }
+
+  // If there's no room for the buffer in the virtual display's queue, let it be freed.
+  int slot;
+  rc = display_consumer_->attachBuffer(&slot, buffer);
+  if (rc != NO_ERROR) {
+    LOG(WARNING) << "failed to attach buffer to IGraphicBufferConsumer: " << statusToString(rc);
+    return;
+  }
+
+  // Buffers attached to a consumer start out with a frame number of 0.
+  rc = display_consumer_->releaseBuffer(slot, 0, fence);
+  if (rc != NO_ERROR) {
+    LOG(WARNING) << "failed to release buffer to IGraphicBufferConsumer: " << statusToString(rc);
+  }
 }
 
 bool MediaCodecSocket::createEncoder() {
   looper_ = new ALooper();
-  looper_->setName("wardenclyffe_looper");
-  looper_->start();
+  looper_->setName("wardenclyffe_encoder");
+
+  codec_looper_ = new ALooper();
+  codec_looper_->setName("wardenclyffe_codec");
+  codec_looper_->start(false /* runOnCallingThread */, false /* canCallJava */,
+                       PRIORITY_URGENT_DISPLAY);
+  TuneLooper(codec_looper_, "encoder");
 
-  codec_ = MediaCodec::CreateByType(looper_, getCodecMimeType(), true);
+  codec_ = MediaCodec::CreateByType(codec_looper_, getCodecMimeType(), true);
   if (!codec_) {
     LOG(ERROR) << "Failed to create codec instance";
     return false;
   }
 
+  if (!checkCapabilities()) {
+    return false;
+  }
+
+  // Rate control scales relative to the size we start at, once the encoder has had its say in it.
+  if (base_width_ == 0) {
+    base_width_ = video_width_;
+    base_height_ = video_height_;
+  }
+
+  // Async mode has to be picked before configuring.
+  codec_callbacks_ = sp<CodecCallbacks>::make(*this, codec_);
+  looper_->registerHandler(codec_callbacks_);
+  status_t err = codec_->setCallback(sp<AMessage>::make(0, codec_callbacks_));
+  if (err != NO_ERROR) {
+    LOG(ERROR) << "Failed to set codec callback (err = " << err << ")";
+    return false;
+  }
+
   sp<AMessage> format = getCodecFormat();
-  status_t err = codec_->configure(format, nullptr, nullptr, MediaCodec::CONFIGURE_FLAG_ENCODE);
+  err = codec_->configure(format, nullptr, nullptr, MediaCodec::CONFIGURE_FLAG_ENCODE);
   if (err != NO_ERROR) {
     LOG(ERROR) << "Failed to configure codec at " << video_width_ << "x" << video_height_
                << " (err = " << err << ")";
@@ -400,13 +1245,15 @@ bool MediaCodecSocket::createEncoder() {
     return false;
   }
 
-  BnGraphicBufferProducer::QueueBufferOutput queue_buffer_output;
-  auto codec_producer_callbacks = sp<CodecBufferProducerCallbacks>::make(*this);
-  err = codec_producer_->connect(codec_producer_callbacks, NATIVE_WINDOW_API_MEDIA, true,
-                                 &queue_buffer_output);
-  if (err != NO_ERROR) {
-    LOG(ERROR) << "Failed to connect to encoder input surface";
-    return false;
+  if (connectsInputSurface()) {
+    BnGraphicBufferProducer::QueueBufferOutput queue_buffer_output;
+    auto codec_producer_callbacks = sp<CodecBufferProducerCallbacks>::make(*this);
+    err = codec_producer_->connect(codec_producer_callbacks, NATIVE_WINDOW_API_MEDIA, true,
+                                   &queue_buffer_output);
+    if (err != NO_ERROR) {
+      LOG(ERROR) << "Failed to connect to encoder input surface";
+      return false;
+    }
   }
 
   err = codec_->start();
@@ -420,126 +1267,167 @@ bool MediaCodecSocket::createEncoder() {
 }
 
 bool MediaCodecSocket::startEncoder() {
-  CHECK(!running_);
+  CHECK(!encoder_running_);
+  encoder_running_ = true;
   running_ = true;
-  encoder_thread_ = std::thread([this]() {
-    android::sp<android::MediaCodec> codec;
-    Vector<sp<MediaCodecBuffer>> buffers;
-    status_t err;
 
-    {
-      std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
-      codec = codec_;
+  // Output buffers that came out since the codec was started are waiting on the looper.
+  status_t err = looper_->start(false /* runOnCallingThread */, false /* canCallJava */,
+                                PRIORITY_URGENT_DISPLAY);
+  if (err != NO_ERROR) {
+    LOG(ERROR) << "Failed to start encoder looper (err = " << err << ")";
+    encoder_running_ = false;
+    return false;
+  }
+  TuneLooper(looper_, "encoder");
+  return true;
+}
+
+void MediaCodecSocket::CodecCallbacks::onMessageReceived(const sp<AMessage>& msg) {
+  parent_.onCodecCallback(codec_, msg);
+}
+
+void MediaCodecSocket::onCodecCallback(const sp<MediaCodec>& codec, const sp<AMessage>& msg) {
+  if (!encoder_running_) {
+    // The encoder is going away, and its buffers with it.
+    return;
+  }
+
+  int32_t callback_id;
+  if (!msg->findInt32("callbackID", &callback_id)) {
+    LOG(WARNING) << "Encoder callback without an ID";
+    return;
+  }
+
+  switch (callback_id) {
+    case MediaCodec::CB_OUTPUT_AVAILABLE:
+      if (!onOutputAvailable(codec, msg)) {
+        onEncoderFailed();
+      }
+      break;
+
+    case MediaCodec::CB_OUTPUT_FORMAT_CHANGED:
+      LOG(VERBOSE) << "Encoder format changed";
+      break;
+
+    case MediaCodec::CB_ERROR: {
+      int32_t err = UNKNOWN_ERROR;
+      msg->findInt32("err", &err);
+      LOG(ERROR) << "Encoder failed (err = " << err << ")";
+      onEncoderFailed();
+      break;
     }
 
-    err = codec->getOutputBuffers(&buffers);
-    if (err != NO_ERROR) {
-      LOG(FATAL) << "failed to get output buffers (err = " << err << ")";
-    }
-
-    while (running_) {
-      size_t buf_index, offset, size;
-      int64_t pts_usec;
-      uint32_t flags;
-
-      static constexpr int kTimeout = 250000;
-      err = codec->dequeueOutputBuffer(&buf_index, &offset, &size, &pts_usec, &flags, kTimeout);
-      switch (err) {
-        case NO_ERROR:
-          if (size != 0) {
-            Frame frame;
-            if (flags & BUFFER_FLAG_CODEC_CONFIG) {
-              frame.type = FrameType::Description;
-            } else if (flags & BUFFER_FLAG_KEY_FRAME) {
-              frame.type = FrameType::Keyframe;
-            } else {
-              frame.type = FrameType::Interframe;
-            }
-
-            bool new_frame = false;
-            {
-              std::lock_guard<std::mutex> lock(frame_mutex_);
-              char* p = reinterpret_cast<char*>(buffers[buf_index]->data());
-              if (frame.type == FrameType::Description) {
-                partial_frame_.assign(p, p + size);
-              } else {
-                encode_timer_.Tick();
-
-                std::vector<char> data = std::move(partial_frame_);
-                data.insert(data.end(), p, p + size);
-                frame.data = std::move(data);
-                frame.timestamp = pts_usec;
-                frames_.push_back(std::move(frame));
-                new_frame = true;
-              }
-            }
-
-            if (new_frame) {
-              cv_.notify_one();
-            }
-          }
-          err = codec->releaseOutputBuffer(buf_index);
-
-          if (err != NO_ERROR) {
-            LOG(ERROR) << "Unable to release output buffer: (err = " << err << ")";
-            goto exit;
-          }
-
-          if ((flags & MediaCodec::BUFFER_FLAG_EOS) != 0) {
-            LOG(ERROR) << "Received end of stream from surfaceflinger";
-            goto exit;
-          }
-          break;
+    default:
+      // Input comes from a surface, so there are no input buffers to fill.
+      break;
+  }
+}
 
-        case -EAGAIN:  // INFO_TRY_AGAIN_LATER
-          LOG(INFO) << "Got -EAGAIN, looping";
-          break;
+bool MediaCodecSocket::onOutputAvailable(const sp<MediaCodec>& codec, const sp<AMessage>& msg) {
+  int32_t buf_index, flags;
+  size_t size;
+  int64_t pts_usec;
+  if (!msg->findInt32("index", &buf_index) || !msg->findSize("size", &size) ||
+      !msg->findInt64("timeUs", &pts_usec) || !msg->findInt32("flags", &flags)) {
+    LOG(ERROR) << "Malformed encoder output callback: " << msg->debugString().c_str();
+    return false;
+  }
 
-        case android::INFO_FORMAT_CHANGED:  // INFO_OUTPUT_FORMAT_CHANGED
-          LOG(VERBOSE) << "Encoder format changed";
-          break;
+  if (size != 0) {
+    sp<MediaCodecBuffer> buffer;
+    status_t err = codec->getOutputBuffer(buf_index, &buffer);
+    if (err != NO_ERROR || !buffer) {
+      LOG(ERROR) << "Unable to get output buffer " << buf_index << " (err = " << err << ")";
+      return false;
+    }
 
-        case android::INFO_OUTPUT_BUFFERS_CHANGED:  // INFO_OUTPUT_BUFFERS_CHANGED
-          // Not expected for an encoder; handle it anyway.
-          LOG(INFO) << "Encoder buffers changed";
-          err = codec->getOutputBuffers(&buffers);
-          if (err != NO_ERROR) {
-            LOG(ERROR) << "Unable to get new output buffers (err = " << err << ")";
-            goto exit;
-          }
-          break;
+    sp<Frame> frame = frame_pool_->Acquire(size);
+    if (flags & BUFFER_FLAG_CODEC_CONFIG) {
+      frame->type = FrameType::Description;
+    } else if ((flags & BUFFER_FLAG_KEY_FRAME) || isIntraOnly()) {
+      frame->type = FrameType::Keyframe;
+    } else {
+      frame->type = FrameType::Interframe;
+    }
 
-        case INVALID_OPERATION:
-          LOG(ERROR) << "dequeueOutputBuffer returned INVALID_OPERATION";
-          goto exit;
+    char* p = reinterpret_cast<char*>(buffer->data());
+    frame->data.insert(frame->data.end(), p, p + size);
+    frame->timestamp = pts_usec;
+    if (frame->type != FrameType::Description) {
+      stats_.RecordSince(LatencyStage::EncoderOutput, frame->timestamp);
+    }
+    if (emit_descriptors_) {
+      frame->Describe();
+    }
 
-        default:
-          LOG(ERROR) << "Got weird result " << err << " from dequeueOutputBuffer";
-          goto exit;
+    bool sync_needed = false;
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex_);
+      if (frame->type == FrameType::Description) {
+        // Configs aren't queued on their own, and share the sequence number of the keyframe that
+        // they precede.
+        if (codec_config_ && !samePayload(*codec_config_, *frame)) {
+          frame->flags |= FrameHeader::kFlagNewConfig;
+        }
+        frame->sequence = next_sequence_;
+        frame->WriteHeader();
+        codec_config_ = std::move(frame);
+      } else {
+        encode_timer_.Tick();
+
+        // Every keyframe carries a reference to the codec config, so that readers can start from
+        // any of them.
+        if (frame->type == FrameType::Keyframe) {
+          frame->config = codec_config_;
+        }
+        sync_needed = pushFrame(std::move(frame));
       }
     }
 
-  exit:
-    LOG(INFO) << "Encoder stopping (request = " << !running_ << ")";
-    running_ = false;
-  });
+    if (sync_needed) {
+      requestSyncFrame();
+    }
+  }
+
+  status_t err = codec->releaseOutputBuffer(buf_index);
+  if (err != NO_ERROR) {
+    LOG(ERROR) << "Unable to release output buffer: (err = " << err << ")";
+    return false;
+  }
+
+  if ((flags & MediaCodec::BUFFER_FLAG_EOS) != 0) {
+    LOG(ERROR) << "Received end of stream from surfaceflinger";
+    return false;
+  }
   return true;
 }
 
+void MediaCodecSocket::onEncoderFailed() {
+  // If the encoder was already being stopped, whoever's stopping it will take care of the rest.
+  if (encoder_running_.exchange(false)) {
+    LOG(INFO) << "Encoder stopped on its own";
+    running_ = false;
+    WakeReaders();
+  }
+}
+
 void MediaCodecSocket::stopEncoder() REQUIRES(buffer_queue_mutex_) {
-  running_ = false;
+  encoder_running_ = false;
+
+  // A callback might be waiting on the lock to request a sync frame.
   buffer_queue_mutex_.unlock();
-  cv_.notify_all();
-  if (encoder_thread_) {
-    encoder_thread_->join();
-    encoder_thread_.reset();
+  if (looper_) {
+    looper_->stop();
   }
   buffer_queue_mutex_.lock();
 }
 
 void MediaCodecSocket::destroyEncoder() {
   if (codec_producer_) {
-    codec_producer_->disconnect(NATIVE_WINDOW_API_MEDIA);
+    if (connectsInputSurface()) {
+      codec_producer_->disconnect(NATIVE_WINDOW_API_MEDIA);
+    }
     codec_producer_ = nullptr;
   }
 
@@ -548,4 +1436,250 @@ void MediaCodecSocket::destroyEncoder() {
     codec_->release();
     codec_ = nullptr;
   }
+
+  if (codec_callbacks_) {
+    looper_->unregisterHandler(codec_callbacks_->id());
+    codec_callbacks_ = nullptr;
+  }
+}
+
+void MediaCodecSocket::onControlTick() {
+  auto now = std::chrono::steady_clock::now();
+  if (now - last_rate_control_ < kRateControlInterval) {
+    return;
+  }
+  last_rate_control_ = now;
+
+  bool congested = congested_.exchange(false);
+  uint32_t receive_kbps = min_receive_kbps_.exchange(UINT32_MAX);
+
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  if (!running_ || !codec_ || suspended_) {
+    // Stalled readers look congested, but the network might be fine once they come back.
+    return;
+  }
+
+  if (congested) {
+    stable_intervals_ = 0;
+    if (controlsBitrate() && bitrate_ > kMinBitrate) {
+      // Back off multiplicatively, and never stay above what the client says it's getting.
+      int64_t bitrate = bitrate_ * 3 / 4;
+      if (receive_kbps != UINT32_MAX) {
+        bitrate = std::min<int64_t>(bitrate, static_cast<int64_t>(receive_kbps) * 1000 * 9 / 10);
+      }
+      setBitrate(std::max<int64_t>(bitrate, kMinBitrate));
+    } else if (canResize() && scale_index_ + 1 < std::size(kScales)) {
+      resize(scale_index_ + 1);
+    }
+  } else if (++stable_intervals_ >= kStableIntervalsBeforeIncrease) {
+    stable_intervals_ = 0;
+    if (controlsBitrate() && bitrate_ < config_.bitrate) {
+      setBitrate(std::min<int64_t>(config_.bitrate, bitrate_ + config_.bitrate / 10));
+    } else if (scale_index_ > 0) {
+      resize(scale_index_ - 1);
+    }
+  }
+}
+
+// Parse a "<min>-<max>" range out of a codec's capability details.
+static bool findRange(const sp<AMessage>& details, const char* name, int64_t* min, int64_t* max) {
+  AString range;
+  if (!details->findString(name, &range)) {
+    return false;
+  }
+  long long low, high;
+  if (sscanf(range.c_str(), "%lld-%lld", &low, &high) != 2) {
+    return false;
+  }
+  *min = low;
+  *max = high;
+  return true;
+}
+
+bool MediaCodecSocket::checkCapabilities() {
+  sp<MediaCodecInfo> info;
+  if (codec_->getCodecInfo(&info) != NO_ERROR || !info) {
+    LOG(WARNING) << "Failed to get codec info, skipping capability checks";
+    return true;
+  }
+
+  sp<MediaCodecInfo::Capabilities> capabilities = info->getCapabilitiesFor(getCodecMimeType());
+  if (!capabilities) {
+    LOG(WARNING) << "Failed to get codec capabilities, skipping capability checks";
+    return true;
+  }
+  sp<AMessage> details = capabilities->getDetails();
+
+  AString size_range;
+  int min_width, min_height, max_width, max_height;
+  if (details->findString("size-range", &size_range) &&
+      sscanf(size_range.c_str(), "%dx%d-%dx%d", &min_width, &min_height, &max_width,
+             &max_height) == 4) {
+    // The size range alone lets through sizes past the encoder's level, e.g. native resolution on
+    // a tall phone screen, so count macroblocks too.
+    AString block_size;
+    int block_width = 0, block_height = 0;
+    int64_t min_blocks, max_blocks;
+    if (!details->findString("block-size", &block_size) ||
+        sscanf(block_size.c_str(), "%dx%d", &block_width, &block_height) != 2 ||
+        block_width <= 0 || block_height <= 0 ||
+        !findRange(details, "block-count-range", &min_blocks, &max_blocks)) {
+      block_width = block_height = 1;
+      max_blocks = INT64_MAX;
+    }
+
+    // Encoders that can rotate report their limits in either orientation.
+    auto fits = [&](uint32_t width, uint32_t height) {
+      int64_t blocks = static_cast<int64_t>((width + block_width - 1) / block_width) *
+                       ((height + block_height - 1) / block_height);
+      return static_cast<int>(width) >= min_width && static_cast<int>(width) <= max_width &&
+             static_cast<int>(height) >= min_height && static_cast<int>(height) <= max_height &&
+             blocks <= max_blocks;
+    };
+    auto fits_either = [&](uint32_t width, uint32_t height) {
+      return fits(width, height) || fits(height, width);
+    };
+
+    // Nobody asked for this size, so shrink it as far as rate control would before giving up.
+    if (!fits_either(video_width_, video_height_) && base_width_ == 0 && config_.width == 0 &&
+        config_.height == 0) {
+      for (double scale : kScales) {
+        uint32_t width = floorToEven(video_width_ * scale);
+        uint32_t height = floorToEven(video_height_ * scale);
+        if (fits_either(width, height)) {
+          LOG(INFO) << info->getCodecName() << " doesn't support " << video_width_ << "x"
+                    << video_height_ << ", encoding at " << width << "x" << height;
+          video_width_ = width;
+          video_height_ = height;
+          break;
+        }
+      }
+    }
+
+    if (!fits_either(video_width_, video_height_)) {
+      LOG(ERROR) << info->getCodecName() << " doesn't support " << video_width_ << "x"
+                 << video_height_ << " (supported: " << size_range.c_str() << ")";
+      return false;
+    }
+  }
+
+  AString alignment;
+  int align_width, align_height;
+  if (details->findString("alignment", &alignment) &&
+      sscanf(alignment.c_str(), "%dx%d", &align_width, &align_height) == 2 && align_width > 0 &&
+      align_height > 0) {
+    if (video_width_ % align_width != 0 || video_height_ % align_height != 0) {
+      LOG(ERROR) << info->getCodecName() << " requires sizes aligned to " << alignment.c_str()
+                 << ", got " << video_width_ << "x" << video_height_;
+      return false;
+    }
+  }
+
+  int64_t min, max;
+  if (findRange(details, "frame-rate-range", &min, &max) &&
+      (video_framerate_ < min || video_framerate_ > max)) {
+    LOG(ERROR) << info->getCodecName() << " doesn't support " << video_framerate_
+               << " fps (supported: " << min << "-" << max << ")";
+    return false;
+  }
+
+  if (controlsBitrate() && findRange(details, "bitrate-range", &min, &max) &&
+      (bitrate_ < min || bitrate_ > max)) {
+    LOG(ERROR) << info->getCodecName() << " doesn't support a bitrate of " << bitrate_
+               << " (supported: " << min << "-" << max << ")";
+    return false;
+  }
+
+  return true;
+}
+
+sp<AMessage> MediaCodecSocket::getBaseCodecFormat() {
+  auto format = sp<AMessage>::make();
+  format->setInt32(KEY_WIDTH, video_width_);
+  format->setInt32(KEY_HEIGHT, video_height_);
+  format->setString(KEY_MIME, getCodecMimeType());
+  format->setInt32(KEY_COLOR_FORMAT, PIXEL_FORMAT_RGBA_8888);
+
+  format->setInt32(KEY_BITRATE_MODE, BITRATE_MODE_CBR);
+  format->setInt32(KEY_BIT_RATE, bitrate_);
+
+  format->setFloat(KEY_FRAME_RATE, video_framerate_);
+  format->setFloat(KEY_MAX_FPS_TO_ENCODER, video_framerate_);
+
+  // The virtual display only produces buffers when the screen changes. Repeat the last one every
+  // so often, so that a static screen costs next to nothing but readers still see the stream.
+  format->setInt64(KEY_REPEAT_PREVIOUS_FRAME_AFTER, kKeepaliveInterval.count());
+
+  // An encoder recreated while idle stays paused until there's a reader again.
+  if (suspended_) {
+    format->setInt32(KEY_CREATE_INPUT_SURFACE_SUSPENDED, 1);
+  }
+
+  format->setInt32(KEY_I_FRAME_INTERVAL, -1);
+  format->setInt32(KEY_PRIORITY, 0);
+  format->setInt32(KEY_LOW_LATENCY, 1);
+
+  // Realtime priority on its own only promises to keep up with the frame rate. Ask for the
+  // encoder's top speed, so that each frame spends as little time in it as possible.
+  format->setFloat(KEY_OPERATING_RATE, std::numeric_limits<int16_t>::max());
+  return format;
+}
+
+void MediaCodecSocket::onIdleChanged(bool idle) {
+  std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+  suspended_ = idle;
+  if (!codec_) {
+    return;
+  }
+
+  auto params = sp<AMessage>::make();
+  params->setInt32(PARAMETER_KEY_SUSPEND, idle);
+  status_t err = codec_->setParameters(params);
+  if (err != NO_ERROR) {
+    LOG(WARNING) << "Failed to " << (idle ? "suspend" : "resume") << " encoder (err = " << err
+                 << ")";
+  } else if (!idle) {
+    codec_->requestIDRFrame();
+  }
+}
+
+void MediaCodecSocket::setBitrate(int32_t bitrate) {
+  LOG(INFO) << "Changing bitrate from " << bitrate_ << " to " << bitrate;
+  bitrate_ = bitrate;
+
+  auto params = sp<AMessage>::make();
+  params->setInt32(PARAMETER_KEY_VIDEO_BITRATE, bitrate);
+  status_t err = codec_->setParameters(params);
+  if (err != NO_ERROR) {
+    LOG(WARNING) << "Failed to set bitrate (err = " << err << ")";
+  }
+}
+
+bool MediaCodecSocket::resize(size_t scale_index) {
+  uint32_t width = floorToEven(base_width_ * kScales[scale_index]);
+  uint32_t height = floorToEven(base_height_ * kScales[scale_index]);
+  LOG(INFO) << "Resizing encoder from " << video_width_ << "x" << video_height_ << " to " << width
+            << "x" << height;
+
+  // The encoder can't change resolution on the fly, so replace it. Readers stay connected, and
+  // pick up the new codec config with the next keyframe.
+  stopEncoder();
+  destroyEncoder();
+
+  scale_index_ = scale_index;
+  video_width_ = width;
+  video_height_ = height;
+  display_consumer_->setDefaultBufferSize(width, height);
+
+  if (!createEncoder() || !startEncoder()) {
+    LOG(ERROR) << "Failed to restart encoder at " << width << "x" << height;
+    running_ = false;
+    WakeReaders();
+    return false;
+  }
+
+  SurfaceComposerClient::Transaction t;
+  setDisplayProjection(t, display_, sourceRect(), width, height);
+  t.apply();
+  return true;
 }
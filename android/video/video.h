@@ -2,32 +2,80 @@
 
 #include <stdint.h>
 
+#include <array>
 #include <atomic>
 #include <chrono>
-#include <deque>
+#include <condition_variable>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <gui/BufferItem.h>
+#include <gui/BufferQueueDefs.h>
 #include <gui/IConsumerListener.h>
 #include <gui/IProducerListener.h>
 #include <gui/SurfaceComposerClient.h>
+#include <json/value.h>
 #include <media/stagefright/MediaCodec.h>
+#include <media/stagefright/foundation/AHandler.h>
 #include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
 #include <ui/DisplayState.h>
+#include <ui/Fence.h>
+#include <ui/Rect.h>
 #include <utils/StrongPointer.h>
 
+#include "wardenclyffe/android/frame.h"
+#include "wardenclyffe/android/frame_queue.h"
 #include "wardenclyffe/android/socket.h"
+#include "wardenclyffe/android/spsc_ring.h"
+#include "wardenclyffe/android/stats.h"
 #include "wardenclyffe/wardenclyffe.h"
 
-enum class FrameType { Description, Keyframe, Interframe };
+// Parameters that identify a capture+encode pipeline. Sockets requesting the same parameters share
+// a single virtual display and encoder.
+//
+// These come from the socket's query string, e.g. /video/h264/?width=640&fps=15.
+struct VideoConfig {
+  std::string codec;
 
-struct Frame {
-  std::vector<char> data;
-  FrameType type;
-  int64_t timestamp;
+  // If only one of these is set, the other follows the display's aspect ratio. If neither is, the
+  // video is half the size of the display.
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  uint32_t fps = 30;
+  int32_t bitrate = 10'000'000;
+
+  // JPEG quality, from 1 to 100. Only valid for jpeg.
+  std::optional<uint32_t> quality;
+
+  // Send only the parts of the screen that changed, as JPEG patches. Only valid for jpeg.
+  bool tiles = false;
+
+  // Physical display to capture, as listed by /video/displays/. Defaults to the internal display.
+  std::optional<uint64_t> display;
+
+  // Composite this layer stack instead of the display's own, with the display's geometry.
+  std::optional<uint32_t> layer_stack;
+
+  // Only capture this region of the display, given as "x,y,width,height" in the display's
+  // coordinates. A cropped capture defaults to the region's own size rather than half of it.
+  std::optional<android::Rect> crop;
+
+  // Also encode the capture at 1/2 and 1/4 of its size, as layers that each reader picks between,
+  // so that thumbnails and a full-size view share a single virtual display. Only valid for h264,
+  // and defaults to the display's own size.
+  bool simulcast = false;
+
+  std::string Key() const;
+
+  // Apply a "key=value" query parameter. Returns false if it isn't one of ours or is out of range.
+  bool Parse(std::string_view option);
 };
 
 struct FrameTimer {
@@ -42,30 +90,77 @@ struct FrameTimer {
   size_t counter_ = 0;
 };
 
-struct VideoSocket : public Socket {
-  VideoSocket(bool emit_descriptors = true)
-      : encode_timer_("Encode"),
-        transport_timer_("Transport"),
-        emit_descriptors_(emit_descriptors) {}
+// Playback statistics reported by a client.
+struct ClientFeedback {
+  // Frames submitted to the decoder that haven't been output yet.
+  uint32_t decode_queue_depth = 0;
+
+  // Rate at which the client is receiving data.
+  uint32_t receive_kbps = 0;
+
+  // Fraction of packets lost on the way to the client, for transports that can lose them.
+  double packet_loss = 0;
+
+  // How much later than the quickest recent frames the slow ones reach the client, which grows as
+  // queues build up along the way.
+  uint32_t jitter_ms = 0;
+};
+
+// A capture+encode pipeline: a virtual display, an encoder, and a ring of recently encoded frames
+// that is shared between every VideoSubscriber reading from it.
+struct VideoSocket {
+  explicit VideoSocket(VideoConfig config, bool emit_descriptors = true)
+      : config_(std::move(config)),
+        encode_timer_("Encode"),
+        emit_descriptors_(emit_descriptors),
+        video_width_(config_.width),
+        video_height_(config_.height),
+        video_framerate_(config_.fps) {}
   virtual ~VideoSocket() { VideoSocket::Destroy(); }
 
-  static VideoSocket* Create(std::string_view path);
+  static Socket* Create(std::string_view path);
 
-  virtual WardenclyffeReads Read() final;
-  virtual bool SupportsRead() final { return true; }
+  // Find out which codecs this device can encode. Called once at startup.
+  static void ProbeCodecs();
+
+  // Statistics for every running pipeline, for CreateStatsSocket.
+  static Json::Value DescribeStats(bool reset);
+
+  // Start delivering frames to |queue|, beginning at a keyframe. Without |join_history|, that's
+  // always a new keyframe rather than the most recent one.
+  void Subscribe(FrameQueue* queue, bool join_history = true) EXCLUDES(frame_mutex_);
+  void Unsubscribe(FrameQueue* queue) EXCLUDES(frame_mutex_);
+  void WakeReaders() EXCLUDES(frame_mutex_);
+
+  // Ask for a keyframe, unless one has already been asked for.
+  void RequestSyncFrame() EXCLUDES(frame_mutex_);
+
+  void ReportFeedback(const ClientFeedback& feedback);
+
+  // A simulcast pipeline encodes its capture once per layer. Layer 0 is the pipeline itself, and
+  // each one after it is smaller. Returns nullptr past the last layer.
+  virtual VideoSocket* Layer(size_t index) { return index == 0 ? this : nullptr; }
+
+  bool EmitsDescriptors() const { return emit_descriptors_; }
+  bool IsRunning() const { return running_; }
+  PipelineStats& Stats() { return stats_; }
+  FramePool& Pool() { return *frame_pool_; }
 
   bool Initialize() EXCLUDES(buffer_queue_mutex_) {
     std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
     return fetchDisplayParameters() && createEncoder() && createVirtualDisplay() &&
-           prepareVirtualDisplay() && startEncoder();
+           prepareVirtualDisplay() && startEncoder() && startControlThread();
   }
 
-  virtual void Destroy() override EXCLUDES(buffer_queue_mutex_) {
+  virtual void Destroy() EXCLUDES(buffer_queue_mutex_) {
     std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
     DestroyLocked();
   }
 
-  virtual void DestroyLocked() REQUIRES(buffer_queue_mutex_) { destroyVirtualDisplay(); }
+  virtual void DestroyLocked() REQUIRES(buffer_queue_mutex_) {
+    stopControlThread();
+    destroyVirtualDisplay();
+  }
 
  protected:
   bool fetchDisplayParameters();
@@ -74,11 +169,37 @@ struct VideoSocket : public Socket {
 
   void destroyVirtualDisplay() REQUIRES(buffer_queue_mutex_);
 
-  void checkOrientation() EXCLUDES(buffer_queue_mutex_);
+  // Display state changes are picked up by polling from a dedicated control thread, to keep binder
+  // calls off of the frame path. The same thread adapts the stream to network conditions.
+  static constexpr std::chrono::milliseconds kControlInterval{250};
+  bool startControlThread();
+  void stopControlThread() REQUIRES(buffer_queue_mutex_) EXCLUDES(control_mutex_);
+  void controlLoop() EXCLUDES(control_mutex_);
+  void checkOrientation();
+
+  // Called from the control thread every kControlInterval.
+  virtual void onControlTick() {}
+
+  // The pipeline goes idle when every reader has stopped taking frames, e.g. because their
+  // WebSockets are stalled. There's no point in encoding frames that will only be dropped.
+  static constexpr std::chrono::seconds kIdleTimeout{2};
+  void checkIdle() EXCLUDES(frame_mutex_);
+
+  // Called from the control thread when the pipeline goes idle or becomes active again. Coming
+  // back should start with a keyframe, since readers will have dropped frames in the meantime.
+  virtual void onIdleChanged(bool) {}
+
+  // Adds pipeline-specific numbers to this pipeline's entry in /stats/.
+  virtual void describeStats(Json::Value*) {}
+
+  // The part of the layer stack to capture, and the layer stack itself, after applying the
+  // config's crop and layer_stack to the current display state.
+  android::Rect sourceRect() const;
+  android::ui::LayerStack layerStack() const;
+
   static void setDisplayProjection(android::SurfaceComposerClient::Transaction& t,
                                    android::sp<android::IBinder> display,
-                                   const android::ui::DisplayState& display_state, uint32_t width,
-                                   uint32_t height);
+                                   const android::Rect& source, uint32_t width, uint32_t height);
 
   virtual void onFrameReceived() = 0;
 
@@ -86,14 +207,41 @@ struct VideoSocket : public Socket {
   virtual bool startEncoder() REQUIRES(buffer_queue_mutex_) = 0;
   virtual uint64_t getGrallocUsageBits() = 0;
 
+  // How many of the virtual display's buffers we hold at once, if we hold on to them at all rather
+  // than detaching them. Called after createEncoder.
+  virtual std::optional<int> getMaxAcquiredBufferCount() REQUIRES(buffer_queue_mutex_) {
+    return std::nullopt;
+  }
+
+  // Buffers the display needs on top of those, to compose into while we hold ours.
+  static constexpr int kDisplayProducerBufferCount = 3;
+
+  // Ask the encoder to emit a keyframe as soon as possible.
+  virtual void requestSyncFrame() EXCLUDES(buffer_queue_mutex_) {}
+
+  // Queue a frame for every reader. Returns true if a reader is waiting for a keyframe that hasn't
+  // been asked for yet, in which case the caller should call requestSyncFrame once it's dropped the
+  // lock.
+  [[nodiscard]] bool pushFrame(android::sp<Frame> frame) REQUIRES(frame_mutex_);
+  void offerFrame(FrameQueue* queue, const android::sp<const Frame>& frame) REQUIRES(frame_mutex_);
+
+  // Congestion signals gathered since the control thread last looked. A reader falling behind
+  // means that the WebSocket can't keep up, since frames are only read once the previous one has
+  // been sent.
+  std::atomic<bool> congested_ = false;
+  std::atomic<uint32_t> min_receive_kbps_ = UINT32_MAX;
+
+  const VideoConfig config_;
+
+  std::shared_ptr<FramePool> frame_pool_ = std::make_shared<FramePool>();
   FrameTimer encode_timer_;
-  FrameTimer transport_timer_;
+  PipelineStats stats_;
 
   bool emit_descriptors_;
 
   uint32_t video_width_ = 0;
   uint32_t video_height_ = 0;
-  float video_framerate_ = 30;
+  float video_framerate_;
 
   std::mutex buffer_queue_mutex_;
   android::sp<android::IBinder> physical_display_;
@@ -101,17 +249,32 @@ struct VideoSocket : public Socket {
   android::sp<android::IGraphicBufferConsumer> display_consumer_ GUARDED_BY(buffer_queue_mutex_);
   android::sp<android::IGraphicBufferProducer> display_producer_ GUARDED_BY(buffer_queue_mutex_);
 
+  // Only touched by the control thread once the virtual display has been set up.
   android::ui::DisplayState display_state_;
   android::ui::DisplayMode display_mode_;
 
+  std::thread control_thread_;
+  std::mutex control_mutex_;
+  std::condition_variable control_cv_;
+  bool control_running_ GUARDED_BY(control_mutex_) = false;
+
+  // Only touched by the control thread.
+  bool idle_ = false;
+
+  // Only taken by producers, and by readers coming and going.
   std::mutex frame_mutex_;
-  std::condition_variable cv_;
+  std::vector<FrameQueue*> subscribers_ GUARDED_BY(frame_mutex_);
   std::atomic<bool> running_ = false;
 
-  std::deque<Frame> frames_ GUARDED_BY(frame_mutex_);
-  std::vector<char> partial_frame_ GUARDED_BY(frame_mutex_);
-  std::deque<std::string> descriptions_ GUARDED_BY(frame_mutex_);
-  std::vector<WardenclyffeRead> reads_ GUARDED_BY(frame_mutex_);
+  // The newest keyframe and the frames after it, which is where new readers start. Readers only
+  // join here if they'd be able to catch up quickly, so this doesn't need to go back very far.
+  static constexpr size_t kMaxHistoryFrames = 30;
+  std::vector<android::sp<const Frame>> history_ GUARDED_BY(frame_mutex_);
+  uint64_t next_sequence_ GUARDED_BY(frame_mutex_) = 0;
+  bool sync_frame_requested_ GUARDED_BY(frame_mutex_) = false;
+
+  // The newest codec config.
+  android::sp<const Frame> codec_config_ GUARDED_BY(frame_mutex_);
 
   std::future<void> display_consumer_disconnect_future_;
 
@@ -145,40 +308,200 @@ struct VideoSocket : public Socket {
   };
 };
 
+// A reader of a shared VideoSocket, handed out to wardenclyffe_create_socket callers.
+struct VideoSubscriber : public Socket {
+  // Frames come from |pipeline|'s |layer|, which must exist. With |binary_header|, each frame is
+  // sent as a single read with its FrameHeader in front. Otherwise, it's preceded by an
+  // out-of-band JSON descriptor.
+  VideoSubscriber(std::shared_ptr<VideoSocket> pipeline, size_t layer, bool binary_header);
+  ~VideoSubscriber();
+
+  static constexpr size_t kDefaultMaxQueueDepth = 8;
+
+  virtual void Destroy() override;
+
+  virtual WardenclyffeReads Read() final;
+  virtual bool SupportsRead() final { return true; }
+
+  // Control messages from the client, as JSON:
+  //   {"type": "feedback", "decodeQueue": <frames>, "receiveKbps": <kbps>, "packetLoss": <0-1>,
+  //    "jitter": <ms>}
+  //   {"type": "keyframe"}
+  //   {"type": "layer", "layer": <index>}
+  //
+  // Switching layers carries on with the current one until the new one has a keyframe, so the
+  // reader doesn't miss a beat.
+  //
+  // Feedback can also carry the client's own latencies, in microseconds, for every frame since the
+  // last feedback: "decodeTimes", "bufferTimes" and "renderTimes", each [<us>, ...].
+  virtual bool Write(const void* data, size_t len) final;
+  virtual bool SupportsWrite() final { return true; }
+
+  virtual void OnReadsSent() final;
+
+ private:
+  // Keeps every layer alive.
+  const std::shared_ptr<VideoSocket> pipeline_;
+  const bool binary_header_;
+  FrameTimer transport_timer_;
+
+  std::atomic<bool> closed_ = false;
+
+  // The layer being read, and the queue it delivers to. These only change on the reader's thread,
+  // with layer_mutex_ held, so the reader itself doesn't need the lock to look at them.
+  std::mutex layer_mutex_;
+  VideoSocket* source_;
+  FrameQueue* queue_;
+
+  // While switching layers, the new layer delivers to the other queue until its first keyframe
+  // comes out, and then the two trade places.
+  FrameQueue queues_[2];
+  VideoSocket* next_source_ = nullptr;
+  FrameQueue* next_queue_;
+
+  // Set by Write, and picked up by the reader.
+  std::atomic<int> requested_layer_ = -1;
+
+  android::sp<const Frame> nextFrame() EXCLUDES(layer_mutex_);
+  void beginLayerSwitch(size_t layer) EXCLUDES(layer_mutex_);
+  void finishLayerSwitch() EXCLUDES(layer_mutex_);
+
+  void appendFrame(const android::sp<const Frame>& frame);
+
+  // The codec config most recently sent to the reader.
+  android::sp<const Frame> config_;
+
+  // Storage backing the most recently returned WardenclyffeReads: at most a config frame and a
+  // frame, each with a descriptor.
+  std::array<WardenclyffeRead, 4> reads_;
+  size_t read_count_ = 0;
+
+  // Frames that have been read but not sent yet, oldest first, with the stats of the layer they
+  // came from. This only has to cover the reads that the server buffers ahead of the WebSocket.
+  struct UnsentRead {
+    PipelineStats* stats = nullptr;
+    int64_t timestamp = 0;
+  };
+  static constexpr size_t kMaxUnsentReads = 16;
+  SpscRing<UnsentRead> unsent_reads_{kMaxUnsentReads};
+};
+
 struct MediaCodecSocket : public VideoSocket {
-  MediaCodecSocket() = default;
+  explicit MediaCodecSocket(VideoConfig config) : VideoSocket(std::move(config)) {}
   ~MediaCodecSocket() {
     std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
     MediaCodecSocket::DestroyLocked();
   }
 
   virtual void DestroyLocked() override REQUIRES(buffer_queue_mutex_) {
+    stopControlThread();
+    running_ = false;
+    WakeReaders();
     stopEncoder();
     VideoSocket::DestroyLocked();
     destroyEncoder();
   }
 
+  static constexpr int32_t kMinBitrate = 500'000;
+
  protected:
   virtual const char* getCodecMimeType() = 0;
-  virtual android::sp<android::AMessage> getCodecFormat() = 0;
+  virtual android::sp<android::AMessage> getCodecFormat() REQUIRES(buffer_queue_mutex_) = 0;
 
-  virtual uint64_t getGrallocUsageBits() final {
+  // The parts of the format that are common to every codec: size, rate control and latency.
+  android::sp<android::AMessage> getBaseCodecFormat() REQUIRES(buffer_queue_mutex_);
+
+  // Check the configured size, frame rate and bitrate against what the encoder says it supports.
+  bool checkCapabilities() REQUIRES(buffer_queue_mutex_);
+
+  // Whether every output buffer can be decoded on its own, even without BUFFER_FLAG_KEY_FRAME.
+  virtual bool isIntraOnly() { return false; }
+
+  // Whether the encoder is fed from the virtual display. Otherwise, whatever feeds it connects to
+  // its input surface itself.
+  virtual bool connectsInputSurface() { return true; }
+
+  // Whether rate control may drop the resolution when cutting the bitrate isn't enough.
+  virtual bool canResize() { return true; }
+
+  // Whether the encoder follows bitrate_. Otherwise, rate control goes straight to resizing.
+  virtual bool controlsBitrate() { return true; }
+
+  virtual uint64_t getGrallocUsageBits() override {
     return GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_VIDEO_ENCODER;
   }
 
   virtual void onFrameReceived() final;
 
-  virtual bool createEncoder() final REQUIRES(buffer_queue_mutex_);
+  // Called with each captured frame on its way to the encoder, for anything else that reads it.
+  // Returns the fence that the encoder waits on before reading it, which has to cover those reads
+  // too, since the buffer goes back to the virtual display once the encoder is done with it.
+  virtual android::sp<android::Fence> shareFrame(const android::BufferItem& item)
+      REQUIRES(buffer_queue_mutex_) {
+    return item.mFence;
+  }
+
+  // Move a buffer that the encoder is done with back into the virtual display's BufferQueue.
+  void onCodecBufferReleased() EXCLUDES(buffer_queue_mutex_);
+
+  virtual bool createEncoder() override REQUIRES(buffer_queue_mutex_);
   virtual bool startEncoder() final REQUIRES(buffer_queue_mutex_);
+  virtual void requestSyncFrame() final EXCLUDES(buffer_queue_mutex_);
   void stopEncoder() REQUIRES(buffer_queue_mutex_);
   void destroyEncoder() REQUIRES(buffer_queue_mutex_);
 
-  std::optional<std::thread> encoder_thread_;
-
+  // The encoder runs in MediaCodec's async mode, and these are called on looper_ as its output
+  // buffers come out, rather than from a thread polling for them.
+  void onCodecCallback(const android::sp<android::MediaCodec>& codec,
+                       const android::sp<android::AMessage>& msg) EXCLUDES(buffer_queue_mutex_);
+  bool onOutputAvailable(const android::sp<android::MediaCodec>& codec,
+                         const android::sp<android::AMessage>& msg) EXCLUDES(buffer_queue_mutex_);
+
+  // The encoder died on its own, there's nothing left for readers to wait for.
+  void onEncoderFailed();
+
+  // Rate control: cut the bitrate when readers fall behind, creep back up once they've kept up for
+  // a while, and change resolution when bitrate alone isn't enough.
+  virtual void onControlTick() final EXCLUDES(buffer_queue_mutex_);
+  virtual void onIdleChanged(bool idle) final EXCLUDES(buffer_queue_mutex_);
+  void setBitrate(int32_t bitrate) REQUIRES(buffer_queue_mutex_);
+  bool resize(size_t scale_index) REQUIRES(buffer_queue_mutex_);
+
+  static constexpr std::chrono::microseconds kKeepaliveInterval{1'000'000};
+
+  static constexpr std::chrono::seconds kRateControlInterval{1};
+  static constexpr int kStableIntervalsBeforeIncrease = 3;
+  static constexpr double kScales[] = {1.0, 0.75, 0.5};
+
+  std::chrono::steady_clock::time_point last_rate_control_;
+  int stable_intervals_ = 0;
+  int32_t bitrate_ GUARDED_BY(buffer_queue_mutex_) = config_.bitrate;
+  bool suspended_ GUARDED_BY(buffer_queue_mutex_) = false;
+  size_t scale_index_ GUARDED_BY(buffer_queue_mutex_) = 0;
+  uint32_t base_width_ = 0;
+  uint32_t base_height_ = 0;
+
+  std::atomic<bool> encoder_running_ = false;
+
+  // MediaCodec waits on its own looper for replies to calls like releaseOutputBuffer, so callbacks
+  // that make those calls have to come in on a different one.
   android::sp<android::ALooper> looper_;
+  android::sp<android::ALooper> codec_looper_;
   android::sp<android::MediaCodec> codec_ GUARDED_BY(buffer_queue_mutex_);
   android::sp<android::IGraphicBufferProducer> codec_producer_ GUARDED_BY(buffer_queue_mutex_);
 
+  struct CodecCallbacks : public android::AHandler {
+    CodecCallbacks(MediaCodecSocket& parent, android::sp<android::MediaCodec> codec)
+        : parent_(parent), codec_(std::move(codec)) {}
+
+    virtual void onMessageReceived(const android::sp<android::AMessage>& msg) final;
+
+   private:
+    MediaCodecSocket& parent_;
+    const android::sp<android::MediaCodec> codec_;
+  };
+  android::sp<CodecCallbacks> codec_callbacks_ GUARDED_BY(buffer_queue_mutex_);
+
   struct CodecBufferProducerCallbacks : public android::BnProducerListener {
     explicit CodecBufferProducerCallbacks(MediaCodecSocket& parent) : parent_(parent) {}
 
@@ -187,31 +510,235 @@ struct MediaCodecSocket : public VideoSocket {
     virtual void onBuffersDiscarded(const std::vector<int32_t>& slots) final;
 
    private:
-    [[maybe_unused]] MediaCodecSocket& parent_;
+    MediaCodecSocket& parent_;
   };
 };
 
 struct H264Socket : public MediaCodecSocket {
-  H264Socket() = default;
+  explicit H264Socket(VideoConfig config) : MediaCodecSocket(std::move(config)) {}
+
+ protected:
+  virtual const char* getCodecMimeType() final;
+  virtual android::sp<android::AMessage> getCodecFormat() final REQUIRES(buffer_queue_mutex_);
+};
+
+// One of a SimulcastSocket's smaller layers. It has an encoder of its own, but no virtual display:
+// the SimulcastSocket draws each captured frame into the encoder's input surface, scaled down.
+struct SimulcastLayerSocket : public H264Socket {
+  explicit SimulcastLayerSocket(VideoConfig config) : H264Socket(std::move(config)) {}
+  ~SimulcastLayerSocket() {
+    std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+    MediaCodecSocket::DestroyLocked();
+  }
+
+  // Start encoding whatever is drawn into InputSurface, at the config's size.
+  bool Start() EXCLUDES(buffer_queue_mutex_);
+  android::sp<android::IGraphicBufferProducer> InputSurface() EXCLUDES(buffer_queue_mutex_);
+
+ protected:
+  virtual bool connectsInputSurface() final { return false; }
+
+  // Readers that want a smaller picture move to a smaller layer instead.
+  virtual bool canResize() final { return false; }
+};
+
+struct GLScaler;
+
+// H.264 at several sizes from a single virtual display, for VideoConfig::simulcast. Layer 0
+// encodes the display's buffers directly, like H264Socket does, and every smaller layer gets a copy
+// scaled down on the GPU. Each layer does its own rate control.
+struct SimulcastSocket : public H264Socket {
+  explicit SimulcastSocket(VideoConfig config);
+  ~SimulcastSocket();
+
+  // Layer n is 1/2^n of the size of layer 0, in each dimension.
+  static constexpr size_t kLayerCount = 3;
+
+  virtual VideoSocket* Layer(size_t index) final;
+
+  virtual void DestroyLocked() override REQUIRES(buffer_queue_mutex_);
+
+ protected:
+  // The GPU samples the display's buffers as textures.
+  virtual uint64_t getGrallocUsageBits() final {
+    return MediaCodecSocket::getGrallocUsageBits() | GRALLOC_USAGE_HW_TEXTURE;
+  }
+
+  virtual bool createEncoder() final REQUIRES(buffer_queue_mutex_);
+  virtual android::sp<android::Fence> shareFrame(const android::BufferItem& item) final
+      REQUIRES(buffer_queue_mutex_);
+  virtual bool canResize() final { return false; }
+
+  // Layers after the first, largest first. Set up before the pipeline is handed out, and kept
+  // until it's destroyed, so readers can look them up without a lock.
+  std::vector<std::shared_ptr<SimulcastLayerSocket>> layers_;
+
+  std::unique_ptr<GLScaler> scaler_ GUARDED_BY(buffer_queue_mutex_);
+};
+
+struct HEVCSocket : public MediaCodecSocket {
+  explicit HEVCSocket(VideoConfig config) : MediaCodecSocket(std::move(config)) {}
 
  protected:
   virtual const char* getCodecMimeType() final;
-  virtual android::sp<android::AMessage> getCodecFormat() final;
+  virtual android::sp<android::AMessage> getCodecFormat() final REQUIRES(buffer_queue_mutex_);
 };
 
+struct VP9Socket : public MediaCodecSocket {
+  explicit VP9Socket(VideoConfig config) : MediaCodecSocket(std::move(config)) {}
+
+ protected:
+  virtual const char* getCodecMimeType() final;
+  virtual android::sp<android::AMessage> getCodecFormat() final REQUIRES(buffer_queue_mutex_);
+};
+
+struct AV1Socket : public MediaCodecSocket {
+  explicit AV1Socket(VideoConfig config) : MediaCodecSocket(std::move(config)) {}
+
+ protected:
+  virtual const char* getCodecMimeType() final;
+  virtual android::sp<android::AMessage> getCodecFormat() final REQUIRES(buffer_queue_mutex_);
+};
+
+// JPEG through a hardware image encoder, fed from the display like any other MediaCodec encoder, so
+// that frames never have to be read back by the CPU. Produces the same stream as JPEGSocket without
+// tiles, which is what VideoSocket::Create falls back to if there's no such encoder.
+struct HardwareJPEGSocket : public MediaCodecSocket {
+  explicit HardwareJPEGSocket(VideoConfig config) : MediaCodecSocket(std::move(config)) {}
+
+  static constexpr const char* kMimeType = "image/jpeg";
+
+ protected:
+  virtual const char* getCodecMimeType() final;
+  virtual android::sp<android::AMessage> getCodecFormat() final REQUIRES(buffer_queue_mutex_);
+  virtual bool isIntraOnly() final { return true; }
+  virtual bool controlsBitrate() final { return false; }
+};
+
+// With VideoConfig::tiles, each JPEG frame's payload is a list of patches: a header followed by a
+// JPEG of that region of the screen. Keyframes are a single patch that covers the whole frame.
+// Fields are little-endian.
+struct __attribute__((packed)) PatchHeader {
+  uint16_t frame_width;
+  uint16_t frame_height;
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint32_t size;
+};
+static_assert(sizeof(PatchHeader) == 16);
+
 struct JPEGSocket : public VideoSocket {
-  JPEGSocket() = default;
+  explicit JPEGSocket(VideoConfig config) : VideoSocket(std::move(config)) {}
+  ~JPEGSocket() {
+    std::lock_guard<std::mutex> lock(buffer_queue_mutex_);
+    JPEGSocket::DestroyLocked();
+  }
+
+  virtual void DestroyLocked() override REQUIRES(buffer_queue_mutex_) {
+    stopEncoder();
+    VideoSocket::DestroyLocked();
+  }
+
+  static constexpr size_t kDefaultWorkerCount = 3;
+  static constexpr uint32_t kDefaultQuality = 90;
+  static constexpr uint32_t kTileSize = 64;
 
  protected:
+  // Change detection works on a hash of each kTileSize x kTileSize tile of a frame.
+  struct TileHashes {
+    uint32_t width;
+    uint32_t height;
+    std::vector<uint64_t> hashes;
+  };
+  using TileHashesFuture = std::shared_future<std::shared_ptr<const TileHashes>>;
+
+  // A captured buffer waiting to be compressed.
+  struct CompressJob {
+    android::BufferItem item;
+    android::sp<android::GraphicBuffer> buffer;
+
+    // Filled in when a worker picks the job up. Frames are compressed in parallel, so each one is
+    // compared against the hashes of the one dispatched before it, which might not be ready yet.
+    bool keyframe = false;
+    TileHashesFuture previous_hashes;
+    std::promise<std::shared_ptr<const TileHashes>> hashes;
+  };
+
+  // A compressed frame waiting for the frames before it to finish.
+  struct CompletedJob {
+    bool done = false;
+    android::sp<Frame> frame;
+  };
+
   virtual void onFrameReceived() final;
+  virtual void onControlTick() final EXCLUDES(buffer_queue_mutex_);
+  void submitJob(CompressJob job) EXCLUDES(jpeg_mutex_);
 
   virtual uint64_t getGrallocUsageBits() final {
     return GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_VIDEO_ENCODER;
   }
 
-  virtual bool createEncoder() final { return true; }
-  virtual bool startEncoder() final {
-    running_ = true;
-    return true;
+  virtual bool createEncoder() final REQUIRES(buffer_queue_mutex_);
+  virtual bool startEncoder() final REQUIRES(buffer_queue_mutex_);
+  virtual std::optional<int> getMaxAcquiredBufferCount() final REQUIRES(buffer_queue_mutex_) {
+    return static_cast<int>(max_held_buffers_);
   }
+  size_t worker_count_ GUARDED_BY(buffer_queue_mutex_) = 0;
+  void stopEncoder() REQUIRES(buffer_queue_mutex_);
+
+  // The next frame handed to a worker is compressed in full.
+  virtual void requestSyncFrame() final { keyframe_requested_ = true; }
+
+  // While idle, the newest frame is held back until a reader is taking frames again.
+  virtual void onIdleChanged(bool idle) final EXCLUDES(buffer_queue_mutex_);
+  bool paused_ GUARDED_BY(buffer_queue_mutex_) = false;
+
+  void workerLoop() EXCLUDES(jpeg_mutex_);
+
+  // Returns nullptr if nothing changed since the previous frame.
+  android::sp<Frame> compress(CompressJob& job);
+  void appendJpeg(Frame* frame, const uint8_t* pixels, size_t stride, uint32_t frame_width,
+                  uint32_t frame_height, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+  void releaseBuffer(const android::BufferItem& item) EXCLUDES(buffer_queue_mutex_);
+  void releaseBufferLocked(const android::BufferItem& item) REQUIRES(buffer_queue_mutex_);
+
+  // Captured frames that arrive sooner than this after the previous one are skipped.
+  std::chrono::steady_clock::time_point last_capture_time_ GUARDED_BY(buffer_queue_mutex_);
+  std::optional<CompressJob> throttled_job_ GUARDED_BY(buffer_queue_mutex_);
+
+  // Makes |job| the one held back, releasing whichever was held back before it.
+  void holdBack(CompressJob job) REQUIRES(buffer_queue_mutex_);
+
+  // Buffers acquired from the virtual display and not yet released, reported in /stats/ so that
+  // leaks show up before the BufferQueue runs out of slots.
+  virtual void describeStats(Json::Value* entry) final EXCLUDES(buffer_queue_mutex_);
+  size_t held_buffers_ GUARDED_BY(buffer_queue_mutex_) = 0;
+  size_t max_held_buffers_ GUARDED_BY(buffer_queue_mutex_) = 0;
+
+  // Running estimate of the compressed frame size, used to size output buffers up front.
+  std::atomic<size_t> expected_frame_size_ = 0;
+
+  // Buffers stay attached to the virtual display's BufferQueue, so we need to track which slot
+  // holds which buffer.
+  android::sp<android::GraphicBuffer> slot_buffers_[android::BufferQueueDefs::NUM_BUFFER_SLOTS]
+      GUARDED_BY(buffer_queue_mutex_);
+
+  // Compression happens on a pool of workers. Only the newest captured frame waits for a worker;
+  // anything older that's still waiting when a new frame arrives is skipped.
+  std::vector<std::thread> workers_;
+  std::mutex jpeg_mutex_;
+  std::condition_variable jpeg_cv_;
+  bool workers_running_ GUARDED_BY(jpeg_mutex_) = false;
+  std::optional<CompressJob> pending_job_ GUARDED_BY(jpeg_mutex_);
+  uint64_t skipped_jobs_ GUARDED_BY(jpeg_mutex_) = 0;
+
+  // Frames finish compressing out of order, and are queued in the order they were captured.
+  std::vector<CompletedJob> completed_jobs_ GUARDED_BY(jpeg_mutex_);
+  uint64_t next_job_sequence_ GUARDED_BY(jpeg_mutex_) = 0;
+  uint64_t next_output_sequence_ GUARDED_BY(jpeg_mutex_) = 0;
+
+  TileHashesFuture last_hashes_ GUARDED_BY(jpeg_mutex_);
+  std::atomic<bool> keyframe_requested_ = true;
 };
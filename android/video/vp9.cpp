@@ -0,0 +1,19 @@
+#include <media/stagefright/MediaCodecConstants.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <utils/StrongPointer.h>
+
+#include "wardenclyffe/android/video/video.h"
+
+using namespace android;
+
+const char* VP9Socket::getCodecMimeType() {
+  return "video/x-vnd.on2.vp9";
+}
+
+sp<AMessage> VP9Socket::getCodecFormat() {
+  // Keep in sync with the WebCodecs codec string in video.cpp.
+  sp<AMessage> format = getBaseCodecFormat();
+  format->setInt32(KEY_PROFILE, VP9Profile0);
+  format->setInt32(KEY_LEVEL, VP9Level41);
+  return format;
+}
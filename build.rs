@@ -1,7 +1,53 @@
 extern crate cbindgen;
 
+use std::fs;
+use std::io::Write;
+use std::path::Path;
+
+use flate2::write::GzEncoder;
+use flate2::Compression;
+
+/// Copy `src` to `dst`, along with a gzipped copy of every file that gets smaller, for the server to
+/// embed.
+fn compress_html(src: &Path, dst: &Path) {
+  fs::create_dir_all(dst).unwrap();
+  for entry in fs::read_dir(src).unwrap() {
+    let entry = entry.unwrap();
+    let src_path = entry.path();
+    let dst_path = dst.join(entry.file_name());
+    if entry.file_type().unwrap().is_dir() {
+      compress_html(&src_path, &dst_path);
+      continue;
+    }
+
+    let contents = fs::read(&src_path).unwrap();
+    fs::write(&dst_path, &contents).unwrap();
+
+    let mut encoder = GzEncoder::new(Vec::new(), Compression::best());
+    encoder.write_all(&contents).unwrap();
+    let compressed = encoder.finish().unwrap();
+
+    let mut gz_path = dst_path.into_os_string();
+    gz_path.push(".gz");
+    if compressed.len() < contents.len() {
+      fs::write(&gz_path, compressed).unwrap();
+    } else {
+      let _ = fs::remove_file(&gz_path);
+    }
+  }
+}
+
 fn main() {
   let crate_dir = std::env::var("CARGO_MANIFEST_DIR").unwrap();
+  let out_dir = std::env::var("OUT_DIR").unwrap();
+
+  println!("cargo:rerun-if-changed=build.rs");
+  println!("cargo:rerun-if-changed=cbindgen.toml");
+  println!("cargo:rerun-if-changed=src");
+  println!("cargo:rerun-if-changed=html");
+
+  compress_html(&Path::new(&crate_dir).join("html"), &Path::new(&out_dir).join("html"));
+
   let config = cbindgen::Config::from_root_or_default(&crate_dir);
   match cbindgen::Builder::new()
     .with_config(config)
@@ -1,3 +1,5 @@
+import {JitterBuffer, StageTimes} from "/playback/playback.js";
+
 class WebGLRenderer {
   #canvas = null;
   #ctx = null;
@@ -110,57 +112,130 @@ function postStatus() {
 let decoder = null;
 let renderer = null;
 
-let pendingFrames = [];
-
 let startTime = null;
 let decodeQueueDepth = 0;
 let decodeFrameCount = 0;
 let renderFrameCount = 0;
 
-let renderingStarted = false;
-const maxRenderQueueDepth = 4;
+let decoderConfig = null;
 
-// TODO: Keep track of frame timestamps and use them to properly delay requestAnimationFrame.
-//       Right now, our frame timing sucks because if we fall behind by a frame, we can end up
-//       rendering pairs of frames at the display refresh rate potentially forever.
-function enqueueFrame(frame) {
-  while (pendingFrames.length >= maxRenderQueueDepth) {
-    const dropped = pendingFrames.shift();
-    dropped.close();
-  }
-  pendingFrames.push(frame);
-  if (!renderingStarted) {
-    requestAnimationFrame(renderFrame);
-    renderingStarted = true;
-  }
-}
+// Decoded frames wait here until it's their turn, going by the server's timestamps. If several
+// come due within one animation frame, only the newest is drawn.
+const jitterBuffer = new JitterBuffer({onDrop: (frame) => frame.close()});
+
+// When each frame went into the decoder, keyed by timestamp, and how long each stage took since
+// the last feedback. These go back to the server, which keeps track of every other stage of the
+// pipeline.
+let decodeStartTimes = new Map();
+let stageTimes = new StageTimes();
+
+function renderFrame(now) {
+  const due = jitterBuffer.takeDue(now);
+  if (due.length != 0) {
+    for (const {item} of due.slice(0, -1)) {
+      ++jitterBuffer.dropped;
+      item.close();
+    }
 
-function renderFrame() {
-  if (pendingFrames.length != 0) {
     ++renderFrameCount;
-    const pendingFrame = pendingFrames.shift();
-    renderer.draw(pendingFrame);
-    requestAnimationFrame(renderFrame);
-  } else {
-    renderingStarted = false;
+    const {item: frame, waited} = due[due.length - 1];
+    stageTimes.record("buffer", waited);
+    const renderStartTime = performance.now();
+    renderer.draw(frame);
+    stageTimes.record("render", performance.now() - renderStartTime);
   }
+  requestAnimationFrame(renderFrame);
 }
 
-function receiveFrame(frame) {
-  const chunk = new EncodedVideoChunk(frame.data);
+// The codec config (e.g. SPS/PPS for H.264) arrives as its own frame, and needs to be fed to the
+// decoder in front of the keyframe that follows it. Codecs without out-of-band config never send
+// one.
+let codecConfig = null;
+
+// After a decode error, everything up to the next keyframe is undecodable.
+let waitingForKeyframe = true;
+
+function requestKeyframe() {
+  waitingForKeyframe = true;
+  self.postMessage({requestKeyframe: true});
+}
+
+// Every frame starts with a 16 byte little-endian header:
+//   u8 version, u8 type, u16 flags, u32 sequence, i64 timestamp (microseconds)
+const frameHeaderSize = 16;
+const frameTypes = ["config", "key", "delta"];
+const frameFlagNewConfig = 1 << 0;
+
+function parseFrame(buf) {
+  const header = new DataView(buf, 0, frameHeaderSize);
+  return {
+    type: frameTypes[header.getUint8(1)],
+    flags: header.getUint16(2, true),
+    timestamp: Number(header.getBigInt64(8, true)),
+    data: new Uint8Array(buf, frameHeaderSize),
+  };
+}
+
+function receiveFrame(message) {
+  const frame = parseFrame(message.data);
+  if (frame.type == "config") {
+    // The server changes resolution by restarting its encoder, which sends a new config.
+    if (frame.flags & frameFlagNewConfig) {
+      decoder.reset();
+      decoder.configure(decoderConfig);
+      decodeQueueDepth = 0;
+      decodeStartTimes.clear();
+    }
+    codecConfig = frame.data;
+    return;
+  }
+
+  if (waitingForKeyframe || decoder.state != "configured") {
+    if (frame.type != "key" || decoder.state != "configured") {
+      return;
+    }
+    waitingForKeyframe = false;
+  }
+
+  if (frame.type == "key" && codecConfig !== null) {
+    const data = new Uint8Array(codecConfig.byteLength + frame.data.byteLength);
+    data.set(codecConfig, 0);
+    data.set(frame.data, codecConfig.byteLength);
+    frame.data = data;
+  }
+
+  const chunk = new EncodedVideoChunk(frame);
+  decodeStartTimes.set(frame.timestamp, performance.now());
   decoder.decode(chunk);
   ++decodeQueueDepth;
 }
 
-function start({host, canvas}) {
-  renderer = new WebGLRenderer(canvas);
+function start({canvas, codec}) {
+  if (canvas !== null) {
+    decoderConfig = {
+      codec,
+      optimizeForLatency: true,
+    };
+    renderer = new WebGLRenderer(canvas);
+    self.addEventListener("message", receiveFrame);
+    requestAnimationFrame(renderFrame);
+  }
+
+  decodeQueueDepth = 0;
+  decodeStartTimes.clear();
   decoder = new VideoDecoder({
     output(frame) {
       ++decodeFrameCount;
       --decodeQueueDepth;
 
-      // Update statistics once a second.
       const now = performance.now();
+      const decodeStartTime = decodeStartTimes.get(frame.timestamp);
+      if (decodeStartTime !== undefined) {
+        decodeStartTimes.delete(frame.timestamp);
+        stageTimes.record("decode", now - decodeStartTime);
+      }
+
+      // Update statistics once a second.
       if (startTime == null) {
         startTime = now;
       } else {
@@ -175,27 +250,36 @@ function start({host, canvas}) {
 
           setStatus("render", `${renderFps.toFixed(0)} fps`);
           setStatus("decode", `${decodeFps.toFixed(0)} fps`);
-          setStatus("renderqueue", `${pendingFrames.length} frame(s)`);
+          setStatus("renderqueue", `${jitterBuffer.length} frame(s)`);
           setStatus("decodequeue", `${decodeQueueDepth} frame(s)`);
+          setStatus("buffer", `${jitterBuffer.targetDelay.toFixed(0)} ms`);
+          setStatus("dropped", `${jitterBuffer.late} late, ${jitterBuffer.dropped} dropped`);
           postStatus();
+
+          // Let the server know how we're keeping up, so it can adjust the bitrate.
+          self.postMessage({
+            feedback: {
+              decodeQueue: decodeQueueDepth,
+              jitter: Math.round(jitterBuffer.jitter),
+              ...stageTimes.take(),
+            },
+          });
         }
       }
 
       // Schedule the frame to be rendered.
-      enqueueFrame(frame);
+      jitterBuffer.push(frame, frame.timestamp, now);
     },
     error(e) {
       console.log("error", e);
       setStatus("decode", e);
+
+      // A decoder that hits an error is closed, so start over with a new one.
+      start({canvas: null});
+      requestKeyframe();
     }
   });
-  const config = {
-    codec: "avc1.4d0029",
-    optimizeForLatency: true,
-  };
-  decoder.configure(config);
-
-  self.addEventListener("message", receiveFrame);
+  decoder.configure(decoderConfig);
 }
 
 self.addEventListener("message", message => start(message.data), {once: true});
@@ -1,6 +1,10 @@
+import {JitterBuffer, StageTimes} from "/playback/playback.js";
+
 class WebGLRenderer {
   #canvas = null;
   #ctx = null;
+  #width = 0;
+  #height = 0;
 
   static vertexShaderSource = `
     attribute vec2 xy;
@@ -71,15 +75,26 @@ class WebGLRenderer {
     gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_T, gl.CLAMP_TO_EDGE);
   }
 
-  draw(frame) {
-    this.#canvas.width = frame.displayWidth;
-    this.#canvas.height = frame.displayHeight;
-
+  // Apply a decoded update to the texture, without drawing it.
+  update({width, height, patches}) {
     const gl = this.#ctx;
 
-    // Upload the frame.
-    gl.texImage2D(gl.TEXTURE_2D, 0, gl.RGBA, gl.RGBA, gl.UNSIGNED_BYTE, frame);
-    frame.close();
+    // Reallocate the texture when the frame size changes. The patches of such a frame cover all of
+    // it, so there's no need to clear it.
+    if (width != this.#width || height != this.#height) {
+      this.#width = this.#canvas.width = width;
+      this.#height = this.#canvas.height = height;
+      gl.texImage2D(gl.TEXTURE_2D, 0, gl.RGBA, width, height, 0, gl.RGBA, gl.UNSIGNED_BYTE, null);
+    }
+
+    for (const patch of patches) {
+      gl.texSubImage2D(gl.TEXTURE_2D, 0, patch.x, patch.y, gl.RGBA, gl.UNSIGNED_BYTE, patch.image);
+      patch.image.close();
+    }
+  }
+
+  draw() {
+    const gl = this.#ctx;
 
     // Configure and clear the drawing area.
     gl.viewport(0, 0, gl.drawingBufferWidth, gl.drawingBufferHeight);
@@ -102,29 +117,57 @@ function postStatus() {
 }
 
 // Rendering. Drawing is limited to once per animation frame.
-let decoder = null;
 let renderer = null;
+let tiles = false;
 
-let pendingFrames = [];
+// Decoded updates wait here until it's their turn, going by the server's timestamps. Patches only
+// make sense on top of everything before them, so every update is applied, even if several come
+// due within one animation frame or get pushed out of the buffer.
+let jitterBuffer = null;
+
+// Frames are decoded as soon as they arrive, several at a time, but are applied in the order they
+// were received. When too many are in flight, frames are dropped up to the next keyframe, which
+// covers the whole screen.
+const maxDecodeQueueDepth = 4;
+let decodeQueueDepth = 0;
+let decodeChain = Promise.resolve();
+let waitingForKeyframe = false;
 
 let startTime = null;
 let decodeFrameCount = 0;
 let renderFrameCount = 0;
 
-function enqueueFrame(frame) {
-  pendingFrames.push(frame);
+// How long each stage took for every frame since the last feedback. These go back to the server,
+// which keeps track of every other stage of the pipeline.
+let stageTimes = new StageTimes();
+
+function discardUpdate(update) {
+  for (const patch of update.patches) {
+    patch.image.close();
+  }
 }
 
-function renderFrame() {
-  if (pendingFrames.length != 0) {
+function renderFrame(now) {
+  const due = jitterBuffer.takeDue(now);
+  if (due.length != 0) {
     ++renderFrameCount;
-    const pendingFrame = pendingFrames.shift();
-    renderer.draw(pendingFrame);
+    for (const {item, waited} of due) {
+      stageTimes.record("buffer", waited);
+      const updateStartTime = performance.now();
+      renderer.update(item);
+      stageTimes.record("render", performance.now() - updateStartTime);
+    }
+    renderer.draw();
   }
 
   requestAnimationFrame(renderFrame);
 }
 
+function requestKeyframe() {
+  waitingForKeyframe = true;
+  self.postMessage({requestKeyframe: true});
+}
+
 function updateStats() {
   // Update statistics once a second.
   const now = performance.now();
@@ -142,37 +185,116 @@ function updateStats() {
 
       setStatus("render", `${renderFps.toFixed(0)} fps`);
       setStatus("decode", `${decodeFps.toFixed(0)} fps`);
-      setStatus("renderqueue", `${pendingFrames.length} frame(s)`);
+      setStatus("decodequeue", `${decodeQueueDepth} frame(s)`);
+      setStatus("renderqueue", `${jitterBuffer.length} frame(s)`);
+      setStatus("buffer", `${jitterBuffer.targetDelay.toFixed(0)} ms`);
       postStatus();
+
+      self.postMessage({
+        feedback: {
+          decodeQueue: decodeQueueDepth,
+          jitter: Math.round(jitterBuffer.jitter),
+          ...stageTimes.take(),
+        },
+      });
     }
   }
 }
 
-async function receiveFrame(frame) {
-  const decoder = new ImageDecoder({
-    type: "image/jpeg",
-    data: frame.data.data,
-  });
+// createImageBitmap decodes off of the worker's thread, without the setup that a new ImageDecoder
+// costs for every image.
+function decodeJpeg(data) {
+  return createImageBitmap(new Blob([data], {type: "image/jpeg"}));
+}
+
+// In tiles mode, frames are a sequence of patches, each a 16 byte header followed by a JPEG:
+//   u16 frame_width, frame_height, x, y, width, height
+//   u32 size
+const patchHeaderSize = 16;
 
-  // TODO: Support progressive decoding
-  const decoded = await decoder.decode();
-  ++decodeFrameCount;
-  updateStats();
+function parsePatches(data) {
+  const view = new DataView(data.buffer, data.byteOffset, data.byteLength);
+  const patches = [];
+  let width = 0;
+  let height = 0;
+  for (let offset = 0; offset + patchHeaderSize <= data.byteLength;) {
+    width = view.getUint16(offset, true);
+    height = view.getUint16(offset + 2, true);
+    const x = view.getUint16(offset + 4, true);
+    const y = view.getUint16(offset + 6, true);
+    const size = view.getUint32(offset + 12, true);
+    offset += patchHeaderSize;
+    patches.push({x, y, data: data.subarray(offset, offset + size)});
+    offset += size;
+  }
+  return {width, height, patches};
+}
 
-  // Schedule the frame to be rendered.
-  enqueueFrame(decoded.image);
+async function decodeFrame(frame) {
+  const decodeStartTime = performance.now();
+  let update;
+  if (tiles) {
+    update = parsePatches(frame.data);
+    await Promise.all(update.patches.map(async (patch) => {
+      patch.image = await decodeJpeg(patch.data);
+      delete patch.data;
+    }));
+  } else {
+    const image = await decodeJpeg(frame.data);
+    update = {
+      width: image.width,
+      height: image.height,
+      patches: [{x: 0, y: 0, image}],
+    };
+  }
+  stageTimes.record("decode", performance.now() - decodeStartTime);
+  return update;
 }
 
-function start({host, canvas}) {
-  renderer = new WebGLRenderer(canvas);
-  decoder = new VideoDecoder({
-    output(frame) {
-    },
-    error(e) {
+function receiveFrame({data: frame}) {
+  // Every JPEG stands on its own. A hardware encoder might still hand out a codec config ahead of
+  // its first frame, which has nothing to show.
+  if (frame.type == "config") {
+    return;
+  }
+
+  if (waitingForKeyframe || decodeQueueDepth >= maxDecodeQueueDepth) {
+    if (frame.type != "key" || decodeQueueDepth >= maxDecodeQueueDepth) {
+      if (!waitingForKeyframe) {
+        requestKeyframe();
+      }
+      return;
+    }
+    waitingForKeyframe = false;
+  }
+
+  // Start decoding now, but wait for the frames before this one before applying it.
+  const decoded = decodeFrame(frame);
+  ++decodeQueueDepth;
+  decodeChain = decodeChain.then(async () => {
+    try {
+      const update = await decoded;
+      ++decodeFrameCount;
+      jitterBuffer.push(update, frame.timestamp);
+    } catch (e) {
       console.log("error", e);
       setStatus("decode", e);
+      requestKeyframe();
+    } finally {
+      --decodeQueueDepth;
+      updateStats();
     }
   });
+}
+
+function start(message) {
+  renderer = new WebGLRenderer(message.canvas);
+  tiles = message.tiles;
+
+  // A patch that's pushed out of the buffer still has to land, so that later ones apply on top.
+  jitterBuffer = new JitterBuffer({
+    onDrop: tiles ? (update) => renderer.update(update) : discardUpdate,
+  });
 
   self.addEventListener("message", receiveFrame);
   requestAnimationFrame(renderFrame);
@@ -0,0 +1,124 @@
+// Playback shared by the video workers: a jitter buffer that paces frames by the timestamps the
+// server sends, and the per-stage timings that go back to the server as feedback.
+//
+//   const buffer = new JitterBuffer({onDrop: (frame) => frame.close()});
+//   buffer.push(frame, timestamp);
+//   ...
+//   for (const {item, waited} of buffer.takeDue(now)) ...
+
+// Frames are shown at their server timestamp plus an offset, picked so that nearly every frame has
+// arrived and been decoded by then. The offset is the shortest transit time seen recently, which
+// takes care of the two clocks being unrelated, plus a target delay that covers how much later
+// than that frames tend to show up.
+//
+// The target delay goes up as soon as frames start arriving later, and comes back down slowly, so
+// that a burst of jitter doesn't leave playback stuttering while it settles.
+export class JitterBuffer {
+  // Transit times are looked at over this many milliseconds.
+  static window = 2000;
+
+  // Frames later than this fraction of recent ones are allowed to miss their slot.
+  static percentile = 0.95;
+
+  // How much of the gap to a lower target is closed with each frame.
+  static release = 0.02;
+
+  #minDelay;
+  #maxDelay;
+  #capacity;
+  #onDrop;
+
+  // {arrival, transit} for every frame in the window, in arrival order.
+  #samples = [];
+  #baseTransit = 0;
+  #targetDelay = 0;
+
+  // {item, due, arrival} for every frame waiting to be shown, in order.
+  #frames = [];
+
+  // Recent jitter in milliseconds, and how many frames arrived after their slot or were pushed out.
+  jitter = 0;
+  late = 0;
+  dropped = 0;
+
+  // Delays are in milliseconds. Frames beyond |capacity| are handed to |onDrop|, oldest first.
+  constructor({minDelay = 0, maxDelay = 100, capacity = 8, onDrop = () => {}} = {}) {
+    this.#minDelay = minDelay;
+    this.#maxDelay = maxDelay;
+    this.#capacity = capacity;
+    this.#onDrop = onDrop;
+    this.#targetDelay = minDelay;
+  }
+
+  get length() {
+    return this.#frames.length;
+  }
+
+  get targetDelay() {
+    return this.#targetDelay;
+  }
+
+  // Add a frame with the server's |timestamp|, in microseconds, that became ready at |arrival|.
+  push(item, timestamp, arrival = performance.now()) {
+    const transit = arrival - timestamp / 1000;
+    this.#samples.push({arrival, transit});
+    while (this.#samples[0].arrival < arrival - JitterBuffer.window) {
+      this.#samples.shift();
+    }
+
+    const transits = this.#samples.map((sample) => sample.transit).sort((a, b) => a - b);
+    this.#baseTransit = transits[0];
+    const index = Math.floor((transits.length - 1) * JitterBuffer.percentile);
+    this.jitter = transits[index] - this.#baseTransit;
+
+    const wanted = Math.min(Math.max(this.jitter, this.#minDelay), this.#maxDelay);
+    if (wanted > this.#targetDelay) {
+      this.#targetDelay = wanted;
+    } else {
+      this.#targetDelay += (wanted - this.#targetDelay) * JitterBuffer.release;
+    }
+
+    const due = timestamp / 1000 + this.#baseTransit + this.#targetDelay;
+    if (due < arrival) {
+      ++this.late;
+    }
+    this.#frames.push({item, due, arrival});
+    while (this.#frames.length > this.#capacity) {
+      ++this.dropped;
+      this.#onDrop(this.#frames.shift().item);
+    }
+  }
+
+  // Take every frame that's due by |now|, oldest first, along with how long each one waited.
+  takeDue(now = performance.now()) {
+    let count = 0;
+    while (count < this.#frames.length && this.#frames[count].due <= now) {
+      ++count;
+    }
+    return this.#frames.splice(0, count).map(({item, arrival}) => ({item, waited: now - arrival}));
+  }
+}
+
+// How long each frame spent in each of the client's stages, collected between feedback messages:
+//   decode: from handing it to the decoder to getting it back
+//   buffer: waiting in the jitter buffer
+//   render: uploading and drawing it
+// The server adds these to its own latency stats, so they show up in /stats next to the rest of
+// the pipeline.
+export class StageTimes {
+  #times = {decode: [], buffer: [], render: []};
+
+  record(stage, milliseconds) {
+    this.#times[stage].push(Math.round(milliseconds * 1000));
+  }
+
+  // Feedback fields, in microseconds: {decodeTimes: [...], bufferTimes: [...], renderTimes: [...]}
+  take() {
+    const feedback = {};
+    for (const stage in this.#times) {
+      feedback[`${stage}Times`] = this.#times[stage];
+      this.#times[stage] = [];
+    }
+    return feedback;
+  }
+}
@@ -0,0 +1,134 @@
+// Client for /session/, which carries several sockets over one WebSocket. See src/session.rs for
+// the protocol.
+//
+//   const session = new Session(`wss://${location.host}/session/`);
+//   const video = session.open("/video/h264/?header=binary");
+//   video.addEventListener("message", (event) => ...);
+//   const input = session.open("/input/");
+//   input.send(buffer);
+
+const headerSize = 2;
+const flagText = 1 << 0;
+const flagContinued = 1 << 1;
+
+class Channel extends EventTarget {
+  #session;
+  #chunks = [];
+
+  constructor(session, id) {
+    super();
+    this.#session = session;
+    this.id = id;
+  }
+
+  // Send a binary message to the channel's socket.
+  send(data) {
+    const bytes = data instanceof ArrayBuffer ? new Uint8Array(data) : data;
+    const message = new Uint8Array(headerSize + bytes.byteLength);
+    message[0] = this.id;
+    message.set(bytes, headerSize);
+    this.#session.send(message.buffer);
+  }
+
+  close() {
+    this.#session.sendControl({type: "close", channel: this.id});
+  }
+
+  // Called by the session with each chunk for this channel.
+  receive(flags, chunk) {
+    this.#chunks.push(chunk);
+    if (flags & flagContinued) {
+      return;
+    }
+
+    // Reassemble, and hand it out the way a WebSocket would: text as a string, binary as an
+    // ArrayBuffer.
+    const size = this.#chunks.reduce((total, c) => total + c.byteLength, 0);
+    const data = new Uint8Array(size);
+    let offset = 0;
+    for (const c of this.#chunks) {
+      data.set(c, offset);
+      offset += c.byteLength;
+    }
+    this.#chunks = [];
+
+    const payload = (flags & flagText) ? new TextDecoder().decode(data) : data.buffer;
+    this.dispatchEvent(new MessageEvent("message", {data: payload}));
+  }
+}
+
+export class Session extends EventTarget {
+  #socket;
+  #channels = new Map();
+  #nextId = 0;
+  #pending = [];
+
+  constructor(url) {
+    super();
+    this.#socket = new WebSocket(url);
+    this.#socket.binaryType = "arraybuffer";
+    this.#socket.addEventListener("open", () => {
+      for (const message of this.#pending) {
+        this.#socket.send(message);
+      }
+      this.#pending = [];
+    });
+    this.#socket.addEventListener("message", (event) => this.#receive(event.data));
+    this.#socket.addEventListener("close", () => {
+      for (const channel of this.#channels.values()) {
+        channel.dispatchEvent(new Event("close"));
+      }
+      this.#channels.clear();
+      this.dispatchEvent(new Event("close"));
+    });
+  }
+
+  // Open a channel to |path|. Lower priorities are sent first; by default input comes before
+  // audio, which comes before everything else.
+  open(path, {priority} = {}) {
+    let id = this.#nextId;
+    while (this.#channels.has(id)) {
+      id = (id + 1) % 256;
+      if (id == this.#nextId) throw new Error("Too many channels");
+    }
+    this.#nextId = (id + 1) % 256;
+
+    const channel = new Channel(this, id);
+    this.#channels.set(id, channel);
+    this.sendControl({type: "open", channel: id, path, priority});
+    return channel;
+  }
+
+  send(message) {
+    if (this.#socket.readyState == WebSocket.CONNECTING) {
+      this.#pending.push(message);
+    } else if (this.#socket.readyState == WebSocket.OPEN) {
+      this.#socket.send(message);
+    }
+  }
+
+  sendControl(message) {
+    this.send(JSON.stringify(message));
+  }
+
+  #receive(data) {
+    if (typeof data == "string") {
+      const message = JSON.parse(data);
+      const channel = this.#channels.get(message.channel);
+      if (!channel) return;
+      if (message.type == "opened") {
+        channel.dispatchEvent(new Event("open"));
+      } else if (message.type == "closed") {
+        this.#channels.delete(message.channel);
+        channel.dispatchEvent(new CloseEvent("close", {reason: message.reason}));
+      }
+      return;
+    }
+
+    const bytes = new Uint8Array(data);
+    const channel = this.#channels.get(bytes[0]);
+    if (channel) {
+      channel.receive(bytes[1], bytes.subarray(headerSize));
+    }
+  }
+}
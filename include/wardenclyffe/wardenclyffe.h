@@ -10,12 +10,17 @@
 #include <new>
 
 
+using WardenclyffeFrame = const void*;
+
 using WardenclyffeSocket = void*;
 
 struct WardenclyffeRead {
   const void *data;
   size_t size;
   uint8_t oob;
+  /// If non-null, a reference to the buffer backing `data`, which must be released with
+  /// `wardenclyffe_release_frame`. Otherwise, `data` is only valid until the next read.
+  WardenclyffeFrame frame;
 };
 
 struct WardenclyffeReads {
@@ -28,10 +33,16 @@ extern "C" {
 
 extern WardenclyffeSocket wardenclyffe_create_socket(const char *path);
 
+extern void wardenclyffe_close_socket(WardenclyffeSocket socket);
+
 extern void wardenclyffe_destroy_socket(WardenclyffeSocket socket);
 
 extern WardenclyffeReads wardenclyffe_read(WardenclyffeSocket socket);
 
+extern void wardenclyffe_release_frame(WardenclyffeFrame frame);
+
+extern void wardenclyffe_reads_sent(WardenclyffeSocket socket);
+
 extern bool wardenclyffe_supports_read(WardenclyffeSocket socket);
 
 extern bool wardenclyffe_supports_write(WardenclyffeSocket socket);
@@ -0,0 +1,256 @@
+//! A headless WebSocket client for benchmarking the server.
+//!
+//! Reads frames from a running server and reports the same numbers as wardenclyffe_bench, which
+//! reads from the pipeline directly, so that the difference between the two is the cost of the
+//! transport. Connecting over ws:// to a server with TLS disabled, and then over wss://, separates
+//! out the cost of TLS.
+//!
+//! Latency is measured against the frame timestamps, which are CLOCK_MONOTONIC on the device, so it
+//! only means something when the client runs on the device too.
+
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use anyhow::{bail, Context, Result};
+use futures_util::StreamExt;
+use tokio::io::{AsyncRead, AsyncWrite};
+use tokio::net::TcpStream;
+use tokio_rustls::TlsConnector;
+use tokio_tungstenite::{client_async, WebSocketStream};
+use tungstenite::client::IntoClientRequest;
+use tungstenite::protocol::Message;
+
+/// Size of the binary frame header, see FrameHeader.
+const FRAME_HEADER_SIZE: usize = 16;
+
+/// FrameHeader::type of codec configs, which aren't frames.
+const FRAME_TYPE_DESCRIPTION: u8 = 0;
+
+/// The server's certificate is usually self-signed, and we're only here to measure it.
+struct AcceptAnyCertificate;
+
+impl rustls::client::ServerCertVerifier for AcceptAnyCertificate {
+  fn verify_server_cert(
+    &self,
+    _end_entity: &rustls::Certificate,
+    _intermediates: &[rustls::Certificate],
+    _server_name: &rustls::ServerName,
+    _scts: &mut dyn Iterator<Item = &[u8]>,
+    _ocsp_response: &[u8],
+    _now: std::time::SystemTime,
+  ) -> Result<rustls::client::ServerCertVerified, rustls::Error> {
+    Ok(rustls::client::ServerCertVerified::assertion())
+  }
+}
+
+/// CLOCK_MONOTONIC, in microseconds, like frame timestamps.
+fn monotonic_now_us() -> i64 {
+  let mut now = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+  unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut now) };
+  now.tv_sec as i64 * 1_000_000 + now.tv_nsec as i64 / 1000
+}
+
+/// CPU time used by this process, and its resident set size in kB.
+fn resource_usage() -> (Duration, u64) {
+  let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+  unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) };
+  let timeval = |t: libc::timeval| Duration::new(t.tv_sec as u64, t.tv_usec as u32 * 1000);
+  let cpu = timeval(usage.ru_utime) + timeval(usage.ru_stime);
+
+  // statm is in pages: size, resident, ...
+  let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u64;
+  let rss_kb = std::fs::read_to_string("/proc/self/statm")
+    .ok()
+    .and_then(|statm| statm.split_whitespace().nth(1)?.parse::<u64>().ok())
+    .map_or(0, |pages| pages * page_size / 1024);
+  (cpu, rss_kb)
+}
+
+/// Latencies in microseconds, bucketed like LatencyHistogram in android/stats.h: exact below
+/// SUB_BUCKETS, then each power of two split into SUB_BUCKETS, for percentiles within about 6% in
+/// a fixed amount of memory however long the run.
+struct Histogram {
+  buckets: [u64; Histogram::BUCKET_COUNT],
+}
+
+impl Histogram {
+  const SUB_BUCKET_BITS: u32 = 3;
+  const SUB_BUCKETS: u64 = 1 << Self::SUB_BUCKET_BITS;
+
+  /// Anything above 2^MAX_BITS microseconds (about 16 seconds) lands in the last bucket.
+  const MAX_BITS: u32 = 24;
+  const BUCKET_COUNT: usize = ((Self::MAX_BITS - Self::SUB_BUCKET_BITS + 1) as usize) << Self::SUB_BUCKET_BITS;
+
+  fn bucket_index(value: u64) -> usize {
+    let value = value.min((1 << Self::MAX_BITS) - 1);
+    if value < Self::SUB_BUCKETS {
+      return value as usize;
+    }
+
+    // The top SUB_BUCKET_BITS + 1 bits pick the bucket, and the rest are dropped.
+    let shift = 63 - value.leading_zeros() - Self::SUB_BUCKET_BITS;
+    let sub_bucket = (value >> shift) & (Self::SUB_BUCKETS - 1);
+    ((shift as u64 + 1) * Self::SUB_BUCKETS + sub_bucket) as usize
+  }
+
+  /// The middle of the range of values that land in bucket `index`.
+  fn bucket_value(index: usize) -> u64 {
+    let index = index as u64;
+    if index < Self::SUB_BUCKETS {
+      return index;
+    }
+    let shift = index / Self::SUB_BUCKETS - 1;
+    let lower = (Self::SUB_BUCKETS + index % Self::SUB_BUCKETS) << shift;
+    lower + ((1 << shift) >> 1)
+  }
+
+  fn record(&mut self, latency_us: i64) {
+    self.buckets[Self::bucket_index(latency_us.max(0) as u64)] += 1;
+  }
+
+  fn percentile_ms(&self, percent: u64) -> f64 {
+    let total: u64 = self.buckets.iter().sum();
+    if total == 0 {
+      return 0.0;
+    }
+    let rank = (total * percent).div_ceil(100).max(1);
+    let mut seen = 0;
+    for (index, count) in self.buckets.iter().enumerate() {
+      seen += count;
+      if seen >= rank {
+        return Self::bucket_value(index) as f64 / 1000.0;
+      }
+    }
+    0.0
+  }
+}
+
+impl Default for Histogram {
+  fn default() -> Self {
+    Self {
+      buckets: [0; Self::BUCKET_COUNT],
+    }
+  }
+}
+
+/// Frames received over some period of time.
+#[derive(Default)]
+struct Interval {
+  frames: u64,
+  bytes: u64,
+  latencies: Histogram,
+}
+
+impl Interval {
+  fn print(&self, label: &str, elapsed: Duration, cpu: Duration, rss_kb: u64) {
+    let seconds = elapsed.as_secs_f64();
+    println!(
+      "{label}: {:.1} fps, {:.0} kB/s, latency p50 {:.1}ms p99 {:.1}ms, cpu {:.0}%, rss {rss_kb} kB",
+      self.frames as f64 / seconds,
+      self.bytes as f64 / seconds / 1000.0,
+      self.latencies.percentile_ms(50),
+      self.latencies.percentile_ms(99),
+      100.0 * cpu.as_secs_f64() / seconds,
+    );
+  }
+}
+
+async fn read_frames<S: AsyncRead + AsyncWrite + Unpin>(
+  mut ws_stream: WebSocketStream<S>,
+  duration: Duration,
+) -> Result<()> {
+  let start = Instant::now();
+  let deadline = start + duration;
+  let mut total = Interval::default();
+  let mut recent = Interval::default();
+  let (start_cpu, _) = resource_usage();
+  let mut last_report = (start, start_cpu);
+  let mut report_at = start + Duration::from_secs(1);
+
+  loop {
+    let message = tokio::select! {
+      message = ws_stream.next() => message,
+      _ = tokio::time::sleep_until(report_at.into()) => {
+        let now = Instant::now();
+        let (cpu, rss_kb) = resource_usage();
+        let label = format!("{:3}s", (now - start).as_secs_f64().round());
+        recent.print(&label, now - last_report.0, cpu - last_report.1, rss_kb);
+        recent = Interval::default();
+        last_report = (now, cpu);
+        report_at += Duration::from_secs(1);
+        if now >= deadline {
+          break;
+        }
+        continue;
+      }
+    };
+
+    let data = match message {
+      Some(Ok(Message::Binary(data))) => data,
+      Some(Ok(Message::Close(frame))) => bail!("server closed the connection: {frame:?}"),
+      Some(Ok(_)) => continue,
+      Some(Err(e)) => return Err(e.into()),
+      None => bail!("connection closed"),
+    };
+
+    let now = monotonic_now_us();
+    for interval in [&mut total, &mut recent] {
+      interval.bytes += data.len() as u64;
+      if data.len() >= FRAME_HEADER_SIZE && data[1] != FRAME_TYPE_DESCRIPTION {
+        let timestamp = i64::from_le_bytes(data[8..16].try_into().unwrap());
+        interval.frames += 1;
+        interval.latencies.record(now - timestamp);
+      }
+    }
+  }
+
+  let (cpu, rss_kb) = resource_usage();
+  total.print("total", last_report.0 - start, cpu - start_cpu, rss_kb);
+  let _ = ws_stream.close(None).await;
+  Ok(())
+}
+
+/// Read from `url` for `duration`, printing statistics once a second and at the end.
+pub async fn run(url: &str, duration: Duration) -> Result<()> {
+  // Only binary headers carry timestamps.
+  let mut url = url.to_string();
+  if !url.contains("header=binary") {
+    url.push_str(if url.contains('?') {
+      "&header=binary"
+    } else {
+      "?header=binary"
+    });
+  }
+
+  let request = url.as_str().into_client_request()?;
+  let uri = request.uri().clone();
+  let tls = match uri.scheme_str() {
+    Some("wss") => true,
+    Some("ws") => false,
+    _ => bail!("expected a ws:// or wss:// URL, got {url}"),
+  };
+  let host = uri.host().context("URL has no host")?.to_string();
+  let port = uri.port_u16().unwrap_or(if tls { 443 } else { 80 });
+
+  let tcp_stream = TcpStream::connect((host.as_str(), port)).await?;
+  tcp_stream.set_nodelay(true)?;
+  println!("{url}: connected, reading for {}s", duration.as_secs());
+
+  if tls {
+    let mut config = rustls::ClientConfig::builder()
+      .with_safe_defaults()
+      .with_custom_certificate_verifier(Arc::new(AcceptAnyCertificate))
+      .with_no_client_auth();
+    config.alpn_protocols = vec![b"http/1.1".to_vec()];
+
+    let server_name = rustls::ServerName::try_from(host.as_str())?;
+    let tls_stream = TlsConnector::from(Arc::new(config))
+      .connect(server_name, tcp_stream)
+      .await?;
+    let (ws_stream, _) = client_async(request, tls_stream).await?;
+    read_frames(ws_stream, duration).await
+  } else {
+    let (ws_stream, _) = client_async(request, tcp_stream).await?;
+    read_frames(ws_stream, duration).await
+  }
+}
@@ -1,7 +1,8 @@
 use std::ffi::{c_char, CStr};
 use std::path::PathBuf;
+use std::time::Duration;
 
-use clap::Parser;
+use clap::{Parser, Subcommand};
 
 use crate::{
   config::{Config, TLS},
@@ -26,6 +27,23 @@ struct Args {
 
   #[arg(long, default_value_t = false)]
   dump_config: bool,
+
+  #[command(subcommand)]
+  command: Option<Command>,
+}
+
+#[derive(Subcommand, Debug)]
+enum Command {
+  /// Read from a running server as a headless client, and report frame rate, throughput, latency
+  /// and CPU use.
+  Bench {
+    /// WebSocket URL to read from, e.g. wss://127.0.0.1:8443/video/h264/
+    url: String,
+
+    /// How long to read for, in seconds.
+    #[arg(long, default_value_t = 30)]
+    duration: u64,
+  },
 }
 
 #[export_name = "main"]
@@ -38,6 +56,17 @@ extern "C" fn wardenclyffe_main(argc: i32, argv: *mut *mut c_char) -> i32 {
   };
   let args = Args::parse_from(args);
 
+  if let Some(Command::Bench { url, duration }) = &args.command {
+    let rt = tokio::runtime::Runtime::new().expect("failed to create runtime");
+    return match rt.block_on(crate::bench::run(url, Duration::from_secs(*duration))) {
+      Ok(()) => 0,
+      Err(e) => {
+        eprintln!("bench failed: {e:?}");
+        1
+      }
+    };
+  }
+
   let mut config = match std::fs::read(&args.config) {
     Ok(config_file) => serde_json::from_slice(&config_file).expect("failed to parse config file"),
 
@@ -23,6 +23,29 @@ pub struct Config {
   pub port: Option<u16>,
   pub tls: Option<TLS>,
   pub http_content: Option<HttpContent>,
+
+  /// Record the screen for as long as the server runs, with these options for `/record/`, e.g.
+  /// "max_size=512&fps=30". See RecordSocket.
+  pub record: Option<String>,
+
+  /// Threads running the async runtime. Defaults to one per CPU.
+  pub worker_threads: Option<usize>,
+
+  /// Most threads started for blocking work, such as creating sockets. Defaults to tokio's 512.
+  pub max_blocking_threads: Option<usize>,
+
+  /// Most video streams open at once, over WebSockets, sessions and WHEP together. Each can hold a
+  /// virtual display and an encoder, so past what the device can handle, new ones are turned away
+  /// instead. Unlimited by default.
+  pub max_video_sessions: Option<usize>,
+
+  /// TLS sessions remembered for resumption, which saves clients reconnecting after a network blip
+  /// most of a handshake. 0 turns resumption off.
+  pub tls_session_cache_size: Option<usize>,
+
+  /// Whether to also resume TLS sessions from tickets, which clients hold on to, so that they keep
+  /// working after the cache has moved on.
+  pub tls_session_tickets: Option<bool>,
 }
 
 impl Config {
@@ -30,6 +53,8 @@ impl Config {
     self.tls = self.tls.or(Some(TLS::SelfSigned));
     self.port = self.port.or(self.tls.as_ref().map(|_| 8443).or(Some(8443)));
     self.http_content = self.http_content.or(Some(HttpContent::Embedded));
+    self.tls_session_cache_size = self.tls_session_cache_size.or(Some(256));
+    self.tls_session_tickets = self.tls_session_tickets.or(Some(true));
     self
   }
 }
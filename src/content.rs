@@ -0,0 +1,178 @@
+//! Static HTTP content: either the html/ directory, embedded at build time, or files on disk.
+//!
+//! Embedded files are served straight out of the binary, gzipped at build time for clients that
+//! accept it. Files on disk are read asynchronously, and never compressed. Either way, responses
+//! carry an ETag and `Cache-Control: no-cache`, so browsers revalidate on every load and get a 304
+//! back if nothing changed. The gzipped and identity bodies of a file are different
+//! representations, so they get different ETags.
+
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+use std::path::{Component, Path};
+use std::sync::OnceLock;
+use std::time::UNIX_EPOCH;
+
+use bytes::Bytes;
+use hyper::header::{
+  HeaderMap, HeaderValue, ACCEPT_ENCODING, CACHE_CONTROL, CONTENT_ENCODING, CONTENT_TYPE, ETAG, IF_NONE_MATCH, VARY,
+};
+use hyper::{Body, Response, StatusCode};
+use include_dir::{include_dir, Dir, DirEntry};
+
+use crate::config::HttpContent;
+
+static HTML_DIR: Dir<'_> = include_dir!("$OUT_DIR/html");
+
+struct Asset {
+  body: Bytes,
+  gzip: Option<Bytes>,
+  etag: HeaderValue,
+  gzip_etag: HeaderValue,
+}
+
+fn embedded_assets() -> &'static HashMap<&'static str, Asset> {
+  static ASSETS: OnceLock<HashMap<&'static str, Asset>> = OnceLock::new();
+  ASSETS.get_or_init(|| {
+    fn visit(dir: &'static Dir<'static>, assets: &mut HashMap<&'static str, Asset>) {
+      for entry in dir.entries() {
+        let file = match entry {
+          DirEntry::Dir(dir) => {
+            visit(dir, assets);
+            continue;
+          }
+          DirEntry::File(file) => file,
+        };
+
+        let Some(path) = file.path().to_str() else {
+          continue;
+        };
+        if path.ends_with(".gz") && HTML_DIR.get_file(&path[..path.len() - 3]).is_some() {
+          continue;
+        }
+
+        let mut hasher = DefaultHasher::new();
+        file.contents().hash(&mut hasher);
+        let hash = hasher.finish();
+        let gzip = HTML_DIR.get_file(format!("{path}.gz"));
+        assets.insert(
+          path,
+          Asset {
+            body: Bytes::from_static(file.contents()),
+            gzip: gzip.map(|f| Bytes::from_static(f.contents())),
+            etag: HeaderValue::from_str(&format!("\"{hash:016x}\"")).unwrap(),
+            gzip_etag: HeaderValue::from_str(&format!("\"{hash:016x}-gz\"")).unwrap(),
+          },
+        );
+      }
+    }
+
+    let mut assets = HashMap::new();
+    visit(&HTML_DIR, &mut assets);
+    assets
+  })
+}
+
+fn content_type(path: &str) -> &'static str {
+  match path.rsplit_once('.').map(|(_, extension)| extension) {
+    Some("html") => "text/html; charset=utf-8",
+    Some("js") => "text/javascript; charset=utf-8",
+    Some("css") => "text/css; charset=utf-8",
+    Some("json") => "application/json",
+    Some("svg") => "image/svg+xml",
+    Some("png") => "image/png",
+    Some("ico") => "image/x-icon",
+    Some("wasm") => "application/wasm",
+    _ => "application/octet-stream",
+  }
+}
+
+fn accepts_gzip(headers: &HeaderMap) -> bool {
+  headers
+    .get_all(ACCEPT_ENCODING)
+    .iter()
+    .filter_map(|h| h.to_str().ok())
+    .flat_map(|h| h.split(','))
+    .any(|coding| {
+      let mut params = coding.split(';').map(str::trim);
+      let gzip = params
+        .next()
+        .is_some_and(|name| name.eq_ignore_ascii_case("gzip") || name == "*");
+      let refused = params.any(|param| param.strip_prefix("q=").and_then(|q| q.parse::<f32>().ok()) == Some(0.0));
+      gzip && !refused
+    })
+}
+
+fn etag_matches(headers: &HeaderMap, etag: &HeaderValue) -> bool {
+  let etag = etag.to_str().unwrap_or_default().trim_start_matches("W/");
+  headers
+    .get_all(IF_NONE_MATCH)
+    .iter()
+    .filter_map(|h| h.to_str().ok())
+    .flat_map(|h| h.split(','))
+    .map(str::trim)
+    .any(|tag| tag == "*" || tag.trim_start_matches("W/") == etag)
+}
+
+/// `body` is None for a 304. `gzip` says whether it's the gzipped representation.
+fn respond(path: &str, etag: HeaderValue, gzip: bool, body: Option<Bytes>) -> Response<Body> {
+  let mut response = Response::new(Body::empty());
+  let response_headers = response.headers_mut();
+  response_headers.insert(CACHE_CONTROL, HeaderValue::from_static("no-cache"));
+  response_headers.insert(VARY, HeaderValue::from_static("Accept-Encoding"));
+  response_headers.insert(ETAG, etag);
+
+  match body {
+    None => *response.status_mut() = StatusCode::NOT_MODIFIED,
+    Some(body) => {
+      response_headers.insert(CONTENT_TYPE, HeaderValue::from_static(content_type(path)));
+      if gzip {
+        response_headers.insert(CONTENT_ENCODING, HeaderValue::from_static("gzip"));
+      }
+      *response.body_mut() = Body::from(body);
+    }
+  }
+  response
+}
+
+/// Serve the file at `path`, relative to the root of `http_content`. Returns None if there's no such
+/// file.
+pub async fn serve(http_content: &HttpContent, headers: &HeaderMap, path: &str) -> Option<Response<Body>> {
+  match http_content {
+    HttpContent::Embedded => {
+      let asset = embedded_assets().get(path)?;
+      let gzip = asset.gzip.as_ref().filter(|_| accepts_gzip(headers));
+      let etag = if gzip.is_some() { &asset.gzip_etag } else { &asset.etag };
+      let body = (!etag_matches(headers, etag)).then(|| gzip.unwrap_or(&asset.body).clone());
+      Some(respond(path, etag.clone(), gzip.is_some(), body))
+    }
+
+    HttpContent::Path(base_path) => {
+      // Don't let requests escape the content directory.
+      let relative = Path::new(path);
+      if !relative.components().all(|c| matches!(c, Component::Normal(_))) {
+        return None;
+      }
+
+      let full_path = base_path.join(relative);
+      let metadata = tokio::fs::metadata(&full_path).await.ok()?;
+      if !metadata.is_file() {
+        return None;
+      }
+
+      // Good enough to tell whether the file has been touched, without reading it.
+      let modified = metadata
+        .modified()
+        .ok()
+        .and_then(|t| t.duration_since(UNIX_EPOCH).ok())
+        .map_or(0, |d| d.as_nanos());
+      let etag = HeaderValue::from_str(&format!("W/\"{:x}-{:x}\"", metadata.len(), modified)).unwrap();
+      if etag_matches(headers, &etag) {
+        return Some(respond(path, etag, false, None));
+      }
+
+      let body = Bytes::from(tokio::fs::read(&full_path).await.ok()?);
+      Some(respond(path, etag, false, Some(body)))
+    }
+  }
+}
@@ -1,5 +1,7 @@
 use std::ffi::{c_char, c_void};
 
+use bytes::Bytes;
+
 #[repr(transparent)]
 #[derive(Clone, Copy)]
 pub struct WardenclyffeSocket(pub *mut c_void);
@@ -7,16 +9,123 @@ pub struct WardenclyffeSocket(pub *mut c_void);
 unsafe impl Sync for WardenclyffeSocket {}
 unsafe impl Send for WardenclyffeSocket {}
 
+/// A WardenclyffeSocket that is destroyed when dropped.
+///
+/// Reads block, so a reader thread typically holds a reference to the socket alongside the
+/// connection. `close` wakes up the reader without pulling the socket out from under it.
+pub struct OwnedSocket(WardenclyffeSocket);
+
+impl OwnedSocket {
+  /// # Safety
+  /// `socket` must be a valid socket returned by `wardenclyffe_create_socket`, and must not be used
+  /// elsewhere afterwards.
+  pub unsafe fn from_raw(socket: WardenclyffeSocket) -> Option<Self> {
+    if socket.0.is_null() {
+      None
+    } else {
+      Some(OwnedSocket(socket))
+    }
+  }
+
+  pub fn supports_read(&self) -> bool {
+    unsafe { wardenclyffe_supports_read(self.0) }
+  }
+
+  pub fn supports_write(&self) -> bool {
+    unsafe { wardenclyffe_supports_write(self.0) }
+  }
+
+  /// Block until the next batch of reads is available.
+  ///
+  /// A negative read count means that the read failed, and zero means EOF. Reads are only valid
+  /// until the next call, so only one thread may read at a time.
+  pub fn read(&self) -> WardenclyffeReads {
+    unsafe { wardenclyffe_read(self.0) }
+  }
+
+  /// Report that everything from one `read` has been sent, in the order that they were read.
+  pub fn reads_sent(&self) {
+    unsafe { wardenclyffe_reads_sent(self.0) }
+  }
+
+  pub fn write(&self, data: &[u8]) -> bool {
+    unsafe { wardenclyffe_write(self.0, data.as_ptr() as *const c_void, data.len()) }
+  }
+
+  /// Make any pending and future reads return EOF.
+  pub fn close(&self) {
+    unsafe { wardenclyffe_close_socket(self.0) }
+  }
+}
+
+impl Drop for OwnedSocket {
+  fn drop(&mut self) {
+    unsafe { wardenclyffe_destroy_socket(self.0) }
+  }
+}
+
+unsafe impl Sync for OwnedSocket {}
+unsafe impl Send for OwnedSocket {}
+
+#[repr(transparent)]
+#[derive(Clone, Copy)]
+pub struct WardenclyffeFrame(pub *const c_void);
+
+unsafe impl Sync for WardenclyffeFrame {}
+unsafe impl Send for WardenclyffeFrame {}
+
 #[repr(C)]
 pub struct WardenclyffeRead {
   pub data: *const c_void,
   pub size: usize,
   pub oob: u8,
+  /// If non-null, a reference to the buffer backing `data`, which must be released with
+  /// `wardenclyffe_release_frame`. Otherwise, `data` is only valid until the next read.
+  pub frame: WardenclyffeFrame,
 }
 
 unsafe impl Sync for WardenclyffeRead {}
 unsafe impl Send for WardenclyffeRead {}
 
+impl WardenclyffeRead {
+  /// Take ownership of the read's contents. Frame-backed reads are wrapped without copying.
+  ///
+  /// # Safety
+  /// Must be called at most once per read, before the next call to `wardenclyffe_read`.
+  pub unsafe fn into_bytes(&self) -> Bytes {
+    if self.frame.0.is_null() {
+      Bytes::copy_from_slice(std::slice::from_raw_parts(self.data as *const u8, self.size))
+    } else {
+      Bytes::from_owner(FrameRef {
+        frame: self.frame,
+        data: self.data as *const u8,
+        size: self.size,
+      })
+    }
+  }
+}
+
+/// A reference to a frame owned by the C++ side, released when dropped.
+struct FrameRef {
+  frame: WardenclyffeFrame,
+  data: *const u8,
+  size: usize,
+}
+
+unsafe impl Send for FrameRef {}
+
+impl AsRef<[u8]> for FrameRef {
+  fn as_ref(&self) -> &[u8] {
+    unsafe { std::slice::from_raw_parts(self.data, self.size) }
+  }
+}
+
+impl Drop for FrameRef {
+  fn drop(&mut self) {
+    unsafe { wardenclyffe_release_frame(self.frame) }
+  }
+}
+
 #[repr(C)]
 pub struct WardenclyffeReads {
   pub reads: *const WardenclyffeRead,
@@ -28,10 +137,13 @@ unsafe impl Send for WardenclyffeReads {}
 
 extern "C" {
   pub fn wardenclyffe_create_socket(path: *const c_char) -> WardenclyffeSocket;
+  pub fn wardenclyffe_close_socket(socket: WardenclyffeSocket) -> ();
   pub fn wardenclyffe_destroy_socket(socket: WardenclyffeSocket) -> ();
 
   pub fn wardenclyffe_supports_read(socket: WardenclyffeSocket) -> bool;
   pub fn wardenclyffe_read(socket: WardenclyffeSocket) -> WardenclyffeReads;
+  pub fn wardenclyffe_release_frame(frame: WardenclyffeFrame) -> ();
+  pub fn wardenclyffe_reads_sent(socket: WardenclyffeSocket) -> ();
 
   pub fn wardenclyffe_supports_write(socket: WardenclyffeSocket) -> bool;
   pub fn wardenclyffe_write(socket: WardenclyffeSocket, data: *const c_void, len: usize) -> bool;
@@ -3,7 +3,7 @@ use std::io::{self, BufReader};
 use std::net::SocketAddr;
 use std::sync::Arc;
 
-use anyhow::{bail, Result};
+use anyhow::{anyhow, bail, Result};
 use hyper::{
   server::conn::{AddrIncoming, AddrStream},
   service::{make_service_fn, service_fn},
@@ -13,11 +13,16 @@ use rustls_pemfile::Item;
 #[macro_use]
 extern crate log;
 
+mod bench;
 mod cli;
 mod config;
+mod content;
 mod ffi;
+mod limits;
 mod server;
+mod session;
 mod tls;
+mod whep;
 
 use config::Config;
 use server::*;
@@ -108,6 +113,16 @@ impl Server {
       .unwrap();
 
     cfg.alpn_protocols = vec![b"h2".to_vec(), b"http/1.1".to_vec()];
+
+    // Resumption skips the certificate and its signature, which is most of a handshake's CPU when
+    // every client reconnects at once.
+    match config.tls_session_cache_size.unwrap_or(256) {
+      0 => cfg.session_storage = Arc::new(rustls::server::NoServerSessionStorage {}),
+      size => cfg.session_storage = rustls::server::ServerSessionMemoryCache::new(size),
+    }
+    if config.tls_session_tickets.unwrap_or(true) {
+      cfg.ticketer = rustls::Ticketer::new().map_err(|_| anyhow!("failed to create TLS ticketer"))?;
+    }
     Ok(cfg)
   }
 
@@ -115,7 +130,29 @@ impl Server {
     android_logger::init_once(android_logger::Config::default().with_max_level(log::LevelFilter::Info));
 
     let config = Arc::new(self.config.populate_defaults());
-    let rt = tokio::runtime::Runtime::new()?;
+    if let Some(options) = &config.record {
+      if let Err(e) = start_recording(options) {
+        error!("{e:?}");
+      }
+    }
+
+    limits::set_max_video_streams(config.max_video_sessions);
+
+    let mut runtime = tokio::runtime::Builder::new_multi_thread();
+    runtime.enable_all();
+    if let Some(threads) = config.worker_threads {
+      if threads == 0 {
+        bail!("worker_threads must be at least 1");
+      }
+      runtime.worker_threads(threads);
+    }
+    if let Some(threads) = config.max_blocking_threads {
+      if threads == 0 {
+        bail!("max_blocking_threads must be at least 1");
+      }
+      runtime.max_blocking_threads(threads);
+    }
+    let rt = runtime.build()?;
     rt.block_on(async move {
       let config = config.clone();
       let addr = format!("0.0.0.0:{}", config.port.unwrap())
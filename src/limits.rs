@@ -0,0 +1,77 @@
+//! Limits on how much clients can open at once. Past what the device can take, new streams are
+//! turned away up front, rather than being let in to slow every other stream down.
+
+use std::fmt;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use hyper::header::{HeaderValue, RETRY_AFTER};
+use hyper::{Body, Response, StatusCode};
+
+static MAX_VIDEO_STREAMS: AtomicUsize = AtomicUsize::new(usize::MAX);
+static VIDEO_STREAMS: AtomicUsize = AtomicUsize::new(0);
+
+/// Set the limit from `Config::max_video_sessions`, or lift it.
+pub(crate) fn set_max_video_streams(max: Option<usize>) {
+  MAX_VIDEO_STREAMS.store(max.unwrap_or(usize::MAX), Ordering::Relaxed);
+}
+
+/// Whether `path` streams video, which can mean a virtual display and an encoder of its own, as
+/// opposed to e.g. listing what's available.
+fn is_video_stream(path: &str) -> bool {
+  let Some(rest) = path.strip_prefix("/video/") else {
+    return false;
+  };
+  let name = rest.split(['/', '?']).next().unwrap_or("");
+  !matches!(name, "" | "codecs" | "displays")
+}
+
+#[derive(Debug)]
+pub(crate) struct LimitExceeded {
+  max: usize,
+}
+
+impl fmt::Display for LimitExceeded {
+  fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+    write!(f, "too many video streams open (at most {})", self.max)
+  }
+}
+
+impl std::error::Error for LimitExceeded {}
+
+impl LimitExceeded {
+  /// A 503, for requests that are turned away before anything is set up for them.
+  pub(crate) fn into_response(self) -> Response<Body> {
+    let mut response = Response::new(Body::from(self.to_string()));
+    *response.status_mut() = StatusCode::SERVICE_UNAVAILABLE;
+    response
+      .headers_mut()
+      .insert(RETRY_AFTER, HeaderValue::from_static("5"));
+    response
+  }
+}
+
+/// One of `Config::max_video_sessions`, held for as long as the stream that claimed it is open.
+pub(crate) struct VideoSlot(());
+
+impl VideoSlot {
+  /// Claim a slot for `path` if it streams video. Other paths don't need one, and get `None`.
+  pub(crate) fn claim(path: &str) -> Result<Option<VideoSlot>, LimitExceeded> {
+    if !is_video_stream(path) {
+      return Ok(None);
+    }
+
+    let max = MAX_VIDEO_STREAMS.load(Ordering::Relaxed);
+    VIDEO_STREAMS
+      .fetch_update(Ordering::AcqRel, Ordering::Acquire, |open| {
+        (open < max).then_some(open + 1)
+      })
+      .map(|_| Some(VideoSlot(())))
+      .map_err(|_| LimitExceeded { max })
+  }
+}
+
+impl Drop for VideoSlot {
+  fn drop(&mut self) {
+    VIDEO_STREAMS.fetch_sub(1, Ordering::AcqRel);
+  }
+}
@@ -1,13 +1,17 @@
-use std::ffi::{c_void, CString};
+use std::ffi::CString;
 use std::net::SocketAddr;
 use std::sync::Arc;
 
 use futures_util::{future, pin_mut, SinkExt, StreamExt, TryStreamExt};
 
 use anyhow::{bail, Result};
+use bytes::Bytes;
 
 use hyper::{
-  header::{HeaderValue, CONNECTION, SEC_WEBSOCKET_ACCEPT, SEC_WEBSOCKET_KEY, SEC_WEBSOCKET_VERSION, UPGRADE},
+  header::{
+    HeaderValue, CACHE_CONTROL, CONNECTION, CONTENT_DISPOSITION, CONTENT_TYPE, SEC_WEBSOCKET_ACCEPT, SEC_WEBSOCKET_KEY,
+    SEC_WEBSOCKET_VERSION, UPGRADE,
+  },
   upgrade::Upgraded,
   Body, Method, Request, Response, StatusCode, Version,
 };
@@ -17,13 +21,14 @@ use tungstenite::handshake::derive_accept_key;
 use tungstenite::protocol::frame::coding::CloseCode;
 use tungstenite::protocol::frame::CloseFrame;
 use tungstenite::protocol::{Message, Role};
+use tungstenite::Utf8Bytes;
 
-use crate::config::{Config, HttpContent};
+use crate::config::Config;
+use crate::content;
 use crate::ffi::*;
-
-use include_dir::{include_dir, Dir, File};
-
-static HTML_DIR: Dir<'_> = include_dir!("$CARGO_MANIFEST_DIR/html");
+use crate::limits::VideoSlot;
+use crate::session::handle_session;
+use crate::whep;
 
 async fn handle_websocket(
   ws_stream: WebSocketStream<Upgraded>,
@@ -31,109 +36,254 @@ async fn handle_websocket(
   addr: SocketAddr,
 ) -> Result<()> {
   info!("{addr}: WebSocket established (uri = {})", request.uri());
-  let path = CString::new(request.uri().path())?;
+  // The query string carries per-connection options, so pass it along with the path.
+  let path = request.uri().path_and_query().map_or("/", |p| p.as_str());
+  let path = CString::new(path)?;
 
-  let wardenclyffe_socket = unsafe { wardenclyffe_create_socket(path.as_ptr()) };
-  if wardenclyffe_socket.0.is_null() {
+  let socket = unsafe { OwnedSocket::from_raw(wardenclyffe_create_socket(path.as_ptr())) };
+  let Some(socket) = socket.map(Arc::new) else {
     bail!("{addr}: failed to create socket");
-  }
+  };
 
   let (mut outgoing, incoming) = ws_stream.split();
-  let supports_read = unsafe { wardenclyffe_supports_read(wardenclyffe_socket) };
-  let supports_write = unsafe { wardenclyffe_supports_write(wardenclyffe_socket) };
+  let supports_write = socket.supports_write();
 
   let incoming = incoming.try_for_each(|msg| {
-    let msg = msg.to_text().unwrap();
+    let msg_bytes: &[u8] = match &msg {
+      Message::Text(text) => text.as_bytes(),
+      Message::Binary(data) => data,
+      _ => return future::ok(()),
+    };
+
     if supports_write {
-      debug!("{addr}: received message: {}", msg);
-      let msg_bytes = msg.as_bytes();
-
-      // TODO: The lifetime of the socket seems dubious here...
-      let result = unsafe {
-        wardenclyffe_write(
-          wardenclyffe_socket,
-          msg_bytes.as_ptr() as *const c_void,
-          msg_bytes.len(),
-        )
-      };
-      if result {
+      debug!("{addr}: received message: {:?}", msg);
+      if socket.write(msg_bytes) {
         future::ok(())
       } else {
         future::err(tungstenite::Error::ConnectionClosed)
       }
     } else {
-      info!("{addr}: received unhandled message: {}", msg);
+      info!("{addr}: received unhandled message: {:?}", msg);
       future::ok(())
     }
   });
 
-  let outgoing = tokio::spawn(async move {
-    if supports_read {
-      loop {
-        let reads = {
-          tokio::task::spawn_blocking(move || unsafe { wardenclyffe_read(wardenclyffe_socket) })
-            .await
-            .expect("failed to join")
-        };
-
-        if reads.read_count < 0 {
-          error!("{addr}: WardenclyffeSocket::read failed: rc = {}", reads.read_count);
-          let _ = outgoing
-            .send(Message::Close(Some(CloseFrame {
-              code: CloseCode::Error,
-              reason: "read failed".into(),
-            })))
-            .await;
-          return;
-        } else if reads.read_count == 0 {
-          info!("{addr}: WardenclyffeSocket hit EOF");
-          let _ = outgoing
-            .send(Message::Close(Some(CloseFrame {
-              code: CloseCode::Normal,
-              reason: "EOF".into(),
-            })))
-            .await;
-          return;
-        }
+  let outgoing = async {
+    if !socket.supports_read() {
+      return future::pending().await;
+    }
 
-        let reads = unsafe { std::slice::from_raw_parts(reads.reads, reads.read_count as usize) };
-        for read in reads {
-          let buf = unsafe { std::slice::from_raw_parts(read.data as *const u8, read.size) }.to_vec();
-          let result = if read.oob != 0 {
-            let buf_str = unsafe { String::from_utf8_unchecked(buf) };
-            outgoing.send(Message::Text(buf_str))
-          } else {
-            outgoing.send(Message::Binary(buf))
-          };
-          if let Err(e) = result.await {
-            error!("{addr}: failed to send: {e}");
-            return;
-          }
-        }
+    let (tx, mut rx) = tokio::sync::mpsc::channel(READ_QUEUE_DEPTH);
+    let reader_socket = socket.clone();
+    std::thread::Builder::new()
+      .name(format!("reader {addr}"))
+      .spawn(move || read_loop(&reader_socket, addr, |read| tx.blocking_send(read).is_ok()))
+      .expect("failed to spawn reader thread");
+
+    while let Some(read) = rx.recv().await {
+      if let Err(e) = outgoing.send(read.message).await {
+        error!("{addr}: failed to send: {e}");
+        return;
+      }
+      if read.last {
+        socket.reads_sent();
       }
-    } else {
-      future::pending().await
     }
-  });
+  };
 
   pin_mut!(incoming, outgoing);
   future::select(incoming, outgoing).await;
 
   info!("{addr}: disconnected");
-  unsafe {
-    wardenclyffe_destroy_socket(wardenclyffe_socket);
-  }
+
+  // Unblock the reader thread. The socket is destroyed once it lets go.
+  socket.close();
 
   Ok(())
 }
 
-fn get_http_content(http_content: &HttpContent, path: &str) -> Option<Vec<u8>> {
-  match http_content {
-    HttpContent::Embedded => HTML_DIR.get_file(path).map(File::contents).map(<[u8]>::to_vec),
-    HttpContent::Path(base_path) => std::fs::read(base_path.join(path)).ok(),
+/// Number of messages that the reader thread can queue up before it stops reading.
+///
+/// This is kept small, so that the WebSocket's backpressure reaches the socket quickly.
+pub(crate) const READ_QUEUE_DEPTH: usize = 4;
+
+/// A message read from a socket, on its way to the client.
+pub(crate) struct SocketRead {
+  pub message: Message,
+
+  /// Set on the last message of each `OwnedSocket::read`, which should be followed by a call to
+  /// `OwnedSocket::reads_sent` once it's been sent.
+  pub last: bool,
+}
+
+impl SocketRead {
+  fn close(code: CloseCode, reason: &'static str) -> Self {
+    SocketRead {
+      message: Message::Close(Some(CloseFrame {
+        code,
+        reason: reason.into(),
+      })),
+      last: false,
+    }
   }
 }
 
+/// Read from `socket` until it hits EOF or an error, or until `send` returns false because the
+/// connection went away. The last message sent is always a `Message::Close`.
+pub(crate) fn read_loop(socket: &OwnedSocket, addr: SocketAddr, mut send: impl FnMut(SocketRead) -> bool) {
+  loop {
+    let reads = socket.read();
+    if reads.read_count < 0 {
+      error!("{addr}: WardenclyffeSocket::read failed: rc = {}", reads.read_count);
+      send(SocketRead::close(CloseCode::Error, "read failed"));
+      return;
+    } else if reads.read_count == 0 {
+      info!("{addr}: WardenclyffeSocket hit EOF");
+      send(SocketRead::close(CloseCode::Normal, "EOF"));
+      return;
+    }
+
+    // Take ownership of every read before sending anything, so that frames are released even if
+    // the connection goes away halfway through.
+    let reads = unsafe { std::slice::from_raw_parts(reads.reads, reads.read_count as usize) };
+    let messages: Vec<Message> = reads
+      .iter()
+      .filter_map(|read| {
+        let buf = unsafe { read.into_bytes() };
+        if read.oob != 0 {
+          match Utf8Bytes::try_from(buf) {
+            Ok(text) => Some(Message::Text(text)),
+            Err(e) => {
+              error!("{addr}: dropping non-UTF-8 OOB message: {e}");
+              None
+            }
+          }
+        } else {
+          Some(Message::Binary(buf))
+        }
+      })
+      .collect();
+
+    if messages.is_empty() {
+      socket.reads_sent();
+      continue;
+    }
+
+    let count = messages.len();
+    for (i, message) in messages.into_iter().enumerate() {
+      let last = i + 1 == count;
+      if !send(SocketRead { message, last }) {
+        return;
+      }
+    }
+  }
+}
+
+/// Serve `/stats` over plain HTTP, for tools that don't speak WebSocket. See CreateStatsSocket.
+async fn get_stats(query: Option<&str>) -> Result<Response<Body>> {
+  let path = CString::new(match query {
+    Some(query) => format!("/stats/?{query}"),
+    None => "/stats/".to_string(),
+  })?;
+
+  let stats = tokio::task::spawn_blocking(move || {
+    let socket = unsafe { OwnedSocket::from_raw(wardenclyffe_create_socket(path.as_ptr())) }?;
+    let reads = socket.read();
+    if reads.read_count <= 0 {
+      return None;
+    }
+    let read = unsafe { &*reads.reads };
+    Some(unsafe { read.into_bytes() })
+  })
+  .await?;
+
+  let Some(stats) = stats else {
+    let mut response = Response::new(Body::from("Bad request"));
+    *response.status_mut() = StatusCode::BAD_REQUEST;
+    return Ok(response);
+  };
+
+  let mut response = Response::new(Body::from(stats));
+  let headers = response.headers_mut();
+  headers.insert(CONTENT_TYPE, HeaderValue::from_static("application/json"));
+  headers.insert(CACHE_CONTROL, HeaderValue::from_static("no-store"));
+  Ok(response)
+}
+
+/// Serve a clip of the recording as an MP4 download. See ClipSocket.
+async fn get_clip(query: Option<&str>) -> Result<Response<Body>> {
+  let path = CString::new(match query {
+    Some(query) => format!("/record/clip/?{query}"),
+    None => "/record/clip/".to_string(),
+  })?;
+
+  let socket =
+    tokio::task::spawn_blocking(move || unsafe { OwnedSocket::from_raw(wardenclyffe_create_socket(path.as_ptr())) })
+      .await?;
+  let Some(socket) = socket else {
+    let mut response = Response::new(Body::from("No recording"));
+    *response.status_mut() = StatusCode::NOT_FOUND;
+    return Ok(response);
+  };
+
+  // Stream the file out as it's read, rather than holding all of it in memory.
+  let (tx, rx) = tokio::sync::mpsc::channel::<std::io::Result<Bytes>>(READ_QUEUE_DEPTH);
+  std::thread::Builder::new()
+    .name("clip reader".to_string())
+    .spawn(move || loop {
+      let reads = socket.read();
+      if reads.read_count < 0 {
+        let _ = tx.blocking_send(Err(std::io::Error::other("failed to read recording")));
+        return;
+      } else if reads.read_count == 0 {
+        return;
+      }
+
+      let reads = unsafe { std::slice::from_raw_parts(reads.reads, reads.read_count as usize) };
+      for read in reads {
+        if tx.blocking_send(Ok(unsafe { read.into_bytes() })).is_err() {
+          return;
+        }
+      }
+    })
+    .expect("failed to spawn clip reader thread");
+
+  let body = futures_util::stream::unfold(rx, |mut rx| async move { rx.recv().await.map(|chunk| (chunk, rx)) });
+  let mut response = Response::new(Body::wrap_stream(body));
+  let headers = response.headers_mut();
+  headers.insert(CONTENT_TYPE, HeaderValue::from_static("video/mp4"));
+  headers.insert(
+    CONTENT_DISPOSITION,
+    HeaderValue::from_static("attachment; filename=\"recording.mp4\""),
+  );
+  headers.insert(CACHE_CONTROL, HeaderValue::from_static("no-store"));
+  Ok(response)
+}
+
+/// Record for as long as the server runs, with `options` as for `/record/?<options>`.
+pub(crate) fn start_recording(options: &str) -> Result<()> {
+  let path = CString::new(format!("/record/?{options}"))?;
+  let socket = unsafe { OwnedSocket::from_raw(wardenclyffe_create_socket(path.as_ptr())) };
+  let Some(socket) = socket else {
+    bail!("failed to start recording with {options}");
+  };
+
+  std::thread::Builder::new()
+    .name("recorder".to_string())
+    .spawn(move || loop {
+      // Reads are status updates, which are only interesting when something goes wrong.
+      let reads = socket.read();
+      if reads.read_count < 0 {
+        error!("recording failed");
+        return;
+      } else if reads.read_count == 0 {
+        info!("recording stopped");
+        return;
+      }
+    })?;
+  Ok(())
+}
+
 pub async fn handle_request(config: Arc<Config>, mut req: Request<Body>, addr: SocketAddr) -> Result<Response<Body>> {
   let upgrade = HeaderValue::from_static("Upgrade");
   let websocket = HeaderValue::from_static("websocket");
@@ -159,17 +309,27 @@ pub async fn handle_request(config: Arc<Config>, mut req: Request<Body>, addr: S
     && headers.get(SEC_WEBSOCKET_VERSION).map(|h| h == "13").unwrap_or(false)
     && key.is_some()
   {
+    // Turn away video streams over the limit before upgrading, so the client gets a proper error.
+    let slot = match VideoSlot::claim(req.uri().path()) {
+      Ok(slot) => slot,
+      Err(e) => {
+        warn!("{addr}: rejecting {}: {e}", req.uri());
+        return Ok(e.into_response());
+      }
+    };
+
     let ver = req.version();
     tokio::task::spawn(async move {
+      let _slot = slot;
       match hyper::upgrade::on(&mut req).await {
         Ok(upgraded) => {
-          if let Err(e) = handle_websocket(
-            WebSocketStream::from_raw_socket(upgraded, Role::Server, None).await,
-            req,
-            addr,
-          )
-          .await
-          {
+          let ws_stream = WebSocketStream::from_raw_socket(upgraded, Role::Server, None).await;
+          let result = if req.uri().path().starts_with("/session/") {
+            handle_session(ws_stream, addr).await
+          } else {
+            handle_websocket(ws_stream, req, addr).await
+          };
+          if let Err(e) = result {
             error!("failed to handle websocket: {e:?}");
           }
         }
@@ -188,6 +348,10 @@ pub async fn handle_request(config: Arc<Config>, mut req: Request<Body>, addr: S
   }
 
   info!("HTTP request for {}", req.uri());
+  if req.uri().path().starts_with("/whep/") {
+    return whep::handle_request(req).await;
+  }
+
   let path = req.uri().path();
   if !path.starts_with('/') {
     let mut response = Response::new(Body::from("Bad request"));
@@ -195,21 +359,31 @@ pub async fn handle_request(config: Arc<Config>, mut req: Request<Body>, addr: S
     return Ok(response);
   }
 
-  let http_content = config.http_content.as_ref().unwrap();
+  if path == "/stats" || path == "/stats/" {
+    return get_stats(req.uri().query()).await;
+  }
 
-  let mut path = &path[1..];
-  if let Some(file) = get_http_content(http_content, path) {
-    return Ok(Response::new(Body::from(file)));
+  if path == "/record/clip" || path == "/record/clip/" {
+    return get_clip(req.uri().query()).await;
   }
 
-  // Assume it's a directory, look for index.html.
-  while path.ends_with('/') {
-    path = &path[..path.len() - 1];
+  let http_content = config.http_content.as_ref().unwrap();
+
+  let headers = req.headers();
+  let path = path.trim_start_matches('/');
+  if let Some(response) = content::serve(http_content, headers, path).await {
+    return Ok(response);
   }
 
-  let index_path = format!("{}/{}", path, "index.html");
-  if let Some(file) = get_http_content(http_content, &index_path) {
-    return Ok(Response::new(Body::from(file)));
+  // Assume it's a directory, look for index.html.
+  let path = path.trim_end_matches('/');
+  let index_path = if path.is_empty() {
+    "index.html".to_string()
+  } else {
+    format!("{path}/index.html")
+  };
+  if let Some(response) = content::serve(http_content, headers, &index_path).await {
+    return Ok(response);
   }
 
   let mut response = Response::new(Body::from(format!("File not found: {path}")));
@@ -0,0 +1,485 @@
+//! Several sockets ("channels") multiplexed over a single WebSocket.
+//!
+//! Text messages are JSON control messages. The client opens and closes channels with
+//!   {"type": "open", "channel": <id>, "path": "/video/h264/?header=binary", "priority": <n>}
+//!   {"type": "close", "channel": <id>}
+//! and the server answers with
+//!   {"type": "opened", "channel": <id>}
+//!   {"type": "closed", "channel": <id>, "reason": <string>}
+//!
+//! Binary messages carry channel data, behind a two byte header: the channel ID, then flags. Binary
+//! messages from the client are written to the channel's socket, once it's been created if the
+//! channel is still opening. Reads from the socket go the other way, with `FLAG_TEXT` set for
+//! out-of-band reads.
+//!
+//! Outgoing reads are split into chunks of at most `CHUNK_SIZE` bytes, with `FLAG_CONTINUED` set on
+//! every chunk but the last, and the next chunk always comes from the highest priority channel
+//! that has something to send. That way input and audio (priorities 0 and 1 by default) only ever
+//! wait for one chunk of a video keyframe, instead of the whole thing.
+
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::net::SocketAddr;
+use std::sync::{Arc, Mutex};
+
+use anyhow::Result;
+use bytes::{BufMut, Bytes, BytesMut};
+use futures_util::stream::SplitSink;
+use futures_util::{SinkExt, StreamExt};
+use hyper::upgrade::Upgraded;
+use serde::{Deserialize, Serialize};
+use tokio::sync::{mpsc, Notify};
+use tokio_tungstenite::WebSocketStream;
+use tungstenite::protocol::Message;
+
+use crate::ffi::*;
+use crate::limits::VideoSlot;
+use crate::server::{read_loop, SocketRead, READ_QUEUE_DEPTH};
+
+const HEADER_SIZE: usize = 2;
+const FLAG_TEXT: u8 = 1 << 0;
+const FLAG_CONTINUED: u8 = 1 << 1;
+
+/// Largest piece of a read that's sent in one go.
+const CHUNK_SIZE: usize = 16 * 1024;
+
+/// Messages held for a channel that's still opening, past which they're dropped.
+const MAX_QUEUED_WRITES: usize = 64;
+
+#[derive(Deserialize)]
+#[serde(tag = "type", rename_all = "lowercase")]
+enum ClientMessage {
+  Open {
+    channel: u8,
+    path: String,
+    priority: Option<u8>,
+  },
+  Close {
+    channel: u8,
+  },
+}
+
+#[derive(Serialize)]
+#[serde(tag = "type", rename_all = "lowercase")]
+enum ServerMessage<'a> {
+  Opened { channel: u8 },
+  Closed { channel: u8, reason: &'a str },
+}
+
+impl ServerMessage<'_> {
+  fn to_message(&self) -> Message {
+    Message::Text(serde_json::to_string(self).unwrap().into())
+  }
+}
+
+/// Lower is more urgent.
+fn default_priority(path: &str) -> u8 {
+  if path.starts_with("/input/") {
+    0
+  } else if path.starts_with("/audio/") {
+    1
+  } else {
+    2
+  }
+}
+
+/// A channel, as seen by the incoming side.
+struct IncomingChannel {
+  /// None while the socket is being created.
+  socket: Option<Arc<OwnedSocket>>,
+
+  /// Keeps the channel open for sockets that don't have a reader thread, until `close` lets go of
+  /// it. Sockets with one report EOF through it instead.
+  tx: Option<mpsc::Sender<SocketRead>>,
+
+  /// Held until the channel is closed, for video channels.
+  _video_slot: Option<VideoSlot>,
+
+  /// Writes that arrived while the socket was being created.
+  queued: Vec<Bytes>,
+
+  /// Set if the channel was closed before its socket was created.
+  closed: bool,
+}
+
+impl IncomingChannel {
+  /// Either way, the writer sees the queue end, and reports the channel as closed. Channels that
+  /// are still opening are closed as soon as their socket exists.
+  fn close(&mut self) {
+    match &self.socket {
+      Some(socket) => socket.close(),
+      None => self.closed = true,
+    }
+    self.tx = None;
+  }
+}
+
+type Channels = Arc<Mutex<HashMap<u8, IncomingChannel>>>;
+
+/// A channel, as seen by the writer.
+struct OutgoingChannel {
+  id: u8,
+  priority: u8,
+  socket: Arc<OwnedSocket>,
+  rx: mpsc::Receiver<SocketRead>,
+
+  /// The read being sent.
+  partial: Option<PartialRead>,
+}
+
+struct PartialRead {
+  data: Bytes,
+  flags: u8,
+
+  /// How much of `data` has been sent so far.
+  offset: usize,
+
+  /// Whether this is the last read from an `OwnedSocket::read`.
+  last: bool,
+}
+
+/// A message for the client, along with the socket to report to once it's been sent, if any.
+type Chunk = (Message, Option<Arc<OwnedSocket>>);
+
+enum WriterEvent {
+  Control(Message),
+  Open(OutgoingChannel),
+}
+
+struct Writer {
+  addr: SocketAddr,
+  channels: Channels,
+  outgoing: Vec<OutgoingChannel>,
+}
+
+impl Writer {
+  fn handle_event(&mut self, event: WriterEvent) -> Option<Message> {
+    match event {
+      WriterEvent::Control(message) => Some(message),
+      WriterEvent::Open(channel) => {
+        // Keep channels sorted by priority, oldest first within a priority.
+        let index = self.outgoing.partition_point(|c| c.priority <= channel.priority);
+        self.outgoing.insert(index, channel);
+        None
+      }
+    }
+  }
+
+  /// Drop the channel at `index`, and return the message that tells the client.
+  fn close_channel(&mut self, index: usize, reason: &str) -> Chunk {
+    let id = self.outgoing.remove(index).id;
+    info!("{}: channel {id} closed: {reason}", self.addr);
+    self.channels.lock().unwrap().remove(&id);
+    let message = ServerMessage::Closed { channel: id, reason };
+    (message.to_message(), None)
+  }
+
+  /// The next chunk to send, if any channel has one ready.
+  fn next_chunk(&mut self) -> Option<Chunk> {
+    for i in 0..self.outgoing.len() {
+      let channel = &mut self.outgoing[i];
+      if channel.partial.is_none() {
+        let read = match channel.rx.try_recv() {
+          Ok(read) => read,
+          Err(mpsc::error::TryRecvError::Empty) => continue,
+          Err(mpsc::error::TryRecvError::Disconnected) => return Some(self.close_channel(i, "closed")),
+        };
+
+        let (data, flags) = match read.message {
+          Message::Binary(data) => (data, 0),
+          Message::Text(text) => (Bytes::from(text), FLAG_TEXT),
+          Message::Close(frame) => {
+            let reason = frame.map_or("closed".into(), |f| f.reason);
+            return Some(self.close_channel(i, &reason));
+          }
+          _ => continue,
+        };
+        channel.partial = Some(PartialRead {
+          data,
+          flags,
+          offset: 0,
+          last: read.last,
+        });
+      }
+
+      let partial = channel.partial.as_mut().unwrap();
+      let end = partial.data.len().min(partial.offset + CHUNK_SIZE);
+      let more = end < partial.data.len();
+
+      let mut chunk = BytesMut::with_capacity(HEADER_SIZE + end - partial.offset);
+      chunk.put_u8(channel.id);
+      chunk.put_u8(partial.flags | if more { FLAG_CONTINUED } else { 0 });
+      chunk.put_slice(&partial.data[partial.offset..end]);
+      let chunk = Message::Binary(chunk.freeze());
+
+      if more {
+        partial.offset = end;
+        return Some((chunk, None));
+      }
+
+      let last = partial.last;
+      channel.partial = None;
+      return Some((chunk, last.then(|| channel.socket.clone())));
+    }
+    None
+  }
+
+  async fn run(
+    mut self,
+    mut sink: SplitSink<WebSocketStream<Upgraded>, Message>,
+    mut events: mpsc::UnboundedReceiver<WriterEvent>,
+    notify: Arc<Notify>,
+  ) -> Result<()> {
+    loop {
+      while let Ok(event) = events.try_recv() {
+        if let Some(message) = self.handle_event(event) {
+          sink.send(message).await?;
+        }
+      }
+
+      if let Some((message, sent)) = self.next_chunk() {
+        sink.send(message).await?;
+        if let Some(socket) = sent {
+          socket.reads_sent();
+        }
+        continue;
+      }
+
+      tokio::select! {
+        event = events.recv() => match event {
+          Some(event) => {
+            if let Some(message) = self.handle_event(event) {
+              sink.send(message).await?;
+            }
+          }
+          None => return Ok(()),
+        },
+        _ = notify.notified() => {}
+      }
+    }
+  }
+}
+
+/// What opening a channel needs from the session, shared with opens that are still in progress.
+#[derive(Clone)]
+struct Session {
+  addr: SocketAddr,
+  channels: Channels,
+  events: mpsc::UnboundedSender<WriterEvent>,
+  notify: Arc<Notify>,
+}
+
+impl Session {
+  fn report_failure(&self, channel: u8, path: &str, reason: &str) {
+    error!("{}: failed to open channel {channel} ({path}): {reason}", self.addr);
+    let message = ServerMessage::Closed { channel, reason };
+    let _ = self.events.send(WriterEvent::Control(message.to_message()));
+  }
+
+  fn open_channel(&self, channel: u8, path: String, priority: Option<u8>) {
+    let fail = |reason: &str| self.report_failure(channel, &path, reason);
+
+    if self.channels.lock().unwrap().contains_key(&channel) {
+      return fail("channel already open");
+    }
+
+    let video_slot = match VideoSlot::claim(&path) {
+      Ok(slot) => slot,
+      Err(e) => return fail(&e.to_string()),
+    };
+
+    let Ok(c_path) = CString::new(path.as_str()) else {
+      return fail("invalid path");
+    };
+
+    // Takes the channel ID while the socket is being created.
+    self.channels.lock().unwrap().insert(
+      channel,
+      IncomingChannel {
+        socket: None,
+        tx: None,
+        _video_slot: video_slot,
+        queued: Vec::new(),
+        closed: false,
+      },
+    );
+
+    // Creating a socket can mean starting a pipeline, which would hold up every other channel's
+    // traffic if it was done here.
+    let session = self.clone();
+    tokio::spawn(async move {
+      let socket = tokio::task::spawn_blocking(move || unsafe {
+        OwnedSocket::from_raw(wardenclyffe_create_socket(c_path.as_ptr()))
+      })
+      .await
+      .ok()
+      .flatten();
+      session.finish_open(channel, &path, priority, socket);
+    });
+  }
+
+  /// Hook up a channel's socket once `open_channel` has created it.
+  fn finish_open(&self, channel: u8, path: &str, priority: Option<u8>, socket: Option<OwnedSocket>) {
+    let addr = self.addr;
+    let mut channels = self.channels.lock().unwrap();
+    let Some(socket) = socket.map(Arc::new) else {
+      channels.remove(&channel);
+      drop(channels);
+      return self.report_failure(channel, path, "failed to create socket");
+    };
+
+    let Some(incoming) = channels.get_mut(&channel) else {
+      socket.close();
+      return;
+    };
+    if incoming.closed {
+      socket.close();
+      channels.remove(&channel);
+      drop(channels);
+      info!("{addr}: channel {channel} closed before it opened");
+      let message = ServerMessage::Closed {
+        channel,
+        reason: "closed",
+      };
+      let _ = self.events.send(WriterEvent::Control(message.to_message()));
+      return;
+    }
+
+    let (tx, rx) = mpsc::channel(READ_QUEUE_DEPTH);
+    let tx = if socket.supports_read() {
+      let reader_socket = socket.clone();
+      let notify = self.notify.clone();
+      std::thread::Builder::new()
+        .name(format!("reader {addr}/{channel}"))
+        .spawn(move || {
+          read_loop(&reader_socket, addr, |read| {
+            let sent = tx.blocking_send(read).is_ok();
+            notify.notify_one();
+            sent
+          })
+        })
+        .expect("failed to spawn reader thread");
+      None
+    } else {
+      Some(tx)
+    };
+
+    incoming.socket = Some(socket.clone());
+    incoming.tx = tx;
+    let queued = std::mem::take(&mut incoming.queued);
+    if !queued.is_empty() && !socket.supports_write() {
+      info!("{addr}: channel {channel} doesn't take writes");
+    } else if queued.iter().any(|data| !socket.write(data)) {
+      incoming.close();
+    }
+    drop(channels);
+
+    info!("{addr}: opened channel {channel} ({path})");
+    let _ = self
+      .events
+      .send(WriterEvent::Control(ServerMessage::Opened { channel }.to_message()));
+    let _ = self.events.send(WriterEvent::Open(OutgoingChannel {
+      id: channel,
+      priority: priority.unwrap_or_else(|| default_priority(path)),
+      socket,
+      rx,
+      partial: None,
+    }));
+  }
+}
+
+pub async fn handle_session(ws_stream: WebSocketStream<Upgraded>, addr: SocketAddr) -> Result<()> {
+  info!("{addr}: session established");
+
+  let (sink, mut incoming) = ws_stream.split();
+  let channels: Channels = Default::default();
+  let notify = Arc::new(Notify::new());
+
+  let (events_tx, events_rx) = mpsc::unbounded_channel();
+  let writer = Writer {
+    addr,
+    channels: channels.clone(),
+    outgoing: Vec::new(),
+  };
+  let writer = writer.run(sink, events_rx, notify.clone());
+  let session = Session {
+    addr,
+    channels: channels.clone(),
+    events: events_tx,
+    notify,
+  };
+
+  let reader = async {
+    while let Some(message) = incoming.next().await {
+      match message? {
+        Message::Text(text) => match serde_json::from_str::<ClientMessage>(&text) {
+          Ok(ClientMessage::Open {
+            channel,
+            path,
+            priority,
+          }) => session.open_channel(channel, path, priority),
+          Ok(ClientMessage::Close { channel }) => {
+            if let Some(c) = channels.lock().unwrap().get_mut(&channel) {
+              c.close();
+            }
+          }
+          Err(e) => warn!("{addr}: invalid control message: {e}"),
+        },
+
+        Message::Binary(data) => {
+          if data.len() < HEADER_SIZE {
+            warn!("{addr}: dropping truncated message");
+            continue;
+          }
+
+          let channel = data[0];
+          let socket = {
+            let mut channels = channels.lock().unwrap();
+            match channels.get_mut(&channel) {
+              Some(c) if c.socket.is_none() => {
+                if c.queued.len() < MAX_QUEUED_WRITES {
+                  c.queued.push(data.slice(HEADER_SIZE..));
+                } else {
+                  warn!("{addr}: dropping message for channel {channel}, which is still opening");
+                }
+                continue;
+              }
+              Some(c) => c.socket.clone(),
+              None => None,
+            }
+          };
+          match socket {
+            Some(socket) if socket.supports_write() => {
+              // A socket that stops taking writes has shut down.
+              if !socket.write(&data[HEADER_SIZE..]) {
+                if let Some(c) = channels.lock().unwrap().get_mut(&channel) {
+                  c.close();
+                }
+              }
+            }
+            Some(_) => info!("{addr}: channel {channel} doesn't take writes"),
+            None => warn!("{addr}: message for unknown channel {channel}"),
+          }
+        }
+
+        Message::Close(_) => break,
+        _ => {}
+      }
+    }
+    Ok::<(), anyhow::Error>(())
+  };
+
+  let result = tokio::select! {
+    result = reader => result,
+    result = writer => result,
+  };
+
+  info!("{addr}: session ended");
+
+  // Unblock every reader thread. Sockets are destroyed once they let go.
+  for channel in channels.lock().unwrap().values_mut() {
+    channel.close();
+  }
+
+  result
+}
@@ -0,0 +1,409 @@
+//! WebRTC delivery of H.264 video, signaled with WHEP (WebRTC-HTTP Egress Protocol).
+//!
+//! A client POSTs an SDP offer to `/whep/video/h264/?<options>` and gets an answer back, with a
+//! Location header pointing at the session, which a DELETE tears down. ICE gathering is finished
+//! before answering, so there's no trickle ICE to deal with.
+//!
+//! Frames are packetized as RTP as they come out of the encoder, without re-encoding, and stamped
+//! with their capture timestamps, so the browser plays them at the pace they were captured. Unlike
+//! the WebSocket transport, a lost packet only holds up the frame it belongs to: the browser asks
+//! for it again with a NACK, which the default interceptors answer from their send buffer, and
+//! gives up with a PLI or FIR if that's not enough, which turns into a keyframe request. Receiver
+//! reports feed packet loss into the encoder's rate control, like the WebSocket clients' feedback.
+
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, OnceLock};
+
+use anyhow::{bail, Context, Result};
+use bytes::{Bytes, BytesMut};
+use hyper::body::HttpBody;
+use hyper::header::{HeaderValue, CONTENT_TYPE, LOCATION};
+use hyper::{Body, Method, Request, Response, StatusCode};
+use tokio::sync::mpsc;
+use webrtc::api::interceptor_registry::register_default_interceptors;
+use webrtc::api::media_engine::{MediaEngine, MIME_TYPE_H264};
+use webrtc::api::APIBuilder;
+use webrtc::interceptor::registry::Registry;
+use webrtc::peer_connection::configuration::RTCConfiguration;
+use webrtc::peer_connection::peer_connection_state::RTCPeerConnectionState;
+use webrtc::peer_connection::sdp::session_description::RTCSessionDescription;
+use webrtc::peer_connection::RTCPeerConnection;
+use webrtc::rtcp::payload_feedbacks::full_intra_request::FullIntraRequest;
+use webrtc::rtcp::payload_feedbacks::picture_loss_indication::PictureLossIndication;
+use webrtc::rtcp::receiver_report::ReceiverReport;
+use webrtc::rtp::codecs::h264::H264Payloader;
+use webrtc::rtp::header::Header;
+use webrtc::rtp::packet::Packet;
+use webrtc::rtp::packetizer::Payloader;
+use webrtc::rtp::sequence::{new_random_sequencer, Sequencer};
+use webrtc::rtp_transceiver::rtp_codec::RTCRtpCodecCapability;
+use webrtc::track::track_local::track_local_static_rtp::TrackLocalStaticRTP;
+use webrtc::track::track_local::{TrackLocal, TrackLocalWriter};
+
+use crate::ffi::*;
+use crate::limits::VideoSlot;
+use crate::server::READ_QUEUE_DEPTH;
+
+/// Size of the binary frame header, see FrameHeader.
+const FRAME_HEADER_SIZE: usize = 16;
+
+/// FrameHeader::type values.
+const FRAME_TYPE_DESCRIPTION: u8 = 0;
+const FRAME_TYPE_KEY: u8 = 1;
+
+/// H.264's RTP clock runs at 90 kHz.
+const RTP_CLOCK_RATE: i64 = 90_000;
+
+/// Leaves room for SRTP and the IP and UDP headers within a typical path MTU.
+const RTP_MTU: usize = 1200;
+
+/// Offers are a few kB of SDP, so anything much bigger isn't one.
+const MAX_OFFER_SIZE: usize = 64 * 1024;
+
+const KEYFRAME_REQUEST: &[u8] = br#"{"type":"keyframe"}"#;
+
+fn sessions() -> &'static Mutex<HashMap<u64, Arc<RTCPeerConnection>>> {
+  static SESSIONS: OnceLock<Mutex<HashMap<u64, Arc<RTCPeerConnection>>>> = OnceLock::new();
+  SESSIONS.get_or_init(Default::default)
+}
+
+fn status(status: StatusCode, body: &'static str) -> Response<Body> {
+  let mut response = Response::new(Body::from(body));
+  *response.status_mut() = status;
+  response
+}
+
+/// An encoded frame, with its capture timestamp in microseconds.
+struct Frame {
+  data: Bytes,
+  timestamp: i64,
+}
+
+/// Read frames from `socket` and hand them to `tx`, until EOF or until the session goes away. Codec
+/// configs are held back and sent along with the next keyframe.
+fn read_frames(socket: &OwnedSocket, session_id: u64, tx: mpsc::Sender<Frame>) {
+  let mut config: Option<Bytes> = None;
+  loop {
+    let reads = socket.read();
+    if reads.read_count < 0 {
+      error!(
+        "WHEP session {session_id}: WardenclyffeSocket::read failed: rc = {}",
+        reads.read_count
+      );
+      return;
+    } else if reads.read_count == 0 {
+      info!("WHEP session {session_id}: WardenclyffeSocket hit EOF");
+      return;
+    }
+
+    let reads = unsafe { std::slice::from_raw_parts(reads.reads, reads.read_count as usize) };
+    let mut frames = Vec::new();
+    for read in reads {
+      let data = unsafe { read.into_bytes() };
+      if read.oob != 0 || data.len() < FRAME_HEADER_SIZE {
+        continue;
+      }
+
+      let frame_type = data[1];
+      let timestamp = i64::from_le_bytes(data[8..16].try_into().unwrap());
+      let payload = data.slice(FRAME_HEADER_SIZE..);
+      if frame_type == FRAME_TYPE_DESCRIPTION {
+        config = Some(payload);
+        continue;
+      }
+
+      // The payloader bundles SPS and PPS up with the IDR that follows them.
+      let payload = match (&config, frame_type) {
+        (Some(config), FRAME_TYPE_KEY) => {
+          let mut buf = BytesMut::with_capacity(config.len() + payload.len());
+          buf.extend_from_slice(config);
+          buf.extend_from_slice(&payload);
+          buf.freeze()
+        }
+        _ => payload,
+      };
+
+      frames.push(Frame {
+        data: payload,
+        timestamp,
+      });
+    }
+
+    if frames.is_empty() {
+      socket.reads_sent();
+      continue;
+    }
+    for frame in frames {
+      if tx.blocking_send(frame).is_err() {
+        return;
+      }
+    }
+  }
+}
+
+/// Packetizes frames for `track`, each stamped with its own capture time.
+struct RtpWriter {
+  track: Arc<TrackLocalStaticRTP>,
+  payloader: H264Payloader,
+  sequencer: Box<dyn Sequencer + Send + Sync>,
+}
+
+impl RtpWriter {
+  fn new(track: Arc<TrackLocalStaticRTP>) -> Self {
+    Self {
+      track,
+      payloader: H264Payloader::default(),
+      sequencer: Box::new(new_random_sequencer()),
+    }
+  }
+
+  async fn write(&mut self, frame: &Frame) -> Result<()> {
+    // RTP timestamps wrap around, and only their differences matter.
+    let timestamp = (frame.timestamp * RTP_CLOCK_RATE / 1_000_000) as u32;
+    let payloads = self.payloader.payload(RTP_MTU, &frame.data)?;
+    let last = payloads.len().saturating_sub(1);
+    for (index, payload) in payloads.into_iter().enumerate() {
+      // The track fills in the payload type and SSRC that were negotiated.
+      let packet = Packet {
+        header: Header {
+          version: 2,
+          marker: index == last,
+          sequence_number: self.sequencer.next_sequence_number(),
+          timestamp,
+          ..Default::default()
+        },
+        payload,
+      };
+      self.track.write_rtp(&packet).await?;
+    }
+    Ok(())
+  }
+}
+
+/// Read the request body, or None if it's over `MAX_OFFER_SIZE`.
+async fn read_offer(mut body: Body) -> Result<Option<Bytes>> {
+  let mut offer = BytesMut::new();
+  while let Some(chunk) = body.data().await {
+    let chunk = chunk?;
+    if offer.len() + chunk.len() > MAX_OFFER_SIZE {
+      return Ok(None);
+    }
+    offer.extend_from_slice(&chunk);
+  }
+  Ok(Some(offer.freeze()))
+}
+
+/// Turn RTCP feedback from the client into control messages for the socket.
+fn handle_rtcp(socket: &OwnedSocket, packets: &[Box<dyn webrtc::rtcp::packet::Packet + Send + Sync>]) {
+  for packet in packets {
+    let packet = packet.as_any();
+    if packet.is::<PictureLossIndication>() || packet.is::<FullIntraRequest>() {
+      debug!("received keyframe request");
+      socket.write(KEYFRAME_REQUEST);
+    } else if let Some(receiver_report) = packet.downcast_ref::<ReceiverReport>() {
+      for report in &receiver_report.reports {
+        let packet_loss = report.fraction_lost as f64 / 256.0;
+        socket.write(format!(r#"{{"type":"feedback","packetLoss":{packet_loss}}}"#).as_bytes());
+      }
+    }
+  }
+}
+
+/// Answer `offer`, with ICE gathering finished.
+async fn negotiate(peer_connection: &RTCPeerConnection, offer: String) -> Result<RTCSessionDescription> {
+  peer_connection
+    .set_remote_description(RTCSessionDescription::offer(offer)?)
+    .await?;
+  let answer = peer_connection.create_answer(None).await?;
+  let mut gathering_complete = peer_connection.gathering_complete_promise().await;
+  peer_connection.set_local_description(answer).await?;
+  let _ = gathering_complete.recv().await;
+  peer_connection
+    .local_description()
+    .await
+    .context("no local description")
+}
+
+async fn start_session(path: &str, offer: String, slot: Option<VideoSlot>) -> Result<(u64, String)> {
+  // H.264 is the one codec that every browser can take over RTP.
+  if !path.starts_with("/video/h264/") {
+    bail!("unsupported WHEP path {path}");
+  }
+  let path = if path.contains('?') {
+    format!("{path}&header=binary")
+  } else {
+    format!("{path}?header=binary")
+  };
+  let path = CString::new(path)?;
+
+  let mut media_engine = MediaEngine::default();
+  media_engine.register_default_codecs()?;
+  let registry = register_default_interceptors(Registry::new(), &mut media_engine)?;
+  let api = APIBuilder::new()
+    .with_media_engine(media_engine)
+    .with_interceptor_registry(registry)
+    .build();
+  let peer_connection = Arc::new(api.new_peer_connection(RTCConfiguration::default()).await?);
+
+  let track = Arc::new(TrackLocalStaticRTP::new(
+    RTCRtpCodecCapability {
+      mime_type: MIME_TYPE_H264.to_owned(),
+      clock_rate: 90000,
+      sdp_fmtp_line: "level-asymmetry-allowed=1;packetization-mode=1;profile-level-id=4d0029".to_owned(),
+      ..Default::default()
+    },
+    "video".to_owned(),
+    "wardenclyffe".to_owned(),
+  ));
+  let rtp_sender = peer_connection
+    .add_track(Arc::clone(&track) as Arc<dyn TrackLocal + Send + Sync>)
+    .await?;
+
+  // Negotiate before there's a stream to tear down, so that a bad offer only costs a peer
+  // connection. Nothing holds on to the socket until this has succeeded.
+  let answer = match negotiate(&peer_connection, offer).await {
+    Ok(answer) => answer,
+    Err(e) => {
+      let _ = peer_connection.close().await;
+      return Err(e);
+    }
+  };
+
+  // Starting a pipeline blocks for a while.
+  let socket =
+    tokio::task::spawn_blocking(move || unsafe { OwnedSocket::from_raw(wardenclyffe_create_socket(path.as_ptr())) })
+      .await?;
+  let Some(socket) = socket.map(Arc::new) else {
+    let _ = peer_connection.close().await;
+    bail!("failed to create socket");
+  };
+
+  let session_id = {
+    static NEXT_SESSION_ID: AtomicU64 = AtomicU64::new(1);
+    NEXT_SESSION_ID.fetch_add(1, Ordering::Relaxed)
+  };
+
+  let rtcp_socket = socket.clone();
+  tokio::spawn(async move {
+    while let Ok((packets, _)) = rtp_sender.read_rtcp().await {
+      handle_rtcp(&rtcp_socket, &packets);
+    }
+  });
+
+  let state_socket = socket.clone();
+  peer_connection.on_peer_connection_state_change(Box::new(move |state| {
+    info!("WHEP session {session_id}: {state}");
+    match state {
+      // Anything sent before now went nowhere, so start over from a keyframe.
+      RTCPeerConnectionState::Connected => {
+        state_socket.write(KEYFRAME_REQUEST);
+      }
+      RTCPeerConnectionState::Failed | RTCPeerConnectionState::Closed => {
+        state_socket.close();
+        sessions().lock().unwrap().remove(&session_id);
+      }
+      _ => {}
+    }
+    Box::pin(async {})
+  }));
+
+  // Registered before the writer starts, so that it can't go away before it's been added.
+  sessions()
+    .lock()
+    .unwrap()
+    .insert(session_id, Arc::clone(&peer_connection));
+
+  let (tx, mut rx) = mpsc::channel(READ_QUEUE_DEPTH);
+  let reader_socket = socket.clone();
+  std::thread::Builder::new()
+    .name(format!("WHEP reader {session_id}"))
+    .spawn(move || read_frames(&reader_socket, session_id, tx))
+    .expect("failed to spawn reader thread");
+
+  // The stream lasts as long as the writer does, and so does the session.
+  let writer_socket = socket;
+  tokio::spawn(async move {
+    let _slot = slot;
+    let mut writer = RtpWriter::new(track);
+    while let Some(frame) = rx.recv().await {
+      if let Err(e) = writer.write(&frame).await {
+        error!("WHEP session {session_id}: failed to send: {e}");
+        break;
+      }
+      writer_socket.reads_sent();
+    }
+    writer_socket.close();
+    sessions().lock().unwrap().remove(&session_id);
+    if let Err(e) = peer_connection.close().await {
+      warn!("WHEP session {session_id}: failed to close peer connection: {e}");
+    }
+  });
+
+  Ok((session_id, answer.sdp))
+}
+
+/// Handle a request under `/whep/`: POST an offer to a video path to start a session, or DELETE
+/// the session's URL to stop it.
+pub async fn handle_request(req: Request<Body>) -> Result<Response<Body>> {
+  let Some(path) = req
+    .uri()
+    .path_and_query()
+    .and_then(|p| p.as_str().strip_prefix("/whep"))
+  else {
+    return Ok(status(StatusCode::NOT_FOUND, "Not found"));
+  };
+  let path = path.to_string();
+
+  match *req.method() {
+    Method::POST => {
+      let mime_type = req.headers().get(CONTENT_TYPE).and_then(|h| h.to_str().ok());
+      if mime_type != Some("application/sdp") {
+        return Ok(status(StatusCode::UNSUPPORTED_MEDIA_TYPE, "Expected application/sdp"));
+      }
+
+      let slot = match VideoSlot::claim(&path) {
+        Ok(slot) => slot,
+        Err(e) => {
+          warn!("rejecting WHEP session for {path}: {e}");
+          return Ok(e.into_response());
+        }
+      };
+
+      let Some(offer) = read_offer(req.into_body()).await? else {
+        return Ok(status(StatusCode::PAYLOAD_TOO_LARGE, "Offer too large"));
+      };
+      let Ok(offer) = String::from_utf8(offer.to_vec()) else {
+        return Ok(status(StatusCode::BAD_REQUEST, "Bad request"));
+      };
+
+      let (session_id, answer) = match start_session(&path, offer, slot).await {
+        Ok(session) => session,
+        Err(e) => {
+          error!("failed to start WHEP session for {path}: {e:?}");
+          return Ok(status(StatusCode::BAD_REQUEST, "Bad request"));
+        }
+      };
+
+      let mut response = Response::new(Body::from(answer));
+      *response.status_mut() = StatusCode::CREATED;
+      let headers = response.headers_mut();
+      headers.insert(CONTENT_TYPE, HeaderValue::from_static("application/sdp"));
+      headers.insert(LOCATION, HeaderValue::from_str(&format!("/whep/session/{session_id}"))?);
+      Ok(response)
+    }
+
+    Method::DELETE => {
+      let session_id = path.strip_prefix("/session/").and_then(|id| id.parse::<u64>().ok());
+      let peer_connection = session_id.and_then(|id| sessions().lock().unwrap().remove(&id));
+      let Some(peer_connection) = peer_connection else {
+        return Ok(status(StatusCode::NOT_FOUND, "No such session"));
+      };
+      peer_connection.close().await?;
+      Ok(status(StatusCode::OK, ""))
+    }
+
+    _ => Ok(status(StatusCode::METHOD_NOT_ALLOWED, "Method not allowed")),
+  }
+}